@@ -0,0 +1,163 @@
+/*
+ * acceptor.c: acceptor threads on SO_REUSEPORT sockets (see acceptor.h).
+ */
+
+#define _GNU_SOURCE	/* for accept4 */
+#include <netinet/tcp.h>
+#include "common.h"
+#include "acceptor.h"
+#include "server_thread.h"
+
+struct acceptor {
+	struct acceptors *acc;
+	int group;		/* of workers, in the server */
+	int listenfd;
+	pthread_t thread;
+	long nr_accepted;
+};
+
+struct acceptors {
+	struct server *sv;
+	int flags;		/* for accept4 */
+	int stopfd[2];		/* a pipe, readable once we are stopping */
+	int nr;
+	struct acceptor *acceptors;
+};
+
+int
+acceptor_parse(const char *spec, struct acceptor_options *ao)
+{
+	char buf[MAXLINE], *opt, *save;
+
+	ao->nr = 0;
+	ao->backlog = LISTENQ;
+	ao->defer_secs = 0;
+	ao->flags = 0;
+	snprintf(buf, sizeof(buf), "%s", spec);
+	opt = strtok_r(buf, ",", &save);
+	if (!opt || sscanf(opt, "%d", &ao->nr) != 1 || ao->nr <= 0) {
+		fprintf(stderr, "bad number of acceptors: %s\n", spec);
+		return 0;
+	}
+	while ((opt = strtok_r(NULL, ",", &save))) {
+		if (sscanf(opt, "backlog=%d", &ao->backlog) == 1 &&
+		    ao->backlog > 0)
+			continue;
+		if (sscanf(opt, "defer=%d", &ao->defer_secs) == 1 &&
+		    ao->defer_secs >= 0)
+			continue;
+		if (strcmp(opt, "nonblock") == 0) {
+			ao->flags |= SOCK_NONBLOCK;
+			continue;
+		}
+		if (strcmp(opt, "cloexec") == 0) {
+			ao->flags |= SOCK_CLOEXEC;
+			continue;
+		}
+		fprintf(stderr, "bad acceptor option: %s\n", opt);
+		return 0;
+	}
+	return 1;
+}
+
+static void *
+acceptor_thread(void *arg)
+{
+	struct acceptor *a = (struct acceptor *)arg;
+	struct pollfd fds[2];
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	int connfd;
+
+	fds[0].fd = a->listenfd;
+	fds[0].events = POLLIN;
+	fds[1].fd = a->acc->stopfd[0];
+	fds[1].events = POLLIN;
+	while (1) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			unix_error("poll error");
+		}
+		if (fds[1].revents)
+			break;
+		/* take all the connections waiting before polling again */
+		while ((connfd = accept4(a->listenfd, (struct sockaddr *)&addr,
+					 &len, a->acc->flags)) >= 0) {
+			a->nr_accepted++;
+			server_request(a->acc->sv, a->group, connfd,
+				       (struct sockaddr *)&addr);
+			len = sizeof(addr);
+		}
+		/* the listen socket does not block, and a client may have
+		 * given up before we got to it */
+		if (errno != EAGAIN && errno != EWOULDBLOCK &&
+		    errno != ECONNABORTED && errno != EPROTO && errno != EINTR)
+			unix_error("accept4 error");
+	}
+	return NULL;
+}
+
+struct acceptors *
+acceptors_init(const struct acceptor_options *ao, int port,
+	       struct server *sv)
+{
+	struct acceptors *acc;
+	struct acceptor *a;
+	int i, flags;
+
+	acc = Malloc(sizeof(struct acceptors));
+	acc->sv = sv;
+	acc->flags = ao->flags;
+	acc->nr = ao->nr;
+	SYS(pipe(acc->stopfd));
+	acc->acceptors = Malloc(ao->nr * sizeof(struct acceptor));
+	for (i = 0; i < ao->nr; i++) {
+		a = &acc->acceptors[i];
+		a->acc = acc;
+		a->group = i;
+		a->nr_accepted = 0;
+		a->listenfd = open_listenfd_opts(port, ao->backlog, 1);
+		if (ao->defer_secs > 0)
+			SYS(setsockopt(a->listenfd, IPPROTO_TCP,
+				       TCP_DEFER_ACCEPT, &ao->defer_secs,
+				       sizeof(int)));
+		SYS(flags = fcntl(a->listenfd, F_GETFL, 0));
+		SYS(fcntl(a->listenfd, F_SETFL, flags | O_NONBLOCK));
+	}
+	/* all the sockets are bound before any connection is accepted */
+	for (i = 0; i < ao->nr; i++) {
+		a = &acc->acceptors[i];
+		pthread_create(&a->thread, NULL, acceptor_thread, a);
+	}
+	return acc;
+}
+
+void
+acceptors_print_stats(struct acceptors *acc, FILE *out)
+{
+	int i;
+
+	fprintf(out, "acceptors accepted");
+	for (i = 0; i < acc->nr; i++)
+		fprintf(out, " %ld", acc->acceptors[i].nr_accepted);
+	fprintf(out, "\n");
+}
+
+void
+acceptors_exit(struct acceptors *acc)
+{
+	int i;
+
+	/* an acceptor waiting for room in its queue goes on until the
+	 * workers, which are still running, make some */
+	SYS(write(acc->stopfd[1], "x", 1));
+	for (i = 0; i < acc->nr; i++)
+		pthread_join(acc->acceptors[i].thread, NULL);
+	for (i = 0; i < acc->nr; i++)
+		SYS(close(acc->acceptors[i].listenfd));
+	SYS(close(acc->stopfd[0]));
+	SYS(close(acc->stopfd[1]));
+	free(acc->acceptors);
+	free(acc);
+}
@@ -0,0 +1,47 @@
+#ifndef __ACCEPTOR_H__
+#define __ACCEPTOR_H__
+
+#include <stdio.h>
+
+/* Acceptor threads, in place of the main thread's accept loop, which is a
+ * bottleneck when requests are short. Each acceptor has a listen socket of
+ * its own, bound to the same port with SO_REUSEPORT, so that the kernel
+ * shares the incoming connections out among the sockets by a hash of their
+ * addresses, and the acceptors don't contend for one queue of connections.
+ * An acceptor hands what it accepts to its own group of workers (see
+ * server_options), so that the rate at which connections are taken on
+ * scales with the number of acceptors and cores.
+ *
+ * The options are given as the number of acceptors, optionally followed by
+ * a comma separated list of:
+ *	backlog=N	connections each socket may hold not yet accepted,
+ *			default LISTENQ
+ *	defer=SECS	TCP_DEFER_ACCEPT: don't wake the acceptor until the
+ *			client has sent its request, for up to SECS. Default
+ *			0, off.
+ *	nonblock	accept connections with SOCK_NONBLOCK, saving the event
+ *			loops a system call. Needs event loops.
+ *	cloexec		accept connections with SOCK_CLOEXEC */
+
+struct acceptor_options {
+	int nr;			/* acceptor threads */
+	int backlog;
+	int defer_secs;
+	int flags;		/* for accept4 */
+};
+
+struct acceptors;
+struct server;
+
+/* fills in ao from spec. Returns 0 if spec is malformed. */
+int acceptor_parse(const char *spec, struct acceptor_options *ao);
+/* opens ao->nr listen sockets on port, and starts an acceptor thread on
+ * each, the i-th handing connections to group i of sv */
+struct acceptors *acceptors_init(const struct acceptor_options *ao, int port,
+				 struct server *sv);
+/* prints the connections accepted by each acceptor */
+void acceptors_print_stats(struct acceptors *acc, FILE *out);
+/* stops the acceptors, and closes their listen sockets */
+void acceptors_exit(struct acceptors *acc);
+
+#endif /* __ACCEPTOR_H__ */
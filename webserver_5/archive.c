@@ -0,0 +1,140 @@
+/*
+ * archive.c: serving files from an archive built by pack (see archive.h).
+ */
+
+#include "common.h"
+#include "archive.h"
+#include "pack.h"
+
+struct archive {
+	char *map;
+	size_t size;
+	const struct pack_header *hdr;
+	const uint32_t *disp;
+	const struct pack_entry *entries;
+	struct file_data *files; /* one for each entry */
+	long hits, misses;
+};
+
+/* checks that the header and index of the archive are within the mapping,
+ * so that lookups need not */
+static int
+archive_check(struct archive *a)
+{
+	const struct pack_header *hdr = a->hdr;
+	const struct pack_entry *e;
+	size_t meta;
+	uint32_t i;
+
+	if (a->size < sizeof(*hdr) || hdr->magic != PACK_MAGIC ||
+	    hdr->version != PACK_VERSION || hdr->size != a->size ||
+	    hdr->nr_files == 0 || hdr->nr_buckets == 0)
+		return 0;
+	meta = sizeof(*hdr) + (size_t)hdr->nr_buckets * sizeof(uint32_t) +
+		(size_t)hdr->nr_files * sizeof(struct pack_entry);
+	if (meta > a->size)
+		return 0;
+	for (i = 0; i < hdr->nr_files; i++) {
+		e = &a->entries[i];
+		if (e->name_off < meta || e->name_off >= a->size ||
+		    e->name_len >= a->size - e->name_off ||
+		    a->map[e->name_off + e->name_len] != 0 ||
+		    e->offset > a->size || e->size > a->size - e->offset)
+			return 0;
+	}
+	return 1;
+}
+
+struct archive *
+archive_open(const char *path)
+{
+	struct archive *a;
+	struct stat sbuf;
+	struct file_data *data;
+	const struct pack_entry *e;
+	uint32_t i;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY, 0)) < 0 || fstat(fd, &sbuf) < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	a = Malloc(sizeof(struct archive));
+	a->size = sbuf.st_size;
+	a->map = mmap(NULL, a->size, PROT_READ, MAP_SHARED, fd, 0);
+	SYS(close(fd));
+	if (a->size == 0 || a->map == MAP_FAILED) {
+		fprintf(stderr, "%s: can't map the archive\n", path);
+		free(a);
+		return NULL;
+	}
+	a->hdr = (const struct pack_header *)a->map;
+	a->disp = (const uint32_t *)(a->hdr + 1);
+	a->entries = (const struct pack_entry *)(a->disp +
+						 a->hdr->nr_buckets);
+	if (!archive_check(a)) {
+		fprintf(stderr, "%s: not an archive built by pack\n", path);
+		munmap(a->map, a->size);
+		free(a);
+		return NULL;
+	}
+
+	/* the archive holds the only reference to its file data until it is
+	 * closed */
+	a->files = Malloc(a->hdr->nr_files * sizeof(struct file_data));
+	for (i = 0; i < a->hdr->nr_files; i++) {
+		e = &a->entries[i];
+		data = &a->files[i];
+		memset(data, 0, sizeof(*data));
+		data->file_name = a->map + e->name_off;
+		data->file_buf = a->map + e->offset;
+		data->file_size = e->size;
+		data->file_mtime.tv_sec = e->mtime_sec;
+		data->file_mtime.tv_nsec = e->mtime_nsec;
+		data->file_csum = e->csum;
+		data->refs = 1;
+	}
+	a->hits = a->misses = 0;
+	return a;
+}
+
+struct file_data *
+archive_lookup(struct archive *a, const char *name)
+{
+	const struct pack_entry *e;
+	uint32_t slot;
+	int len;
+
+	/* names are kept without the ./ and / that request_parse_URI adds */
+	while (*name == '.' && name[1] == '/')
+		name += 2;
+	while (*name == '/')
+		name++;
+	len = strlen(name);
+	slot = pack_hash(name, len, a->disp[pack_hash(name, len, 0) %
+					     a->hdr->nr_buckets]) %
+		a->hdr->nr_files;
+	e = &a->entries[slot];
+	if (e->name_len != len || memcmp(a->map + e->name_off, name, len)) {
+		__sync_add_and_fetch(&a->misses, 1);
+		return NULL;
+	}
+	__sync_add_and_fetch(&a->hits, 1);
+	file_data_ref(&a->files[slot]);
+	return &a->files[slot];
+}
+
+void
+archive_print_stats(struct archive *a, FILE *out)
+{
+	fprintf(out, "archive files %u hits %ld misses %ld\n",
+		a->hdr->nr_files, a->hits, a->misses);
+}
+
+void
+archive_close(struct archive *a)
+{
+	munmap(a->map, a->size);
+	free(a->files);
+	free(a);
+}
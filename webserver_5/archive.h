@@ -0,0 +1,27 @@
+#ifndef __ARCHIVE_H__
+#define __ARCHIVE_H__
+
+#include <stdio.h>
+#include "request.h"
+
+/* Serving files from an archive built by pack (see pack.h). The archive is
+ * mapped once, and each of its files gets a file_data pointing into the
+ * mapping, so a request for one of them takes one hash probe and no system
+ * calls, as a cache hit does. The file data is never evicted, and is not
+ * compressed. */
+
+struct archive;
+
+/* returns NULL, after printing why, if the archive can't be used */
+struct archive *archive_open(const char *path);
+/* returns the file data of the file named name, as request_parse_URI makes
+ * it, with a reference for the caller, or NULL if it is not in the
+ * archive */
+struct file_data *archive_lookup(struct archive *a, const char *name);
+/* prints the number of lookups that found their file, and those that did
+ * not */
+void archive_print_stats(struct archive *a, FILE *out);
+/* all references to the archive's file data must have been dropped */
+void archive_close(struct archive *a);
+
+#endif /* __ARCHIVE_H__ */
@@ -0,0 +1,95 @@
+/*
+ * arena.c: per-request bump allocation.
+ */
+
+#include "common.h"
+#include "arena.h"
+
+#define ARENA_CHUNK (16 * 1024)
+#define ARENA_ALIGN 16
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;			/* bytes in mem */
+	size_t used;
+	char mem[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+void
+arena_init(struct arena *a)
+{
+	a->head = NULL;
+	a->cur = NULL;
+}
+
+static struct arena_chunk *
+arena_chunk_new(size_t size)
+{
+	struct arena_chunk *ch;
+
+	if (size < ARENA_CHUNK)
+		size = ARENA_CHUNK;
+	ch = Malloc(sizeof(struct arena_chunk) + size);
+	ch->next = NULL;
+	ch->size = size;
+	ch->used = 0;
+	return ch;
+}
+
+void *
+arena_alloc(struct arena *a, size_t size)
+{
+	struct arena_chunk *ch;
+	void *p;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (!a->cur) {
+		a->head = a->cur = arena_chunk_new(size);
+	}
+	/* move on to the next chunk that fits, adding one at the end if none
+	 * does. Chunks are never reordered, so a reset starts from head. */
+	ch = a->cur;
+	while (ch->size - ch->used < size) {
+		if (!ch->next)
+			ch->next = arena_chunk_new(size);
+		ch = ch->next;
+		ch->used = 0;
+	}
+	a->cur = ch;
+	p = ch->mem + ch->used;
+	ch->used += size;
+	return p;
+}
+
+void *
+arena_realloc(struct arena *a, void *old, size_t old_size, size_t size)
+{
+	void *p;
+
+	if (size <= old_size)
+		return old;
+	p = arena_alloc(a, size);
+	if (old)
+		memcpy(p, old, old_size);
+	return p;
+}
+
+void
+arena_reset(struct arena *a)
+{
+	if (a->head)
+		a->head->used = 0;
+	a->cur = a->head;
+}
+
+void
+arena_destroy(struct arena *a)
+{
+	struct arena_chunk *ch, *next;
+
+	for (ch = a->head; ch; ch = next) {
+		next = ch->next;
+		free(ch);
+	}
+	a->head = a->cur = NULL;
+}
@@ -0,0 +1,27 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+/* A bump allocator for objects that die together at the end of a request,
+ * such as the request itself and its staged response. Each worker (or, in
+ * event loop mode, each connection) owns an arena and resets it once the
+ * request is done. The memory is kept across resets, so after the first few
+ * requests allocation never reaches malloc. */
+
+struct arena_chunk;
+
+struct arena {
+	struct arena_chunk *head;	/* all chunks, kept across resets */
+	struct arena_chunk *cur;	/* chunk being allocated from */
+};
+
+void arena_init(struct arena *a);
+void *arena_alloc(struct arena *a, size_t size);
+/* grows an allocation. The old copy is only reclaimed by arena_reset. */
+void *arena_realloc(struct arena *a, void *old, size_t old_size,
+		    size_t size);
+void arena_reset(struct arena *a);
+void arena_destroy(struct arena *a);
+
+#endif /* __ARENA_H__ */
@@ -0,0 +1,392 @@
+/*
+ * bufpool.c: size-classed freelists.
+ *
+ * Each buffer is preceded by a small header recording its class, so that
+ * bufpool_free does not need to be told the size. Aligned buffers have no
+ * header, which would cost them a page of its own: their classes are kept in
+ * a table by address, which bufpool_free only looks at for buffers that
+ * start on a page.
+ *
+ * Each thread keeps a few free buffers of each of the smaller classes in a
+ * cache of its own, and only takes the lock of a class to move half a cache
+ * at a time between it and the class's shared freelist. The shared
+ * freelists of all classes together keep at most BUFPOOL_FREE_BYTES, and
+ * the buffers freed past that go back to malloc.
+ */
+
+#include <malloc.h>
+#include <stdint.h>
+#include "common.h"
+#include "bufpool.h"
+
+#define BUFPOOL_MIN_SHIFT 6	/* smallest class is 64 bytes */
+#define BUFPOOL_NR_CLASSES 21	/* largest class is 64 MB */
+#define BUFPOOL_FREE_BYTES (64 * 1024 * 1024)
+#define BUFPOOL_TCACHE 8	/* free buffers of a class a thread keeps */
+#define BUFPOOL_TCACHE_CLASSES 11 /* classes up to 64 KB are kept */
+#define BUFPOOL_LARGE -1	/* class of buffers that bypass the pool */
+#define BUFPOOL_ALIGNED_BUCKETS 256
+
+/* keeps the buffer that follows 16-byte aligned, like malloc */
+union bufpool_hdr {
+	int cls;
+	union bufpool_hdr *next;	/* while on a freelist */
+	long double align;
+};
+
+struct bufpool_class {
+	pthread_mutex_t lock;
+	union bufpool_hdr *free;
+	int nr_free;
+};
+
+/* the free buffers a thread keeps, of the classes below
+ * BUFPOOL_TCACHE_CLASSES */
+struct bufpool_tcache {
+	union bufpool_hdr *free[BUFPOOL_TCACHE_CLASSES];
+	int nr_free[BUFPOOL_TCACHE_CLASSES];
+};
+
+/* an aligned buffer, in the table, from the time it is allocated until it
+ * goes back to malloc */
+struct bufpool_aligned {
+	void *buf;
+	int cls;
+	struct bufpool_aligned *next;	/* in its bucket */
+};
+
+static struct bufpool_class classes[BUFPOOL_NR_CLASSES];
+static struct bufpool_class aligned[BUFPOOL_NR_CLASSES];
+static struct bufpool_aligned *aligned_table[BUFPOOL_ALIGNED_BUCKETS];
+static pthread_mutex_t aligned_lock = PTHREAD_MUTEX_INITIALIZER;
+static long free_bytes;		/* on the shared freelists */
+static pthread_once_t bufpool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tcache_key; /* empties the cache of a thread that exits */
+static __thread struct bufpool_tcache *tcache;
+
+static size_t
+bufpool_class_size(int cls)
+{
+	return (size_t)1 << (cls + BUFPOOL_MIN_SHIFT);
+}
+
+/* puts h, of class c of size bytes, on the shared freelist of c. Returns 0
+ * if the freelists are full. Called with c->lock held. */
+static int
+bufpool_put(struct bufpool_class *c, union bufpool_hdr *h, size_t size)
+{
+	if (__atomic_add_fetch(&free_bytes, size, __ATOMIC_RELAXED) >
+	    BUFPOOL_FREE_BYTES) {
+		__atomic_sub_fetch(&free_bytes, size, __ATOMIC_RELAXED);
+		return 0;
+	}
+	h->next = c->free;
+	c->free = h;
+	c->nr_free++;
+	return 1;
+}
+
+/* takes a buffer of class c, of size bytes, off its shared freelist, or
+ * returns NULL. Called with c->lock held. */
+static union bufpool_hdr *
+bufpool_get(struct bufpool_class *c, size_t size)
+{
+	union bufpool_hdr *h;
+
+	if ((h = c->free)) {
+		c->free = h->next;
+		c->nr_free--;
+		__atomic_sub_fetch(&free_bytes, size, __ATOMIC_RELAXED);
+	}
+	return h;
+}
+
+/* moves n buffers of class cls from the cache of a thread to the shared
+ * freelist, freeing those it has no room for */
+static void
+bufpool_spill(struct bufpool_tcache *tc, int cls, int n)
+{
+	struct bufpool_class *c = &classes[cls];
+	union bufpool_hdr *h, *full = NULL;
+
+	pthread_mutex_lock(&c->lock);
+	while (n-- > 0 && (h = tc->free[cls])) {
+		tc->free[cls] = h->next;
+		tc->nr_free[cls]--;
+		if (!bufpool_put(c, h, bufpool_class_size(cls))) {
+			h->next = full;
+			full = h;
+		}
+	}
+	pthread_mutex_unlock(&c->lock);
+	while ((h = full)) {
+		full = h->next;
+		free(h);
+	}
+}
+
+/* moves up to half a cache of buffers of class cls from the shared freelist
+ * to the cache of a thread */
+static void
+bufpool_refill(struct bufpool_tcache *tc, int cls)
+{
+	struct bufpool_class *c = &classes[cls];
+	union bufpool_hdr *h;
+	int n = BUFPOOL_TCACHE / 2;
+
+	pthread_mutex_lock(&c->lock);
+	while (n-- > 0 && (h = bufpool_get(c, bufpool_class_size(cls)))) {
+		h->next = tc->free[cls];
+		tc->free[cls] = h;
+		tc->nr_free[cls]++;
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+static void
+bufpool_tcache_free(void *arg)
+{
+	struct bufpool_tcache *tc = (struct bufpool_tcache *)arg;
+	int i;
+
+	for (i = 0; i < BUFPOOL_TCACHE_CLASSES; i++)
+		bufpool_spill(tc, i, BUFPOOL_TCACHE);
+	free(tc);
+}
+
+static struct bufpool_tcache *
+bufpool_tcache(void)
+{
+	if (!tcache) {
+		tcache = Malloc(sizeof(struct bufpool_tcache));
+		memset(tcache, 0, sizeof(struct bufpool_tcache));
+		pthread_setspecific(tcache_key, tcache);
+	}
+	return tcache;
+}
+
+static void
+bufpool_class_init(struct bufpool_class *c)
+{
+	pthread_mutex_init(&c->lock, NULL);
+	c->free = NULL;
+	c->nr_free = 0;
+}
+
+static void
+bufpool_init(void)
+{
+	int i;
+
+	for (i = 0; i < BUFPOOL_NR_CLASSES; i++) {
+		bufpool_class_init(&classes[i]);
+		bufpool_class_init(&aligned[i]);
+	}
+	pthread_key_create(&tcache_key, bufpool_tcache_free);
+}
+
+static int
+bufpool_class(size_t size)
+{
+	int cls = 0;
+
+	while (((size_t)1 << (cls + BUFPOOL_MIN_SHIFT)) < size) {
+		cls++;
+		if (cls == BUFPOOL_NR_CLASSES)
+			return BUFPOOL_LARGE;
+	}
+	return cls;
+}
+
+void *
+bufpool_alloc(size_t size)
+{
+	struct bufpool_tcache *tc;
+	struct bufpool_class *c;
+	union bufpool_hdr *h = NULL;
+	int cls;
+
+	pthread_once(&bufpool_once, bufpool_init);
+	cls = bufpool_class(size);
+	if (cls == BUFPOOL_LARGE) {
+		h = Malloc(sizeof(*h) + size);
+	} else if (cls < BUFPOOL_TCACHE_CLASSES) {
+		tc = bufpool_tcache();
+		if (!tc->free[cls])
+			bufpool_refill(tc, cls);
+		if ((h = tc->free[cls])) {
+			tc->free[cls] = h->next;
+			tc->nr_free[cls]--;
+		}
+	} else {
+		c = &classes[cls];
+		pthread_mutex_lock(&c->lock);
+		h = bufpool_get(c, bufpool_class_size(cls));
+		pthread_mutex_unlock(&c->lock);
+	}
+	if (!h)
+		h = Malloc(sizeof(*h) + bufpool_class_size(cls));
+	h->cls = cls;
+	return h + 1;
+}
+
+static struct bufpool_aligned **
+bufpool_aligned_bucket(void *buf)
+{
+	return &aligned_table[((uintptr_t)buf / BUFPOOL_ALIGN) %
+			      BUFPOOL_ALIGNED_BUCKETS];
+}
+
+/* sets *cls to the class of aligned buffer buf. Returns 0 if buf is not
+ * an aligned buffer. */
+static int
+bufpool_aligned_class(void *buf, int *cls)
+{
+	struct bufpool_aligned *a;
+
+	if ((uintptr_t)buf % BUFPOOL_ALIGN != 0)
+		return 0;
+	pthread_mutex_lock(&aligned_lock);
+	for (a = *bufpool_aligned_bucket(buf); a && a->buf != buf; a = a->next)
+		;
+	if (a)
+		*cls = a->cls;
+	pthread_mutex_unlock(&aligned_lock);
+	return a != NULL;
+}
+
+/* frees aligned buffer buf, and forgets it */
+static void
+bufpool_aligned_free(void *buf)
+{
+	struct bufpool_aligned **ap, *a;
+
+	pthread_mutex_lock(&aligned_lock);
+	for (ap = bufpool_aligned_bucket(buf); (*ap)->buf != buf;
+	     ap = &(*ap)->next)
+		;
+	a = *ap;
+	*ap = a->next;
+	pthread_mutex_unlock(&aligned_lock);
+	free(a);
+	free(buf);
+}
+
+void *
+bufpool_alloc_aligned(size_t size)
+{
+	struct bufpool_aligned *a, **bucket;
+	struct bufpool_class *c;
+	void *buf = NULL;
+	int cls;
+
+	pthread_once(&bufpool_once, bufpool_init);
+	cls = bufpool_class(size);
+	if (cls != BUFPOOL_LARGE) {
+		c = &aligned[cls];
+		size = bufpool_class_size(cls);
+		pthread_mutex_lock(&c->lock);
+		buf = bufpool_get(c, size);
+		pthread_mutex_unlock(&c->lock);
+	}
+	if (!buf) {
+		if (posix_memalign(&buf, BUFPOOL_ALIGN, size) != 0)
+			unix_error("posix_memalign error");
+		a = Malloc(sizeof(struct bufpool_aligned));
+		a->buf = buf;
+		a->cls = cls;
+		pthread_mutex_lock(&aligned_lock);
+		bucket = bufpool_aligned_bucket(buf);
+		a->next = *bucket;
+		*bucket = a;
+		pthread_mutex_unlock(&aligned_lock);
+	}
+	return buf;
+}
+
+void
+bufpool_free(void *buf)
+{
+	struct bufpool_tcache *tc;
+	struct bufpool_class *c;
+	union bufpool_hdr *h;
+	int cls, kept;
+
+	if (!buf)
+		return;
+	if (bufpool_aligned_class(buf, &cls)) {
+		if (cls == BUFPOOL_LARGE) {
+			bufpool_aligned_free(buf);
+			return;
+		}
+		/* the buffer is free, so it holds its own link */
+		c = &aligned[cls];
+		pthread_mutex_lock(&c->lock);
+		kept = bufpool_put(c, buf, bufpool_class_size(cls));
+		pthread_mutex_unlock(&c->lock);
+		if (!kept)
+			bufpool_aligned_free(buf);
+		return;
+	}
+	h = (union bufpool_hdr *)buf - 1;
+	if (h->cls == BUFPOOL_LARGE) {
+		free(h);
+		return;
+	}
+	cls = h->cls;
+	if (cls < BUFPOOL_TCACHE_CLASSES) {
+		tc = bufpool_tcache();
+		if (tc->nr_free[cls] == BUFPOOL_TCACHE)
+			bufpool_spill(tc, cls, BUFPOOL_TCACHE / 2);
+		h->next = tc->free[cls];
+		tc->free[cls] = h;
+		tc->nr_free[cls]++;
+		return;
+	}
+	c = &classes[cls];
+	pthread_mutex_lock(&c->lock);
+	kept = bufpool_put(c, h, bufpool_class_size(cls));
+	pthread_mutex_unlock(&c->lock);
+	if (!kept)
+		free(h);
+}
+
+size_t
+bufpool_size(void *buf)
+{
+	union bufpool_hdr *h;
+	int cls;
+
+	if (!buf)
+		return 0;
+	if (bufpool_aligned_class(buf, &cls))
+		return cls == BUFPOOL_LARGE ? malloc_usable_size(buf) :
+			bufpool_class_size(cls);
+	h = (union bufpool_hdr *)buf - 1;
+	if (h->cls == BUFPOOL_LARGE)
+		return malloc_usable_size(h) - sizeof(*h);
+	return bufpool_class_size(h->cls);
+}
+
+void
+bufpool_drain(void)
+{
+	union bufpool_hdr *h;
+	int i;
+
+	pthread_once(&bufpool_once, bufpool_init);
+	if (tcache) {
+		for (i = 0; i < BUFPOOL_TCACHE_CLASSES; i++)
+			bufpool_spill(tcache, i, BUFPOOL_TCACHE);
+	}
+	for (i = 0; i < BUFPOOL_NR_CLASSES; i++) {
+		pthread_mutex_lock(&classes[i].lock);
+		while ((h = bufpool_get(&classes[i], bufpool_class_size(i))))
+			free(h);
+		pthread_mutex_unlock(&classes[i].lock);
+		pthread_mutex_lock(&aligned[i].lock);
+		while ((h = bufpool_get(&aligned[i], bufpool_class_size(i))))
+			bufpool_aligned_free(h);
+		pthread_mutex_unlock(&aligned[i].lock);
+	}
+}
@@ -0,0 +1,29 @@
+#ifndef __BUFPOOL_H__
+#define __BUFPOOL_H__
+
+#include <stddef.h>
+
+#define BUFPOOL_ALIGN 4096
+
+/* Size-classed freelists for buffers that outlive a single request: file
+ * buffers, file data shared with the cache, and cache bookkeeping. Sizes are
+ * rounded up to a power of two, and freed buffers are kept on the freelist of
+ * their class for the next allocation of that class, so a server serving a
+ * steady mix of files stops calling malloc. Each thread keeps a few of the
+ * smaller ones to itself, and the freelists shared by the threads keep a
+ * bounded number of bytes in all. Buffers larger than the largest class go
+ * straight to malloc and free. */
+
+void *bufpool_alloc(size_t size);
+/* same as bufpool_alloc, but the buffer starts on a BUFPOOL_ALIGN boundary,
+ * as O_DIRECT reads need. These buffers have freelists of their own. */
+void *bufpool_alloc_aligned(size_t size);
+void bufpool_free(void *buf);
+/* returns the bytes allocated for buf, its class size, which is what it
+ * costs whatever its size was asked to be. 0 for NULL. */
+size_t bufpool_size(void *buf);
+/* returns the buffers kept on the freelists, and in the cache of the
+ * calling thread, to malloc */
+void bufpool_drain(void);
+
+#endif /* __BUFPOOL_H__ */
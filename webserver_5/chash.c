@@ -0,0 +1,97 @@
+/*
+ * chash.c: a consistent hash ring (see chash.h).
+ */
+
+#include "common.h"
+#include "chash.h"
+
+/* a point of a node on the ring */
+struct vnode {
+	uint64_t hash;
+	int node;
+};
+
+struct chash {
+	struct vnode *ring;	/* sorted by hash */
+	int nr_vnodes;
+};
+
+/* FNV-1a, with a final mix so that nearby keys spread over the ring */
+uint64_t
+chash_hash(const char *key, int len)
+{
+	uint64_t h = 14695981039346656037ULL;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)key[i];
+		h *= 1099511628211ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static int
+vnode_cmp(const void *a, const void *b)
+{
+	uint64_t x = ((const struct vnode *)a)->hash;
+	uint64_t y = ((const struct vnode *)b)->hash;
+
+	return x < y ? -1 : x > y;
+}
+
+struct chash *
+chash_init(char *const *names, int nr_nodes)
+{
+	struct chash *ch;
+	char buf[MAXLINE];
+	int i, j, len;
+
+	ch = Malloc(sizeof(struct chash));
+	ch->nr_vnodes = nr_nodes * CHASH_VNODES;
+	ch->ring = Malloc(ch->nr_vnodes * sizeof(struct vnode));
+	for (i = 0; i < nr_nodes; i++) {
+		for (j = 0; j < CHASH_VNODES; j++) {
+			struct vnode *v = &ch->ring[i * CHASH_VNODES + j];
+
+			len = snprintf(buf, sizeof(buf), "%s#%d", names[i], j);
+			v->hash = chash_hash(buf, len);
+			v->node = i;
+		}
+	}
+	qsort(ch->ring, ch->nr_vnodes, sizeof(struct vnode), vnode_cmp);
+	return ch;
+}
+
+int
+chash_pick(struct chash *ch, const char *key, int len,
+	   int (*ok)(void *arg, int node), void *arg)
+{
+	uint64_t h = chash_hash(key, len);
+	int lo = 0, hi = ch->nr_vnodes, i, node;
+
+	/* the first point at or after h, around the ring */
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (ch->ring[mid].hash < h)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (i = 0; i < ch->nr_vnodes; i++) {
+		node = ch->ring[(lo + i) % ch->nr_vnodes].node;
+		if (ok(arg, node))
+			return node;
+	}
+	return -1;
+}
+
+void
+chash_destroy(struct chash *ch)
+{
+	free(ch->ring);
+	free(ch);
+}
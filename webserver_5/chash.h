@@ -0,0 +1,24 @@
+#ifndef __CHASH_H__
+#define __CHASH_H__
+
+#include <stdint.h>
+
+/* A consistent hash ring over a set of nodes, named e.g. by host:port. Each
+ * node is placed at CHASH_VNODES points on the ring, and a key belongs to
+ * the node of the first point at or after the key's hash. When a node is
+ * skipped, only its keys move, spread over the nodes after its points. All
+ * servers given the same names build the same ring. */
+
+#define CHASH_VNODES 100
+
+struct chash;
+
+struct chash *chash_init(char *const *names, int nr_nodes);
+uint64_t chash_hash(const char *key, int len);
+/* returns the node that key of len bytes belongs to, among the nodes for
+ * which ok(arg, node) returns 1, or -1 if there are none */
+int chash_pick(struct chash *ch, const char *key, int len,
+	       int (*ok)(void *arg, int node), void *arg);
+void chash_destroy(struct chash *ch);
+
+#endif /* __CHASH_H__ */
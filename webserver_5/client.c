@@ -4,6 +4,7 @@
  */
 
 #include "common.h"
+#include "csum.h"
 
 /* send an HTTP request for the specified file */
 static void
@@ -25,7 +26,7 @@ client_print(int fd, unsigned int orig_csum, int orig_length, int print)
 {
 	struct rio *rio;
 	char buf[MAXBUF];
-	int i, n;
+	int n;
 	int length = 0;
 	int length_received = 0;
 	unsigned int csum = 0;
@@ -58,9 +59,7 @@ client_print(int fd, unsigned int orig_csum, int orig_length, int print)
 			Rio_write(STDOUT_FILENO, buf, n);
 		}
 		length_received += n;
-		for (i = 0; i < n; i++) {
-			csum_received += (unsigned char)buf[i];
-		}
+		csum_received += csum_bytes(buf, n);
 	} while (n > 0);
 
 	assert(orig_csum == csum);
@@ -24,6 +24,17 @@ Malloc(size_t size)
 	return rc;
 }
 
+void *
+Realloc(void *ptr, size_t size)
+{
+	void *rc;
+	rc = realloc(ptr, size);
+	if (!rc) {
+		unix_error("realloc");
+	}
+	return rc;
+}
+
 /*********************************************************************
  * The Rio package - robust I/O functions
  **********************************************************************/
@@ -270,6 +281,15 @@ open_clientfd(char *hostname, int port)
 /* open and return a listening socket on port */
 int
 open_listenfd(int port)
+{
+	return open_listenfd_opts(port, LISTENQ, 0);
+}
+
+/* opens a listen socket with a backlog of backlog connections. With
+ * reuseport, other sockets may be bound to port at the same time, and the
+ * kernel shares the connections out among them. */
+int
+open_listenfd_opts(int port, int backlog, int reuseport)
 {
 	int listenfd, optval = 1;
 	struct sockaddr_in serveraddr;
@@ -280,6 +300,9 @@ open_listenfd(int port)
 	/* Eliminates "Address already in use" error from bind. */
 	SYS(setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,
 		       (const void *)&optval, sizeof(int)));
+	if (reuseport)
+		SYS(setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+			       (const void *)&optval, sizeof(int)));
 
 	/* Listenfd will be an endpoint for all requests to port
 	   on any IP address for this host */
@@ -290,7 +313,7 @@ open_listenfd(int port)
 	SYS(bind(listenfd, (struct sockaddr *)&serveraddr, sizeof(serveraddr)));
 
 	/* Make it a listening socket ready to accept connection requests */
-	SYS(listen(listenfd, LISTENQ));
+	SYS(listen(listenfd, backlog));
 
 	return listenfd;
 }
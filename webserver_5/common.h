@@ -20,11 +20,13 @@
 #include <pthread.h>
 #include <semaphore.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <assert.h>
 #include <poll.h>
+#include <sched.h>
 
 #define __STR(n) #n
 #define STR(n) __STR(n)
@@ -56,6 +58,14 @@
 		}							\
 	} while (0)
 
+/* marks a step of a lock-free algorithm that may race with another thread.
+ * The stress tests (stress.c) are built with STRESS_YIELD, to let other
+ * threads run there. */
+#ifdef STRESS_YIELD
+#define stress_yield() sched_yield()
+#else
+#define stress_yield() do { } while (0)
+#endif
 
 /* Misc constants */
 #define MAXLINE  8192	/* max text line length */
@@ -63,7 +73,9 @@
 #define LISTENQ  1024	/* second argument to listen() */
 
 /* Memory managment wrappers */
+void unix_error(char *msg);
 void *Malloc(size_t size);
+void *Realloc(void *ptr, size_t size);
 
 /* Persistent state for the robust I/O (Rio) package */
 struct rio;
@@ -77,6 +89,7 @@ ssize_t Rio_readlineb(struct rio *rp, void *usrbuf, size_t maxlen);
 /* Wrappers for client/server helper functions */
 int open_clientfd(char *hostname, int port);
 int open_listenfd(int port);
+int open_listenfd_opts(int port, int backlog, int reuseport);
 
 /* Random functions */
 void init_random();
@@ -0,0 +1,148 @@
+/*
+ * csum.c: byte-sum checksum kernels with runtime dispatch.
+ *
+ * The vector kernels use psadbw (sum of absolute differences against zero),
+ * which adds up groups of 8 bytes into 64-bit lanes without overflow. The
+ * 64-bit total truncated to 32 bits is the same as summing into an unsigned
+ * int one byte at a time.
+ */
+
+#include <stdint.h>
+#include <pthread.h>
+#include "csum.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CSUM_X86 1
+#endif
+
+static unsigned int
+csum_scalar(const unsigned char *p, long len)
+{
+	unsigned int csum = 0;
+	long i;
+
+	for (i = 0; i < len; i++) {
+		csum += p[i];
+	}
+	return csum;
+}
+
+#ifdef CSUM_X86
+
+__attribute__((target("sse2")))
+static unsigned int
+csum_sse2(const unsigned char *p, long len)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i a0 = zero, a1 = zero;
+	uint64_t sum;
+	long i = 0;
+
+	for (; i + 32 <= len; i += 32) {
+		__m128i v0 = _mm_loadu_si128((const __m128i *)(p + i));
+		__m128i v1 = _mm_loadu_si128((const __m128i *)(p + i + 16));
+		a0 = _mm_add_epi64(a0, _mm_sad_epu8(v0, zero));
+		a1 = _mm_add_epi64(a1, _mm_sad_epu8(v1, zero));
+	}
+	a0 = _mm_add_epi64(a0, a1);
+	sum = (uint64_t)_mm_cvtsi128_si64(a0) +
+		(uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(a0, a0));
+	return (unsigned int)sum + csum_scalar(p + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static unsigned int
+csum_avx2(const unsigned char *p, long len)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i a0 = zero, a1 = zero, a2 = zero, a3 = zero;
+	__m128i s;
+	uint64_t sum;
+	long i = 0;
+
+	for (; i + 128 <= len; i += 128) {
+		__m256i v0 = _mm256_loadu_si256((const __m256i *)(p + i));
+		__m256i v1 = _mm256_loadu_si256((const __m256i *)(p + i + 32));
+		__m256i v2 = _mm256_loadu_si256((const __m256i *)(p + i + 64));
+		__m256i v3 = _mm256_loadu_si256((const __m256i *)(p + i + 96));
+		a0 = _mm256_add_epi64(a0, _mm256_sad_epu8(v0, zero));
+		a1 = _mm256_add_epi64(a1, _mm256_sad_epu8(v1, zero));
+		a2 = _mm256_add_epi64(a2, _mm256_sad_epu8(v2, zero));
+		a3 = _mm256_add_epi64(a3, _mm256_sad_epu8(v3, zero));
+	}
+	for (; i + 32 <= len; i += 32) {
+		__m256i v0 = _mm256_loadu_si256((const __m256i *)(p + i));
+		a0 = _mm256_add_epi64(a0, _mm256_sad_epu8(v0, zero));
+	}
+	a0 = _mm256_add_epi64(_mm256_add_epi64(a0, a1),
+			      _mm256_add_epi64(a2, a3));
+	s = _mm_add_epi64(_mm256_castsi256_si128(a0),
+			  _mm256_extracti128_si256(a0, 1));
+	sum = (uint64_t)_mm_cvtsi128_si64(s) +
+		(uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(s, s));
+	return (unsigned int)sum + csum_scalar(p + i, len - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static unsigned int
+csum_avx512(const unsigned char *p, long len)
+{
+	const __m512i zero = _mm512_setzero_si512();
+	__m512i a0 = zero, a1 = zero;
+	long i = 0;
+
+	for (; i + 128 <= len; i += 128) {
+		__m512i v0 = _mm512_loadu_si512((const void *)(p + i));
+		__m512i v1 = _mm512_loadu_si512((const void *)(p + i + 64));
+		a0 = _mm512_add_epi64(a0, _mm512_sad_epu8(v0, zero));
+		a1 = _mm512_add_epi64(a1, _mm512_sad_epu8(v1, zero));
+	}
+	if (i < len) {
+		/* masked load of the tail, the masked-off bytes read as 0 */
+		long left = len - i;
+		__mmask64 m;
+		__m512i v;
+
+		if (left >= 64) {
+			v = _mm512_loadu_si512((const void *)(p + i));
+			a0 = _mm512_add_epi64(a0, _mm512_sad_epu8(v, zero));
+			i += 64;
+			left -= 64;
+		}
+		if (left > 0) {
+			m = (~0ULL) >> (64 - left);
+			v = _mm512_maskz_loadu_epi8(m, (const void *)(p + i));
+			a1 = _mm512_add_epi64(a1, _mm512_sad_epu8(v, zero));
+		}
+	}
+	return (unsigned int)_mm512_reduce_add_epi64(_mm512_add_epi64(a0, a1));
+}
+
+#endif /* CSUM_X86 */
+
+static unsigned int (*csum_kernel)(const unsigned char *p, long len);
+static pthread_once_t csum_once = PTHREAD_ONCE_INIT;
+
+static void
+csum_select(void)
+{
+	csum_kernel = csum_scalar;
+#ifdef CSUM_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512bw")) {
+		csum_kernel = csum_avx512;
+	} else if (__builtin_cpu_supports("avx2")) {
+		csum_kernel = csum_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		csum_kernel = csum_sse2;
+	}
+#endif
+}
+
+unsigned int
+csum_bytes(const char *buf, long len)
+{
+	pthread_once(&csum_once, csum_select);
+	return csum_kernel((const unsigned char *)buf, len);
+}
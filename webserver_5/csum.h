@@ -0,0 +1,12 @@
+#ifndef __CSUM_H__
+#define __CSUM_H__
+
+/* The "very trivial checksum" used by the server, the client and fileset:
+ * the sum of all bytes, as unsigned chars, modulo 2^32.
+ *
+ * csum_bytes picks the widest vector unit the CPU supports the first time it
+ * is called (AVX-512, AVX2, SSE2 or plain C). All versions return exactly the
+ * same value. */
+unsigned int csum_bytes(const char *buf, long len);
+
+#endif /* __CSUM_H__ */
@@ -0,0 +1,510 @@
+/*
+ * event.c: epoll event loops for serving many connections with few threads.
+ *
+ * Connections are nonblocking and registered with EPOLLONESHOT, so at any
+ * time a connection is handled by exactly one thread: its loop while the
+ * headers are read or the response is drained, or a worker while the file, or
+ * the next chunk of a streamed file, is read and processed.
+ *
+ * Each loop keeps the connections it is waiting on that have a deadline on
+ * one of two lists, for headers and for responses. All connections on a list
+ * wait for the same time, so appending keeps the list sorted by deadline,
+ * and a loop only looks at the heads of its lists to find the next deadline
+ * and the connections that missed theirs.
+ */
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include "common.h"
+#include "event.h"
+
+#define EVENT_BATCH 64	/* events returned by one epoll_wait */
+
+struct conn_list {
+	struct conn *head, *tail;
+};
+
+struct loop {
+	int epfd;
+	int wakefd;		/* eventfd used to stop the loop */
+	pthread_t thread;
+	struct event *ev;
+	pthread_mutex_t lock;	/* protects the lists */
+	struct conn_list reading; /* waiting for their headers */
+	struct conn_list writing; /* waiting to send their response */
+	long header_timeouts;
+	long write_timeouts;
+};
+
+struct event {
+	int nr_loops;
+	struct loop *loops;
+	unsigned int next;	/* round-robin choice of loop */
+	int exiting;
+	struct conn **conns;	/* open connections, indexed by fd */
+	int max_conns;
+	int nr_conns;
+	pthread_mutex_t free_lock;
+	struct conn *free_conns;	/* closed connections, for reuse */
+	void (*dispatch)(void *arg, struct conn *c);
+	void *arg;
+	int header_ms;
+	int write_ms;
+};
+
+static long
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* the lock of c's loop must be held */
+static void
+timer_del(struct conn *c)
+{
+	struct conn_list *l = c->timers;
+
+	if (!l)
+		return;
+	if (c->tprev)
+		c->tprev->tnext = c->tnext;
+	else
+		l->head = c->tnext;
+	if (c->tnext)
+		c->tnext->tprev = c->tprev;
+	else
+		l->tail = c->tprev;
+	c->timers = NULL;
+}
+
+/* (re)starts c waiting ms on list l of loop lp, whose lock must be held */
+static void
+timer_add(struct loop *lp, struct conn_list *l, struct conn *c, int ms)
+{
+	uint64_t one = 1;
+
+	timer_del(c);
+	/* c has the earliest deadline on an empty list, so the loop may have
+	 * to wake up sooner than it planned to */
+	if (!l->head && !pthread_equal(pthread_self(), lp->thread))
+		SYS(write(lp->wakefd, &one, sizeof(one)));
+	c->deadline = now_ms() + ms;
+	c->timers = l;
+	c->tnext = NULL;
+	c->tprev = l->tail;
+	if (l->tail)
+		l->tail->tnext = c;
+	else
+		l->head = c;
+	l->tail = c;
+}
+
+static void
+conn_arm(struct event *ev, struct conn *c, unsigned int events)
+{
+	struct epoll_event e;
+
+	e.events = events | EPOLLONESHOT;
+	e.data.ptr = c;
+	SYS(epoll_ctl(ev->loops[c->loop].epfd, EPOLL_CTL_MOD, c->fd, &e));
+}
+
+static void
+conn_close(struct event *ev, struct conn *c)
+{
+	struct loop *lp = &ev->loops[c->loop];
+
+	if (c->timers) {
+		pthread_mutex_lock(&lp->lock);
+		timer_del(c);
+		pthread_mutex_unlock(&lp->lock);
+	}
+	/* clear the slot before closing, since accept may reuse the fd */
+	ev->conns[c->fd] = NULL;
+	__sync_sub_and_fetch(&ev->nr_conns, 1);
+	if (c->rq) {
+		/* closes c->fd */
+		request_destroy(c->rq);
+		file_data_free(c->data);
+	} else {
+		SYS(close(c->fd));
+	}
+	pthread_mutex_lock(&ev->free_lock);
+	c->next = ev->free_conns;
+	ev->free_conns = c;
+	pthread_mutex_unlock(&ev->free_lock);
+}
+
+/* reads whatever part of the headers has arrived */
+static void
+conn_read(struct event *ev, struct conn *c)
+{
+	ssize_t n;
+
+	while (1) {
+		n = read(c->fd, c->hdr + c->hdr_len,
+			 sizeof(c->hdr) - c->hdr_len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			conn_close(ev, c);
+			return;
+		}
+		if (n == 0) { /* client hung up before sending its headers */
+			conn_close(ev, c);
+			return;
+		}
+		c->hdr_len += n;
+		c->parsed = http_parse(&c->hp, c->hdr, c->hdr_len);
+		/* once the headers are complete, malformed or too long, the
+		 * worker takes over and responds */
+		if (c->parsed != HTTP_PARSE_AGAIN ||
+		    c->hdr_len == sizeof(c->hdr)) {
+			if (c->timers) {
+				pthread_mutex_lock(&ev->loops[c->loop].lock);
+				timer_del(c);
+				pthread_mutex_unlock(&ev->loops[c->loop].lock);
+			}
+			ev->dispatch(ev->arg, c);
+			return;
+		}
+	}
+	conn_arm(ev, c, EPOLLIN);
+}
+
+/* waits for the next request on c, once its response has been sent.
+ * Requests are not pipelined: anything the client sent after the headers
+ * of the last request is dropped. */
+static void
+conn_reuse(struct event *ev, struct conn *c)
+{
+	struct loop *lp = &ev->loops[c->loop];
+
+	request_finish(c->rq);
+	file_data_free(c->data);
+	c->rq = NULL;
+	c->data = NULL;
+	c->hdr_len = 0;
+	http_parser_init(&c->hp);
+	c->parsed = HTTP_PARSE_AGAIN;
+	/* as in conn_write, c must be on the list before it is armed, and
+	 * an idle connection is closed once the header deadline passes */
+	pthread_mutex_lock(&lp->lock);
+	conn_arm(ev, c, EPOLLIN);
+	if (ev->header_ms)
+		timer_add(lp, &lp->reading, c, ev->header_ms);
+	else
+		timer_del(c);
+	pthread_mutex_unlock(&lp->lock);
+}
+
+/* sends as much of the staged response as the socket accepts. Called when
+ * the socket has room, so something was sent and the write deadline
+ * restarts. A worker reads the chunks of a streamed file as the socket takes
+ * them, while a loop hands the connection back to the workers for that. */
+static void
+conn_write(struct event *ev, struct conn *c, int worker)
+{
+	struct loop *lp = &ev->loops[c->loop];
+	int done;
+
+	while ((done = request_flush(c->rq)) == 2) {
+		if (!worker) {
+			if (c->timers) {
+				pthread_mutex_lock(&lp->lock);
+				timer_del(c);
+				pthread_mutex_unlock(&lp->lock);
+			}
+			ev->dispatch(ev->arg, c);
+			return;
+		}
+		request_read_chunk(c->rq);
+	}
+	if (done == 0) {
+		if (!ev->write_ms) {
+			conn_arm(ev, c, EPOLLOUT);
+			return;
+		}
+		/* a worker calling this gives c up once it is armed, so c
+		 * must be on the list by the time the loop can see it */
+		pthread_mutex_lock(&lp->lock);
+		conn_arm(ev, c, EPOLLOUT);
+		timer_add(lp, &lp->writing, c, ev->write_ms);
+		pthread_mutex_unlock(&lp->lock);
+	} else if (c->rq->keep_alive) {
+		conn_reuse(ev, c);
+	} else {
+		conn_close(ev, c);
+	}
+}
+
+/* the time until the earliest deadline on l, or -1 if there is none */
+static long
+timer_next(struct conn_list *l, long now, long wait)
+{
+	long left;
+
+	if (!l->head)
+		return wait;
+	left = l->head->deadline - now;
+	if (left < 0)
+		left = 0;
+	return (wait < 0 || left < wait) ? left : wait;
+}
+
+/* moves the connections on l that missed their deadline to expired.
+ * Returns how many there were. */
+static long
+timer_expire(struct conn_list *l, long now, struct conn **expired)
+{
+	struct conn *c;
+	long n = 0;
+
+	while ((c = l->head) && c->deadline <= now) {
+		timer_del(c);
+		c->tnext = *expired;
+		*expired = c;
+		n++;
+	}
+	return n;
+}
+
+/* closes the connections of lp that missed their deadline, and returns the
+ * time until the next deadline */
+static int
+loop_expire(struct loop *lp)
+{
+	struct conn *c, *expired = NULL;
+	long now = now_ms(), wait;
+
+	pthread_mutex_lock(&lp->lock);
+	lp->header_timeouts += timer_expire(&lp->reading, now, &expired);
+	lp->write_timeouts += timer_expire(&lp->writing, now, &expired);
+	wait = timer_next(&lp->reading, now, -1);
+	wait = timer_next(&lp->writing, now, wait);
+	pthread_mutex_unlock(&lp->lock);
+	/* the loop is the only thread that handles a connection on its lists,
+	 * so they can be closed without the lock */
+	while ((c = expired)) {
+		expired = c->tnext;
+		conn_close(lp->ev, c);
+	}
+	return wait;
+}
+
+static void *
+loop_main(void *arg)
+{
+	struct loop *lp = (struct loop *)arg;
+	struct event *ev = lp->ev;
+	struct epoll_event events[EVENT_BATCH];
+	int i, n, wait = -1;
+
+	while (!ev->exiting) {
+		n = epoll_wait(lp->epfd, events, EVENT_BATCH, wait);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			SYS(n);
+		}
+		for (i = 0; i < n; i++) {
+			struct conn *c = events[i].data.ptr;
+
+			if (c == NULL) { /* wakefd, a new deadline or exit */
+				uint64_t val;
+
+				/* drain it, it is level triggered */
+				if (read(lp->wakefd, &val, sizeof(val)) < 0 &&
+				    errno != EAGAIN)
+					unix_error("read error");
+				continue;
+			}
+			if (c->rq) {
+				conn_write(ev, c, 0);
+			} else {
+				conn_read(ev, c);
+			}
+		}
+		if (ev->header_ms || ev->write_ms)
+			wait = loop_expire(lp);
+	}
+	return NULL;
+}
+
+struct event *
+event_init(int nr_loops, void (*dispatch)(void *arg, struct conn *c),
+	   void *arg, int header_ms, int write_ms)
+{
+	struct event *ev;
+	struct rlimit rl;
+	struct epoll_event e;
+	int i;
+
+	assert(nr_loops > 0);
+	ev = Malloc(sizeof(struct event));
+	ev->nr_loops = nr_loops;
+	ev->next = 0;
+	ev->exiting = 0;
+	ev->nr_conns = 0;
+	ev->dispatch = dispatch;
+	ev->arg = arg;
+	ev->header_ms = header_ms;
+	ev->write_ms = write_ms;
+	pthread_mutex_init(&ev->free_lock, NULL);
+	ev->free_conns = NULL;
+
+	/* the whole point is to keep many connections open, so allow as many
+	 * descriptors as the hard limit lets us */
+	SYS(getrlimit(RLIMIT_NOFILE, &rl));
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+	SYS(getrlimit(RLIMIT_NOFILE, &rl));
+	ev->max_conns = rl.rlim_cur;
+	ev->conns = Malloc(ev->max_conns * sizeof(struct conn *));
+	memset(ev->conns, 0, ev->max_conns * sizeof(struct conn *));
+
+	ev->loops = Malloc(nr_loops * sizeof(struct loop));
+	for (i = 0; i < nr_loops; i++) {
+		struct loop *lp = &ev->loops[i];
+
+		lp->ev = ev;
+		pthread_mutex_init(&lp->lock, NULL);
+		lp->reading.head = lp->reading.tail = NULL;
+		lp->writing.head = lp->writing.tail = NULL;
+		lp->header_timeouts = lp->write_timeouts = 0;
+		SYS(lp->epfd = epoll_create1(0));
+		SYS(lp->wakefd = eventfd(0, EFD_NONBLOCK));
+		e.events = EPOLLIN;
+		e.data.ptr = NULL;
+		SYS(epoll_ctl(lp->epfd, EPOLL_CTL_ADD, lp->wakefd, &e));
+		pthread_create(&lp->thread, NULL, loop_main, lp);
+	}
+	return ev;
+}
+
+/* hands a newly accepted connection to one of the loops */
+void
+event_add(struct event *ev, int connfd)
+{
+	struct conn *c;
+	struct epoll_event e;
+	int flags;
+
+	if (connfd >= ev->max_conns) {
+		SYS(close(connfd));
+		return;
+	}
+	SYS(flags = fcntl(connfd, F_GETFL, 0));
+	SYS(fcntl(connfd, F_SETFL, flags | O_NONBLOCK));
+
+	pthread_mutex_lock(&ev->free_lock);
+	c = ev->free_conns;
+	if (c)
+		ev->free_conns = c->next;
+	pthread_mutex_unlock(&ev->free_lock);
+	if (!c) {
+		c = Malloc(sizeof(struct conn));
+		arena_init(&c->arena);
+	}
+	c->fd = connfd;
+	c->loop = __sync_fetch_and_add(&ev->next, 1) % ev->nr_loops;
+	c->hdr_len = 0;
+	http_parser_init(&c->hp);
+	c->parsed = HTTP_PARSE_AGAIN;
+	c->rq = NULL;
+	c->data = NULL;
+	c->timers = NULL;
+	ev->conns[connfd] = c;
+	__sync_add_and_fetch(&ev->nr_conns, 1);
+	if (ev->header_ms) {
+		pthread_mutex_lock(&ev->loops[c->loop].lock);
+		timer_add(&ev->loops[c->loop], &ev->loops[c->loop].reading, c,
+			  ev->header_ms);
+		pthread_mutex_unlock(&ev->loops[c->loop].lock);
+	}
+
+	e.events = EPOLLIN | EPOLLONESHOT;
+	e.data.ptr = c;
+	SYS(epoll_ctl(ev->loops[c->loop].epfd, EPOLL_CTL_ADD, connfd, &e));
+}
+
+struct conn *
+event_conn(struct event *ev, int connfd)
+{
+	assert(connfd >= 0 && connfd < ev->max_conns);
+	return ev->conns[connfd];
+}
+
+/* called by the worker once the response is staged in c->rq. Most responses
+ * fit in the socket buffer and are sent right away; the rest are finished by
+ * the owning loop. */
+void
+event_reply(struct event *ev, struct conn *c)
+{
+	assert(c->rq);
+	conn_write(ev, c, 1);
+}
+
+void
+event_close(struct event *ev, struct conn *c)
+{
+	conn_close(ev, c);
+}
+
+void
+event_print_stats(struct event *ev, FILE *out)
+{
+	long header = 0, write = 0;
+	int i;
+
+	for (i = 0; i < ev->nr_loops; i++) {
+		header += ev->loops[i].header_timeouts;
+		write += ev->loops[i].write_timeouts;
+	}
+	fprintf(out, "event timeouts header %ld write %ld\n", header, write);
+}
+
+int
+event_nr_conns(struct event *ev)
+{
+	return ev->nr_conns;
+}
+
+/* the workers must have stopped before the loops are shut down */
+void
+event_exit(struct event *ev)
+{
+	struct conn *c;
+	uint64_t one = 1;
+	int i;
+
+	ev->exiting = 1;
+	for (i = 0; i < ev->nr_loops; i++) {
+		SYS(write(ev->loops[i].wakefd, &one, sizeof(one)));
+	}
+	for (i = 0; i < ev->nr_loops; i++) {
+		pthread_join(ev->loops[i].thread, NULL);
+		SYS(close(ev->loops[i].epfd));
+		SYS(close(ev->loops[i].wakefd));
+	}
+	for (i = 0; i < ev->max_conns; i++) {
+		if (ev->conns[i])
+			conn_close(ev, ev->conns[i]);
+	}
+	for (i = 0; i < ev->nr_loops; i++)
+		pthread_mutex_destroy(&ev->loops[i].lock);
+	while ((c = ev->free_conns) != NULL) {
+		ev->free_conns = c->next;
+		arena_destroy(&c->arena);
+		free(c);
+	}
+	free(ev->conns);
+	free(ev->loops);
+	free(ev);
+}
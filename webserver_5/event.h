@@ -0,0 +1,53 @@
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+#include "common.h"
+#include "request.h"
+
+/* A client connection owned by an event loop. The loop reads the request
+ * headers without blocking and hands the connection to a worker. The worker
+ * stages the response in rq and calls event_reply, after which the loop sends
+ * the response whenever the socket becomes writable. */
+struct conn {
+	int fd;
+	int loop;		/* index of the loop that owns fd */
+	char hdr[MAXLINE];	/* request headers read so far */
+	int hdr_len;
+	struct http_parser hp;	/* parses hdr as it arrives */
+	int parsed;		/* result of http_parse on hdr */
+	struct request *rq;	/* staged response, set by the worker */
+	struct file_data *data; /* kept alive until the response is sent */
+	struct arena arena;	/* memory for rq, kept when c is recycled */
+	struct conn *next;	/* on the list of free connections */
+	/* private to event.c: the deadline c is waiting for, on one of the
+	 * lists of its loop */
+	long deadline;
+	struct conn_list *timers;
+	struct conn *tprev, *tnext;
+};
+
+struct event;
+
+/* dispatch is called from a loop thread once the headers of a connection
+ * have arrived, and again, with c->rq set, whenever the response needs the
+ * next chunk of a streamed file to be read. It must eventually lead to a call
+ * to event_reply, which reads the chunk.
+ * A connection is closed if its headers have not all arrived header_ms
+ * after it was accepted, or if its response stalls, with nothing sent, for
+ * write_ms. 0 means no deadline. */
+struct event *event_init(int nr_loops,
+			 void (*dispatch)(void *arg, struct conn *c),
+			 void *arg, int header_ms, int write_ms);
+void event_add(struct event *ev, int connfd);
+struct conn *event_conn(struct event *ev, int connfd);
+void event_reply(struct event *ev, struct conn *c);
+/* closes a connection handed to the workers, without a response */
+void event_close(struct event *ev, struct conn *c);
+/* returns the number of open connections, including those kept open
+ * between requests */
+int event_nr_conns(struct event *ev);
+/* prints the number of connections closed for missing their deadlines */
+void event_print_stats(struct event *ev, FILE *out);
+void event_exit(struct event *ev);
+
+#endif /* __EVENT_H__ */
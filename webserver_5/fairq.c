@@ -0,0 +1,429 @@
+/*
+ * fairq.c: deficit round-robin across clients (see fairq.h).
+ */
+
+#include <time.h>
+#include "common.h"
+#include "fairq.h"
+#include "queue.h"
+
+#define FAIRQ_BUCKETS 256
+#define FAIRQ_QUANTUM 65536
+/* the first estimate of a client's response size, and the weight of each
+ * new response in the average, as a shift */
+#define FAIRQ_EST 16384
+#define FAIRQ_EST_SHIFT 3
+
+/* a client, which exists while it has connections queued or being served */
+struct fairq_flow {
+	unsigned char addr[16];	/* IPv6, or IPv4 mapped to IPv6 */
+	REQ_QUEUE *queue;
+	int active;		/* requests being served */
+	long deficit;		/* bytes it may still be sent this turn */
+	double tokens;		/* bytes it may be sent by the rate limit */
+	double refilled;	/* when tokens was last topped up */
+	long est;		/* average response size */
+	struct fairq_flow *next;	/* in its hash bucket */
+	struct fairq_flow *rr_prev, *rr_next; /* on the ring, if queued */
+};
+
+struct fairq {
+	struct fairq_limits limits;
+	int max_queued;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;	/* a connection may have become servable */
+	int stopped;
+	int nr_queued;
+	struct fairq_flow *buckets[FAIRQ_BUCKETS];
+	struct fairq_flow *ring; /* the client whose turn it is */
+	struct fairq_flow *free_flows;
+	/* statistics */
+	long nr_flows;		/* clients seen, again after being idle */
+	int max_flows;		/* at once */
+	int cur_flows;
+	long nr_dropped;
+	long nr_limited;	/* waits for a rate or concurrency limit */
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+fairq_parse(const char *spec, struct fairq_limits *limits)
+{
+	char buf[MAXLINE], *opt, *save;
+	long rate;
+
+	limits->quantum = FAIRQ_QUANTUM;
+	limits->conc = 0;
+	limits->rate = 0;
+	snprintf(buf, sizeof(buf), "%s", spec);
+	for (opt = strtok_r(buf, ",", &save); opt;
+	     opt = strtok_r(NULL, ",", &save)) {
+		if (sscanf(opt, "quantum=%ld", &limits->quantum) == 1 &&
+		    limits->quantum > 0)
+			continue;
+		if (sscanf(opt, "conc=%d", &limits->conc) == 1 &&
+		    limits->conc >= 0)
+			continue;
+		if (sscanf(opt, "rate=%ld", &rate) == 1 && rate >= 0) {
+			limits->rate = rate * 1024;
+			continue;
+		}
+		fprintf(stderr, "bad fair queue limit: %s\n", opt);
+		return 0;
+	}
+	return 1;
+}
+
+struct fairq *
+fairq_init(const struct fairq_limits *limits, int max_queued)
+{
+	struct fairq *fq;
+
+	fq = Malloc(sizeof(struct fairq));
+	memset(fq, 0, sizeof(struct fairq));
+	fq->limits = *limits;
+	fq->max_queued = max_queued > 0 ? max_queued : 1;
+	pthread_mutex_init(&fq->lock, NULL);
+	pthread_cond_init(&fq->ready, NULL);
+	return fq;
+}
+
+static unsigned int
+fairq_hash(const unsigned char *addr)
+{
+	unsigned int h = 2166136261u;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		h = (h ^ addr[i]) * 16777619u;
+	return h % FAIRQ_BUCKETS;
+}
+
+/* the address of the client on connfd, as IPv6 */
+static void
+fairq_addr(int connfd, unsigned char *addr)
+{
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof(ss);
+
+	memset(addr, 0, 16);
+	if (getpeername(connfd, (struct sockaddr *)&ss, &len) < 0)
+		return;	/* the client is gone, any flow will do */
+	if (ss.ss_family == AF_INET) {
+		addr[10] = addr[11] = 0xff;
+		memcpy(addr + 12, &((struct sockaddr_in *)&ss)->sin_addr, 4);
+	} else if (ss.ss_family == AF_INET6) {
+		memcpy(addr, &((struct sockaddr_in6 *)&ss)->sin6_addr, 16);
+	}
+}
+
+/* finds, or creates, the flow of addr. The lock must be held. */
+static struct fairq_flow *
+flow_get(struct fairq *fq, const unsigned char *addr)
+{
+	struct fairq_flow **b = &fq->buckets[fairq_hash(addr)], *f;
+
+	for (f = *b; f; f = f->next) {
+		if (memcmp(f->addr, addr, 16) == 0)
+			return f;
+	}
+	if ((f = fq->free_flows)) {
+		fq->free_flows = f->next;
+	} else {
+		f = Malloc(sizeof(struct fairq_flow));
+		f->queue = create_request_queue(fq->max_queued);
+	}
+	memcpy(f->addr, addr, 16);
+	f->active = 0;
+	f->deficit = 0;
+	f->tokens = fq->limits.rate;
+	f->refilled = now();
+	f->est = FAIRQ_EST;
+	f->rr_prev = f->rr_next = NULL;
+	f->next = *b;
+	*b = f;
+	fq->nr_flows++;
+	if (++fq->cur_flows > fq->max_flows)
+		fq->max_flows = fq->cur_flows;
+	return f;
+}
+
+/* frees f once it has nothing queued or being served */
+static void
+flow_put(struct fairq *fq, struct fairq_flow *f)
+{
+	struct fairq_flow **p;
+
+	if (f->queue->curr_size > 0 || f->active > 0)
+		return;
+	for (p = &fq->buckets[fairq_hash(f->addr)]; *p != f; p = &(*p)->next);
+	*p = f->next;
+	f->next = fq->free_flows;
+	fq->free_flows = f;
+	fq->cur_flows--;
+}
+
+static void
+ring_add(struct fairq *fq, struct fairq_flow *f)
+{
+	if (!fq->ring) {
+		f->rr_prev = f->rr_next = f;
+		fq->ring = f;
+		return;
+	}
+	/* join at the end of the round */
+	f->rr_next = fq->ring;
+	f->rr_prev = fq->ring->rr_prev;
+	f->rr_prev->rr_next = f;
+	fq->ring->rr_prev = f;
+}
+
+static void
+ring_del(struct fairq *fq, struct fairq_flow *f)
+{
+	if (f->rr_next == f) {
+		fq->ring = NULL;
+	} else {
+		f->rr_prev->rr_next = f->rr_next;
+		f->rr_next->rr_prev = f->rr_prev;
+		if (fq->ring == f)
+			fq->ring = f->rr_next;
+	}
+	f->rr_prev = f->rr_next = NULL;
+	/* unused credit does not carry over to when it has work again */
+	if (f->deficit > 0)
+		f->deficit = 0;
+}
+
+/* removes the oldest connection of f */
+static int
+flow_pop(struct fairq *fq, struct fairq_flow *f)
+{
+	int connfd;
+
+	pop_front(f->queue, &connfd);
+	fq->nr_queued--;
+	if (f->queue->curr_size == 0)
+		ring_del(fq, f);
+	return connfd;
+}
+
+int
+fairq_push(struct fairq *fq, int connfd)
+{
+	unsigned char addr[16];
+	struct fairq_flow *f, *longest = NULL;
+	int dropped = -1, i;
+
+	fairq_addr(connfd, addr);
+	pthread_mutex_lock(&fq->lock);
+	f = flow_get(fq, addr);
+	if (fq->nr_queued == fq->max_queued) {
+		for (i = 0; i < FAIRQ_BUCKETS; i++) {
+			struct fairq_flow *g;
+
+			for (g = fq->buckets[i]; g; g = g->next) {
+				if (!longest || g->queue->curr_size >
+				    longest->queue->curr_size)
+					longest = g;
+			}
+		}
+		fq->nr_dropped++;
+		if (longest == f || longest->queue->curr_size <=
+		    f->queue->curr_size) {
+			/* connfd's own client has the most queued */
+			flow_put(fq, f);
+			pthread_mutex_unlock(&fq->lock);
+			return connfd;
+		}
+		dropped = flow_pop(fq, longest);
+		flow_put(fq, longest);
+	}
+	push_back(f->queue, connfd);
+	fq->nr_queued++;
+	if (f->queue->curr_size == 1)
+		ring_add(fq, f);
+	pthread_cond_signal(&fq->ready);
+	pthread_mutex_unlock(&fq->lock);
+	return dropped;
+}
+
+/* tops up the tokens of f. Returns the seconds until f may be sent
+ * anything, 0 if it may now. */
+static double
+flow_refill(struct fairq *fq, struct fairq_flow *f, double t)
+{
+	long rate = fq->limits.rate;
+
+	if (!rate)
+		return 0;
+	f->tokens += (t - f->refilled) * rate;
+	if (f->tokens > rate)
+		f->tokens = rate;	/* a second's worth of burst */
+	f->refilled = t;
+	return f->tokens > 0 ? 0 : (double)-f->tokens / rate;
+}
+
+/* picks the client to serve next, in deficit round-robin among those the
+ * limits let be served. Returns NULL if there is none, with *wait set to
+ * the seconds until the rate limit lets one be served, or -1 if only a
+ * request finishing can. The lock must be held. */
+static struct fairq_flow *
+fairq_pick(struct fairq *fq, double *wait)
+{
+	struct fairq_flow *f;
+	double t = now(), w;
+	int eligible;
+
+	*wait = -1;
+	if (!fq->ring)
+		return NULL;
+	while (1) {
+		eligible = 0;
+		f = fq->ring;
+		do {
+			if (fq->limits.conc && f->active >= fq->limits.conc)
+				continue;
+			if ((w = flow_refill(fq, f, t)) > 0) {
+				if (*wait < 0 || w < *wait)
+					*wait = w;
+				continue;
+			}
+			eligible = 1;
+			if (f->deficit > 0) {
+				fq->ring = f;
+				return f;
+			}
+			/* its turn is over, with credit for the next one */
+			f->deficit += fq->limits.quantum;
+		} while ((f = f->rr_next) != fq->ring);
+		if (!eligible)
+			return NULL;
+		fq->ring = fq->ring->rr_next;
+	}
+}
+
+int
+fairq_pop(struct fairq *fq, int *connfd, struct fairq_flow **flow)
+{
+	struct fairq_flow *f;
+	struct timespec ts;
+	double wait;
+
+	pthread_mutex_lock(&fq->lock);
+	while (!fq->stopped && !(f = fairq_pick(fq, &wait))) {
+		if (fq->ring)
+			fq->nr_limited++;
+		if (wait < 0) {
+			pthread_cond_wait(&fq->ready, &fq->lock);
+			continue;
+		}
+		clock_gettime(CLOCK_REALTIME, &ts);
+		wait += ts.tv_sec + ts.tv_nsec / 1e9;
+		ts.tv_sec = (time_t)wait;
+		ts.tv_nsec = (wait - ts.tv_sec) * 1e9;
+		pthread_cond_timedwait(&fq->ready, &fq->lock, &ts);
+	}
+	if (fq->stopped) {
+		pthread_mutex_unlock(&fq->lock);
+		return 0;
+	}
+	*connfd = flow_pop(fq, f);
+	*flow = f;
+	f->active++;
+	/* charge the estimate now, so that the flow's other requests are not
+	 * taken as if this one were free */
+	f->deficit -= f->est;
+	/* more may be servable, e.g., other clients' */
+	if (fq->nr_queued > 0)
+		pthread_cond_signal(&fq->ready);
+	pthread_mutex_unlock(&fq->lock);
+	return 1;
+}
+
+double
+fairq_sent(struct fairq *fq, struct fairq_flow *f, long bytes)
+{
+	double wait;
+
+	if (!fq->limits.rate)
+		return 0;
+	pthread_mutex_lock(&fq->lock);
+	f->tokens -= bytes;
+	wait = flow_refill(fq, f, now());
+	pthread_mutex_unlock(&fq->lock);
+	return wait;
+}
+
+void
+fairq_done(struct fairq *fq, struct fairq_flow *f, long bytes)
+{
+	pthread_mutex_lock(&fq->lock);
+	f->active--;
+	f->deficit -= bytes - f->est;
+	f->est += (bytes - f->est) >> FAIRQ_EST_SHIFT;
+	flow_put(fq, f);
+	/* f may be under its concurrency limit again */
+	if (fq->nr_queued > 0)
+		pthread_cond_signal(&fq->ready);
+	pthread_mutex_unlock(&fq->lock);
+}
+
+void
+fairq_stop(struct fairq *fq)
+{
+	pthread_mutex_lock(&fq->lock);
+	fq->stopped = 1;
+	pthread_cond_broadcast(&fq->ready);
+	pthread_mutex_unlock(&fq->lock);
+}
+
+int
+fairq_len(struct fairq *fq)
+{
+	int n;
+
+	pthread_mutex_lock(&fq->lock);
+	n = fq->nr_queued;
+	pthread_mutex_unlock(&fq->lock);
+	return n;
+}
+
+void
+fairq_print_stats(struct fairq *fq, FILE *out)
+{
+	fprintf(out, "fairq clients %ld max at once %d dropped %ld "
+		"limited %ld\n", fq->nr_flows, fq->max_flows, fq->nr_dropped,
+		fq->nr_limited);
+}
+
+void
+fairq_destroy(struct fairq *fq)
+{
+	struct fairq_flow *f;
+	int i;
+
+	for (i = 0; i < FAIRQ_BUCKETS; i++) {
+		while ((f = fq->buckets[i])) {
+			fq->buckets[i] = f->next;
+			delete_queue(f->queue);
+			free(f);
+		}
+	}
+	while ((f = fq->free_flows)) {
+		fq->free_flows = f->next;
+		delete_queue(f->queue);
+		free(f);
+	}
+	pthread_mutex_destroy(&fq->lock);
+	pthread_cond_destroy(&fq->ready);
+	free(fq);
+}
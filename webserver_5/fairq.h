@@ -0,0 +1,61 @@
+#ifndef __FAIRQ_H__
+#define __FAIRQ_H__
+
+#include <stdio.h>
+
+/* A fair queue of client connections for the worker threads, in place of
+ * the single FIFO request_queue. Connections are classified by the address
+ * of the client, each client has its own FIFO, and workers take from the
+ * clients in deficit round-robin: each turn, a client may be served until
+ * it has been sent a quantum of bytes. A response's size is not known until
+ * it has been served, so a client is charged an estimate, its average
+ * response size, when a worker takes a request, and the difference once the
+ * worker is done. The rate limit, on the other hand, is charged the bytes of
+ * a response as they are written, with fairq_sent, and a worker sending to
+ * a client over its rate waits, so that a large response is shaped too.
+ *
+ * When the queue is full, the client with the most queued connections loses
+ * its oldest one, so one client cannot take all the slots.
+ *
+ * The limits are given as a comma separated list of:
+ *	quantum=BYTES	bytes a client may be sent per turn, default 65536
+ *	conc=N		requests of one client served at once, 0 (the
+ *			default) for no limit
+ *	rate=KBPS	bytes per second sent to one client, in KB/s, with
+ *			bursts of up to a second's worth. 0 (the default) for
+ *			no limit */
+
+struct fairq_limits {
+	long quantum;
+	int conc;
+	long rate;		/* bytes per second */
+};
+
+struct fairq;
+struct fairq_flow;
+
+/* fills in limits from spec. Returns 0 if spec is malformed. */
+int fairq_parse(const char *spec, struct fairq_limits *limits);
+/* a queue of up to max_queued connections */
+struct fairq *fairq_init(const struct fairq_limits *limits, int max_queued);
+/* queues connfd. Returns -1, or a connection dropped to make room for it,
+ * possibly connfd itself, which the caller must close. */
+int fairq_push(struct fairq *fq, int connfd);
+/* waits for a connection that may be served, and returns it in *connfd and
+ * its client in *flow. Returns 0 once the queue is stopped. */
+int fairq_pop(struct fairq *fq, int *connfd, struct fairq_flow **flow);
+/* bytes were just sent to flow, e.g., the first of a response. Returns the
+ * seconds to wait before sending it more, to keep to its rate. */
+double fairq_sent(struct fairq *fq, struct fairq_flow *flow, long bytes);
+/* the request taken from flow was served, with a response of bytes */
+void fairq_done(struct fairq *fq, struct fairq_flow *flow, long bytes);
+/* returns the number of connections queued */
+int fairq_len(struct fairq *fq);
+/* wakes up, and fails, all callers of fairq_pop */
+void fairq_stop(struct fairq *fq);
+/* prints the number of clients, and of connections dropped */
+void fairq_print_stats(struct fairq *fq, FILE *out);
+/* connections still queued are left open */
+void fairq_destroy(struct fairq *fq);
+
+#endif /* __FAIRQ_H__ */
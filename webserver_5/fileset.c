@@ -8,6 +8,7 @@
 #include <errno.h>
 #include <popt.h>
 #include "common.h"
+#include "csum.h"
 
 /* Generate a set of files for the webserver assignment */
 
@@ -108,7 +109,7 @@ main(int argc, const char *argv[])
 	/* null terminate the buffer */
 	idx_buffer[0] = 0;
 	while (current_fileset_sz < total_fileset_sz) {
-		char name[10];
+		char name[16];
 		int fd, file_sz, remaining;
 		char buf[4096];
 		double ms = default_file_sz;
@@ -127,8 +128,8 @@ main(int argc, const char *argv[])
 			for (j = 0; j < sz; j++) {
 				/* printable characters lie between 0x20-0x73 */
 				buf[j] = random() % (0x73 - 0x20) + 0x20;
-				csum += (unsigned char)(buf[j]);
 			}
+			csum += csum_bytes(buf, sz);
 			Rio_write(fd, buf, sz);
 			remaining -= sz;
 		}
@@ -0,0 +1,145 @@
+/*
+ * forkjoin.c: helper threads that share out the chunks of large buffers (see
+ * forkjoin.h).
+ */
+
+#include "common.h"
+#include "forkjoin.h"
+
+/* one call to forkjoin_for. It lives on the caller's stack, so helpers only
+ * touch it with lock held, and the caller only returns once every chunk has
+ * been counted as done. */
+struct forkjoin_job {
+	void (*fn)(void *arg, long start, long end);
+	void *arg;
+	long n;
+	long grain;
+	long nr_chunks;
+	long next;		/* next chunk to hand out */
+	long done;		/* chunks finished */
+	struct forkjoin_job *link; /* on the list of jobs with chunks left */
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;	/* for helpers */
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;	/* for callers */
+static struct forkjoin_job *jobs;
+static pthread_t *helpers;
+static int nr_helpers;
+static int exiting;
+
+/* hands out the next chunk of job, and unlinks job once it has none left.
+ * Returns -1 if there is none. Called with lock held. */
+static long
+forkjoin_claim(struct forkjoin_job *job)
+{
+	struct forkjoin_job **p;
+
+	if (job->next == job->nr_chunks)
+		return -1;
+	if (job->next + 1 == job->nr_chunks) {
+		for (p = &jobs; *p; p = &(*p)->link) {
+			if (*p == job) {
+				*p = job->link;
+				break;
+			}
+		}
+	}
+	return job->next++;
+}
+
+/* works on chunk i of job, and counts it as done. Called with lock held,
+ * which is dropped meanwhile. */
+static void
+forkjoin_run(struct forkjoin_job *job, long i)
+{
+	long start = i * job->grain;
+	long end = start + job->grain < job->n ? start + job->grain : job->n;
+
+	pthread_mutex_unlock(&lock);
+	job->fn(job->arg, start, end);
+	pthread_mutex_lock(&lock);
+	if (++job->done == job->nr_chunks)
+		pthread_cond_broadcast(&done);
+}
+
+static void *
+forkjoin_helper(void *arg)
+{
+	struct forkjoin_job *job;
+	long i;
+
+	pthread_mutex_lock(&lock);
+	while (1) {
+		while (!jobs && !exiting)
+			pthread_cond_wait(&work, &lock);
+		if (!jobs)
+			break;
+		/* jobs on the list always have a chunk left */
+		job = jobs;
+		i = forkjoin_claim(job);
+		forkjoin_run(job, i);
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+void
+forkjoin_init(int n)
+{
+	int i;
+
+	nr_helpers = n;
+	exiting = 0;
+	if (nr_helpers == 0)
+		return;
+	helpers = Malloc(nr_helpers * sizeof(pthread_t));
+	for (i = 0; i < nr_helpers; i++)
+		pthread_create(&helpers[i], NULL, forkjoin_helper, NULL);
+}
+
+void
+forkjoin_for(long n, long grain, void (*fn)(void *arg, long start, long end),
+	     void *arg)
+{
+	struct forkjoin_job job;
+	long i;
+
+	if (nr_helpers == 0 || n <= grain) {
+		fn(arg, 0, n);
+		return;
+	}
+	job.fn = fn;
+	job.arg = arg;
+	job.n = n;
+	job.grain = grain;
+	job.nr_chunks = (n + grain - 1) / grain;
+	job.next = job.done = 0;
+
+	pthread_mutex_lock(&lock);
+	job.link = jobs;
+	jobs = &job;
+	pthread_cond_broadcast(&work);
+	/* work on our own chunks rather than just waiting for the helpers */
+	while ((i = forkjoin_claim(&job)) >= 0)
+		forkjoin_run(&job, i);
+	while (job.done < job.nr_chunks)
+		pthread_cond_wait(&done, &lock);
+	pthread_mutex_unlock(&lock);
+}
+
+void
+forkjoin_exit(void)
+{
+	int i;
+
+	pthread_mutex_lock(&lock);
+	exiting = 1;
+	pthread_cond_broadcast(&work);
+	pthread_mutex_unlock(&lock);
+	for (i = 0; i < nr_helpers; i++)
+		pthread_join(helpers[i], NULL);
+	free(helpers);
+	helpers = NULL;
+	nr_helpers = 0;
+}
@@ -0,0 +1,19 @@
+#ifndef __FORKJOIN_H__
+#define __FORKJOIN_H__
+
+/* A pool of helper threads for splitting the work on one large buffer into
+ * chunks that are worked on in parallel. The thread that calls forkjoin_for
+ * works on the chunks too, and returns once all of them are done. Any number
+ * of threads may call forkjoin_for at once; the helpers share out the chunks
+ * of all of them. */
+
+/* starts nr_helpers helper threads. With none, forkjoin_for runs everything
+ * in the calling thread. */
+void forkjoin_init(int nr_helpers);
+/* calls fn(arg, start, end) for consecutive chunks [start, end) of [0, n)
+ * that are grain long (the last one may be shorter), in parallel */
+void forkjoin_for(long n, long grain, void (*fn)(void *arg, long start,
+						 long end), void *arg);
+void forkjoin_exit(void);
+
+#endif /* __FORKJOIN_H__ */
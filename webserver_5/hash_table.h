@@ -4,30 +4,14 @@
 #include "common.h"
 #include "request.h"
 #include "queue.h"
+#include "bufpool.h"
 
 #define NUM_BUCKETS 80000
 
-
-static void
-file_data_delete(struct file_data *data)
-{
-	free(data->file_name);
-	free(data);
-}
-
-static struct file_data *
-file_data_copy(struct file_data* rhs)
-{
-	struct file_data *data = Malloc(sizeof(struct file_data));
-
-	data->file_name =  Malloc(sizeof(char) * (strlen(rhs->file_name) + 1));
-	data->file_buf =  Malloc(sizeof(char) * (strlen(rhs->file_buf) + 1));
-	data->file_size = rhs->file_size;
-
-    strcpy(data->file_name, rhs->file_name);
-    strcpy(data->file_buf, rhs->file_buf);
-	return data;
-}
+// cached file data is shared with the requests sending it rather than
+// copied: the cache holds one reference to each entry's file_data, and
+// find_in_hash_table hands out another one, which the caller drops with
+// file_data_free
 
 typedef struct ENTRY {
 	char* filename;
@@ -64,7 +48,7 @@ pthread_mutex_t cache_mutex;
 // 1 or 4 (or from single thread), and don't need lock
 
 HASH_TABLE* hash_table_init(int max_buffer_size);
-// takes ownership of struct file_data memory
+// takes a reference to data
 bool add_to_hash_table(HASH_TABLE* wc, char* filename, struct file_data* data);
 void delete_from_hash_table(HASH_TABLE* wc, char* filename); 
 // deletes the entire hash table
@@ -74,6 +58,7 @@ struct file_data* delete_node_from_list(LINKED_LIST* list, char* filename);
 struct file_data* find_in_hash_table(HASH_TABLE* hash_table, char* filename);
 void delete_list(LINKED_LIST* list);
 void evict_cache(HASH_TABLE* hash_table, int total_size_to_evict);
+int collect_hash_table(HASH_TABLE* wc, struct file_data*** datas);
 
 static inline unsigned long hash_fn(char* str)
 {
@@ -101,18 +86,22 @@ HASH_TABLE* hash_table_init(int max_buffer_size) {
     return hash_table;
 }
 
-// assumes the data's filesize is less than hash table's max size
-// return true means that there are no duplicates; return false means duplicates found
+// files are charged the memory they take, see file_data_charge
+// return true means that there are no duplicates; return false means duplicates found,
+// or the file takes more memory than the whole cache has
 bool add_to_hash_table(HASH_TABLE* wc, char* filename, struct file_data* data){
     pthread_mutex_lock(&cache_mutex);
-    struct file_data* new_data = file_data_copy(data); // create a new file_data so the old can be deleted
-    assert(new_data->file_size <= wc->max_buffer_size);
+    struct file_data* new_data = data;
+    if (file_data_charge(new_data) > wc->max_buffer_size) {
+        pthread_mutex_unlock(&cache_mutex);
+        return false;
+    }
 
     int hash_table_remaining_size = wc->max_buffer_size - wc->curr_buffer_size;
-    if (new_data->file_size > hash_table_remaining_size){
+    if (file_data_charge(new_data) > hash_table_remaining_size){
         // have to evict to get free space
-        evict_cache(wc, new_data->file_size - hash_table_remaining_size);
-        assert(new_data->file_size <= (wc->max_buffer_size - wc->curr_buffer_size));
+        evict_cache(wc, file_data_charge(new_data) - hash_table_remaining_size);
+        assert(file_data_charge(new_data) <= (wc->max_buffer_size - wc->curr_buffer_size));
     }
 
 	int hash_val = (int)hash_fn(filename);
@@ -120,15 +109,15 @@ bool add_to_hash_table(HASH_TABLE* wc, char* filename, struct file_data* data){
 
 	if (add_to_list(&wc->list[hash_val], filename, new_data))
     {
+        file_data_ref(new_data);
         // add to list successful. Must update current cache size, as well as the list of largest files
-        wc->curr_buffer_size += new_data->file_size;
-        insert_into_filesize_queue(filesize_queue, new_data->file_size, filename);
+        wc->curr_buffer_size += file_data_charge(new_data);
+        insert_into_filesize_queue(filesize_queue, file_data_charge(new_data), filename);
         pthread_mutex_unlock(&cache_mutex);
         return true;
     }   
 
-    // insertion failed. delete new_data
-    file_data_delete(new_data);
+    // insertion failed, a duplicate is cached already
     pthread_mutex_unlock(&cache_mutex);
     return false;
 }
@@ -142,8 +131,8 @@ void delete_from_hash_table(HASH_TABLE* wc, char* filename) {
     struct file_data* data = delete_node_from_list(&wc->list[hash_val], filename);
     assert(data != NULL);
 
-    wc->curr_buffer_size -= data->file_size;
-    file_data_delete(data);
+    wc->curr_buffer_size -= file_data_charge(data);
+    file_data_free(data);
 }
 
 
@@ -151,8 +140,8 @@ bool add_to_list(LINKED_LIST* list, char* filename, struct file_data* data){
 	assert(filename[strlen(filename)] == '\0');
 
 	if (list->head == NULL) {
-		list->head = (ENTRY*) malloc(sizeof(ENTRY));
-		list->head->filename = (char*) malloc(sizeof(char) * (strlen(filename) + 1));
+		list->head = (ENTRY*) bufpool_alloc(sizeof(ENTRY));
+		list->head->filename = (char*) bufpool_alloc(sizeof(char) * (strlen(filename) + 1));
 		strcpy(list->head->filename, filename);
 		list->head->data = data;
 		list->head->next = NULL;
@@ -173,8 +162,8 @@ bool add_to_list(LINKED_LIST* list, char* filename, struct file_data* data){
 		}
 
 		// reaching here means that no identical entries exist, and we have to add a new entry
-		last_word_entry->next = (ENTRY*) malloc(sizeof(ENTRY));
-		last_word_entry->next->filename = (char*) malloc(sizeof(char) * (strlen(filename) + 1));
+		last_word_entry->next = (ENTRY*) bufpool_alloc(sizeof(ENTRY));
+		last_word_entry->next->filename = (char*) bufpool_alloc(sizeof(char) * (strlen(filename) + 1));
 		strcpy(last_word_entry->next->filename, filename);
 		last_word_entry->next->data = data;
 		last_word_entry->next->next = NULL;
@@ -199,8 +188,8 @@ struct file_data* delete_node_from_list(LINKED_LIST* list, char* filename){
                 last_word_entry->next = curr_word_entry->next;
             }
 
-            free(curr_word_entry->filename);
-            free(curr_word_entry);
+            bufpool_free(curr_word_entry->filename);
+            bufpool_free(curr_word_entry);
             return data;
         }
 
@@ -225,8 +214,9 @@ struct file_data* find_in_hash_table(HASH_TABLE* hash_table, char* filename) {
         if (strcmp(curr_word_entry->filename, filename) == 0) {
             
             // found it!
-            // make a copy of the data and return it
-            struct file_data* new_data = file_data_copy(curr_word_entry->data);
+            // share the data with the caller
+            struct file_data* new_data = curr_word_entry->data;
+            file_data_ref(new_data);
             pthread_mutex_unlock(&cache_mutex);
             return new_data;
         }
@@ -239,15 +229,36 @@ struct file_data* find_in_hash_table(HASH_TABLE* hash_table, char* filename) {
 }
 
 
+// returns the number of cached files, with a reference to the file_data of
+// each one in *datas, which the caller frees along with the references
+int collect_hash_table(HASH_TABLE* wc, struct file_data*** datas) {
+    pthread_mutex_lock(&cache_mutex);
+    int nr = 0, max = 16;
+    *datas = Malloc(max * sizeof(struct file_data*));
+    for (int i = 0; i < NUM_BUCKETS; i++) {
+        for (ENTRY* e = wc->list[i].head; e != NULL; e = e->next) {
+            if (nr == max) {
+                max *= 2;
+                *datas = Realloc(*datas, max * sizeof(struct file_data*));
+            }
+            file_data_ref(e->data);
+            (*datas)[nr++] = e->data;
+        }
+    }
+    pthread_mutex_unlock(&cache_mutex);
+    return nr;
+}
+
+
 void delete_list(LINKED_LIST* list){
 	ENTRY* curr_entry = list->head;
 	ENTRY* last_entry = NULL;
 	while (curr_entry != NULL) {
-		free(curr_entry->filename);
-        file_data_delete(curr_entry->data);
+		bufpool_free(curr_entry->filename);
+        file_data_free(curr_entry->data);
 		last_entry = curr_entry;
 		curr_entry = curr_entry->next;
-		free(last_entry);
+		bufpool_free(last_entry);
 	}
 }
 
@@ -274,7 +285,7 @@ void evict_cache(HASH_TABLE* hash_table, int total_size_to_evict) {
         assert(pop_front_fq(filesize_queue, &filename, &temp_size)); 
         evicted_cache += temp_size;
         delete_from_hash_table(hash_table, filename);
-        free(filename);
+        bufpool_free(filename);
     }
 }
 
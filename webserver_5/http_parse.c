@@ -0,0 +1,124 @@
+/*
+ * http_parse.c: a state machine for parsing HTTP request headers in place.
+ */
+
+#include <string.h>
+#include <strings.h>
+#include "http_parse.h"
+
+enum {
+	HTTP_REQUEST_LINE,
+	HTTP_HEADERS,
+	HTTP_DONE,
+	HTTP_ERROR,
+};
+
+void
+http_parser_init(struct http_parser *hp)
+{
+	hp->state = HTTP_REQUEST_LINE;
+	hp->pos = 0;
+	hp->method.p = hp->uri.p = hp->version.p = NULL;
+	hp->method.len = hp->uri.len = hp->version.len = 0;
+	hp->nr_headers = 0;
+}
+
+static int
+is_space(char c)
+{
+	return c == ' ' || c == '\t';
+}
+
+/* cuts the next space separated word off the front of [*p, end) */
+static void
+next_word(const char **p, const char *end, struct http_slice *word)
+{
+	while (*p < end && is_space(**p))
+		(*p)++;
+	word->p = *p;
+	while (*p < end && !is_space(**p))
+		(*p)++;
+	word->len = *p - word->p;
+}
+
+/* "GET /uri HTTP/1.0". The version is missing in HTTP/0.9 requests. */
+static int
+parse_request_line(struct http_parser *hp, const char *p, const char *end)
+{
+	next_word(&p, end, &hp->method);
+	next_word(&p, end, &hp->uri);
+	next_word(&p, end, &hp->version);
+	if (hp->method.len == 0 || hp->uri.len == 0)
+		return HTTP_ERROR;
+	return HTTP_HEADERS;
+}
+
+/* "Name: value", without the leading and trailing white space of value */
+static int
+parse_header(struct http_parser *hp, const char *p, const char *end)
+{
+	const char *colon;
+	struct http_header *h;
+
+	colon = memchr(p, ':', end - p);
+	if (colon == NULL || colon == p)
+		return HTTP_ERROR;
+	if (hp->nr_headers == HTTP_MAX_HEADERS)
+		return HTTP_HEADERS;
+	h = &hp->headers[hp->nr_headers++];
+	h->name.p = p;
+	h->name.len = colon - p;
+	p = colon + 1;
+	while (p < end && is_space(*p))
+		p++;
+	while (end > p && is_space(end[-1]))
+		end--;
+	h->value.p = p;
+	h->value.len = end - p;
+	return HTTP_HEADERS;
+}
+
+int
+http_parse(struct http_parser *hp, const char *buf, int len)
+{
+	const char *line, *nl, *end;
+
+	while (hp->state != HTTP_DONE && hp->state != HTTP_ERROR) {
+		line = buf + hp->pos;
+		nl = memchr(line, '\n', len - hp->pos);
+		if (nl == NULL)
+			return HTTP_PARSE_AGAIN;
+		hp->pos = nl + 1 - buf;
+		/* lines end in \r\n, but accept a bare \n too */
+		end = (nl > line && nl[-1] == '\r') ? nl - 1 : nl;
+
+		if (hp->state == HTTP_REQUEST_LINE) {
+			hp->state = parse_request_line(hp, line, end);
+		} else if (end == line) {
+			hp->state = HTTP_DONE;
+		} else {
+			hp->state = parse_header(hp, line, end);
+		}
+	}
+	return hp->state == HTTP_DONE ? HTTP_PARSE_DONE : HTTP_PARSE_ERROR;
+}
+
+int
+http_slice_eq(const struct http_slice *s, const char *str)
+{
+	int len = strlen(str);
+
+	return s->len == len && strncasecmp(s->p, str, len) == 0;
+}
+
+const struct http_slice *
+http_header(const struct http_parser *hp, const char *name)
+{
+	int i;
+
+	for (i = 0; i < hp->nr_headers; i++) {
+		if (http_slice_eq(&hp->headers[i].name, name))
+			return &hp->headers[i].value;
+	}
+	return NULL;
+}
@@ -0,0 +1,47 @@
+#ifndef __HTTP_PARSE_H__
+#define __HTTP_PARSE_H__
+
+/* An incremental HTTP request header parser.
+ *
+ * The parser never allocates and never copies. It works over a buffer owned by
+ * the caller, which may be filled a bit at a time: call http_parse again with
+ * the same buffer after appending more bytes, and parsing resumes where it
+ * stopped. The method, URI, version and headers are returned as slices
+ * pointing into the buffer, so they are valid for as long as the buffer is. */
+
+#define HTTP_MAX_HEADERS 32	/* further headers are parsed but not kept */
+
+/* return values of http_parse */
+#define HTTP_PARSE_ERROR -1	/* malformed request */
+#define HTTP_PARSE_AGAIN 0	/* need more bytes */
+#define HTTP_PARSE_DONE	 1	/* found the blank line ending the headers */
+
+struct http_slice {
+	const char *p;	/* not NUL terminated */
+	int len;
+};
+
+struct http_header {
+	struct http_slice name;
+	struct http_slice value;
+};
+
+struct http_parser {
+	int state;
+	int pos;		/* bytes of the buffer parsed so far */
+	struct http_slice method;
+	struct http_slice uri;
+	struct http_slice version;
+	struct http_header headers[HTTP_MAX_HEADERS];
+	int nr_headers;
+};
+
+void http_parser_init(struct http_parser *hp);
+int http_parse(struct http_parser *hp, const char *buf, int len);
+/* returns the value of header name (case insensitive), or NULL */
+const struct http_slice *http_header(const struct http_parser *hp,
+				     const char *name);
+/* compares a slice with a string, ignoring case */
+int http_slice_eq(const struct http_slice *s, const char *str);
+
+#endif /* __HTTP_PARSE_H__ */
@@ -0,0 +1,263 @@
+/*
+ * log.c: per-thread log rings drained by a writer thread (see log.h).
+ */
+
+#include <stdarg.h>
+#include <time.h>
+#include "common.h"
+#include "log.h"
+
+#define LOG_SLOT 128		/* longest message, longer ones are cut */
+#define LOG_SLOTS 512		/* messages a ring holds */
+#define LOG_IDLE_NS 10000000	/* writer naps this long when idle */
+
+/* a single producer, single consumer ring. head is only written by the thread
+ * that owns the ring and tail only by the writer, so each side just needs to
+ * see the other's index with acquire/release ordering. */
+struct log_ring {
+	unsigned long head;	/* next slot to fill */
+	unsigned long tail;	/* next slot to write out */
+	unsigned long dropped;	/* messages that found the ring full */
+	unsigned long reported;	/* dropped messages already reported */
+	struct log_ring *next;	/* on the list of all rings */
+	struct log_ring *next_free; /* on the list of free rings */
+	char slots[LOG_SLOTS][LOG_SLOT];
+};
+
+static const char *level_names[] = { "error", "warn", "info", "debug" };
+static const char level_tags[] = "EWID";
+
+static enum log_level max_level = LOG_ERROR;
+static int log_fd = -1;
+static pthread_t writer;
+static int exiting;
+
+/* rings are only added to the list, under rings_lock, and freed by log_exit.
+ * When a thread exits, its ring goes on the free list, for the next thread
+ * that logs, e.g., a new worker of the pool, to take over. The writer
+ * drains what the old thread left in it as usual. */
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct log_ring *rings;
+static struct log_ring *free_rings;
+static pthread_key_t ring_key;	/* frees the ring of a thread that exits */
+static __thread struct log_ring *ring;
+
+static void
+log_ring_free(void *arg)
+{
+	struct log_ring *r = (struct log_ring *)arg;
+
+	pthread_mutex_lock(&rings_lock);
+	r->next_free = free_rings;
+	free_rings = r;
+	pthread_mutex_unlock(&rings_lock);
+}
+
+static struct log_ring *
+log_ring(void)
+{
+	if (!ring) {
+		pthread_mutex_lock(&rings_lock);
+		if ((ring = free_rings)) {
+			free_rings = ring->next_free;
+		} else {
+			ring = Malloc(sizeof(struct log_ring));
+			ring->head = ring->tail = 0;
+			ring->dropped = ring->reported = 0;
+			ring->next = rings;
+			__atomic_store_n(&rings, ring, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&rings_lock);
+		pthread_setspecific(ring_key, ring);
+	}
+	return ring;
+}
+
+/* reserves the next slot of the calling thread's ring, or returns NULL,
+ * counting a drop, if the ring is full */
+static char *
+log_slot(struct log_ring *r)
+{
+	if (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) ==
+	    LOG_SLOTS) {
+		__atomic_store_n(&r->dropped, r->dropped + 1,
+				 __ATOMIC_RELAXED);
+		return NULL;
+	}
+	return r->slots[r->head % LOG_SLOTS];
+}
+
+/* hands the reserved slot to the writer */
+static void
+log_commit(struct log_ring *r)
+{
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+/* formats the time and level that start each message. Returns its length. */
+static int
+log_prefix(char *slot, enum log_level level)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return snprintf(slot, LOG_SLOT, "%ld.%03ld %c ", (long)ts.tv_sec,
+			ts.tv_nsec / 1000000, level_tags[level]);
+}
+
+/* ends a message with a newline, even one that had to be cut */
+static void
+log_end(char *slot, int len)
+{
+	if (len > LOG_SLOT - 2)
+		len = LOG_SLOT - 2;
+	slot[len] = '\n';
+	slot[len + 1] = '\0';
+}
+
+void
+log_msg(enum log_level level, const char *fmt, ...)
+{
+	struct log_ring *r;
+	va_list ap;
+	char *slot;
+	int len;
+
+	if (level > max_level || log_fd < 0)
+		return;
+	r = log_ring();
+	if (!(slot = log_slot(r)))
+		return;
+	len = log_prefix(slot, level);
+	va_start(ap, fmt);
+	len += vsnprintf(slot + len, LOG_SLOT - len, fmt, ap);
+	va_end(ap);
+	log_end(slot, len);
+	log_commit(r);
+}
+
+void
+log_access(int status, long bytes, const char *path)
+{
+	struct log_ring *r;
+	char *slot;
+	int len;
+
+	if (LOG_INFO > max_level || log_fd < 0)
+		return;
+	r = log_ring();
+	if (!(slot = log_slot(r)))
+		return;
+	len = log_prefix(slot, LOG_INFO);
+	len += snprintf(slot + len, LOG_SLOT - len, "%d %ld %s", status, bytes,
+			path ? path : "-");
+	log_end(slot, len);
+	log_commit(r);
+}
+
+/* writes out the messages in the rings, and reports new drops.
+ * Returns the number of messages written. */
+static int
+log_drain(char *buf, int size)
+{
+	struct log_ring *r;
+	unsigned long head, dropped;
+	int n = 0, len = 0, l;
+
+	for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		while (r->tail != head) {
+			if (len + LOG_SLOT > size) {
+				Rio_write(log_fd, buf, len);
+				len = 0;
+			}
+			l = strlen(r->slots[r->tail % LOG_SLOTS]);
+			memcpy(buf + len, r->slots[r->tail % LOG_SLOTS], l);
+			len += l;
+			n++;
+			/* the slot may be reused once tail moves past it */
+			__atomic_store_n(&r->tail, r->tail + 1,
+					 __ATOMIC_RELEASE);
+		}
+		dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+		if (dropped != r->reported) {
+			if (len + LOG_SLOT > size) {
+				Rio_write(log_fd, buf, len);
+				len = 0;
+			}
+			len += log_prefix(buf + len, LOG_WARN);
+			len += sprintf(buf + len, "log: %lu messages dropped\n",
+				       dropped - r->reported);
+			r->reported = dropped;
+		}
+	}
+	if (len)
+		Rio_write(log_fd, buf, len);
+	return n;
+}
+
+static void *
+log_writer(void *arg)
+{
+	struct timespec nap = { 0, LOG_IDLE_NS };
+	char *buf = Malloc(LOG_SLOT * LOG_SLOTS);
+
+	while (!__atomic_load_n(&exiting, __ATOMIC_ACQUIRE)) {
+		if (log_drain(buf, LOG_SLOT * LOG_SLOTS) == 0)
+			nanosleep(&nap, NULL);
+	}
+	log_drain(buf, LOG_SLOT * LOG_SLOTS);
+	free(buf);
+	return NULL;
+}
+
+int
+log_level(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(level_names) / sizeof(level_names[0]); i++) {
+		if (strcmp(name, level_names[i]) == 0)
+			return i;
+	}
+	return -1;
+}
+
+int
+log_init(enum log_level level, const char *file)
+{
+	max_level = level;
+	if (!file) {
+		log_fd = STDOUT_FILENO;
+	} else if ((log_fd = open(file, O_WRONLY | O_CREAT | O_APPEND,
+				  0644)) < 0) {
+		perror(file);
+		return 0;
+	}
+	exiting = 0;
+	pthread_key_create(&ring_key, log_ring_free);
+	pthread_create(&writer, NULL, log_writer, NULL);
+	return 1;
+}
+
+/* called once the threads that log have exited */
+void
+log_exit(void)
+{
+	struct log_ring *r;
+
+	if (log_fd < 0)
+		return;
+	__atomic_store_n(&exiting, 1, __ATOMIC_RELEASE);
+	pthread_join(writer, NULL);
+	if (log_fd != STDOUT_FILENO)
+		SYS(close(log_fd));
+	log_fd = -1;
+	pthread_key_delete(ring_key);
+	while ((r = rings)) {
+		rings = r->next;
+		free(r);
+	}
+	free_rings = NULL;
+	ring = NULL;
+}
@@ -0,0 +1,30 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+/* Asynchronous logging. Each thread that logs gets a ring buffer of its own,
+ * which only it writes to, so logging takes no locks and makes no system
+ * calls. A background writer thread drains the rings to the log file. When a
+ * thread's ring is full, its messages are dropped and counted rather than
+ * making the thread wait; the counts are logged by the writer. */
+
+enum log_level {
+	LOG_ERROR,	/* error responses */
+	LOG_WARN,
+	LOG_INFO,	/* access log, one line per response */
+	LOG_DEBUG,
+};
+
+/* starts the writer thread, logging messages up to level to file, or to
+ * stdout if file is NULL. Returns 0 if file can't be opened. */
+int log_init(enum log_level level, const char *file);
+/* returns the level named name, or -1 */
+int log_level(const char *name);
+void log_msg(enum log_level level, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+/* logs a response in the compact access log format:
+ * time status bytes path */
+void log_access(int status, long bytes, const char *path);
+/* writes out what is left in the rings, and stops the writer */
+void log_exit(void);
+
+#endif /* __LOG_H__ */
@@ -0,0 +1,296 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <string.h>
+#include <errno.h>
+#include <popt.h>
+#include "common.h"
+#include "csum.h"
+#include "pack.h"
+
+/* Pack the files of a directory, such as the one created by fileset, into
+ * one archive that the server can serve with -a (see pack.h) */
+
+poptContext context;	/* context for parsing command-line options */
+
+static void
+usage()
+{
+	poptPrintUsage(context, stderr, 0);
+	exit(1);
+}
+
+/* the directory whose files are packed */
+#define DEFAULT_DIR fileset_dir
+/* the average number of names per bucket of the hash. More makes the
+ * displacement table smaller, and the search for displacements longer. */
+#define NAMES_PER_BUCKET 4
+/* give up on a bucket after this many displacements */
+#define MAX_DISP (1 << 24)
+
+static char *dir = STR(DEFAULT_DIR);
+static char *out = NULL;
+
+struct file {
+	char *name;		/* the name it is requested by */
+	int len;
+	off_t size;
+	struct timespec mtime;
+	uint32_t slot;		/* its entry in the index */
+};
+
+struct bucket {
+	int nr;			/* names in the bucket */
+	int first;		/* of its names in order[] */
+};
+
+static int
+file_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct file *)a)->name,
+		      ((const struct file *)b)->name);
+}
+
+static struct bucket *sort_buckets;
+
+/* larger buckets first, they are the hardest to place */
+static int
+bucket_cmp(const void *a, const void *b)
+{
+	return sort_buckets[*(const int *)b].nr -
+		sort_buckets[*(const int *)a].nr;
+}
+
+/* fills in disp, and the slot of each file. Returns the number of
+ * displacements tried. */
+static long
+pack_index(struct file *files, uint32_t nr_files, uint32_t *disp,
+	   uint32_t nr_buckets)
+{
+	struct bucket *buckets;
+	int *order, *by_size, *pos;
+	char *taken;
+	uint32_t i, b, d, k;
+	long tries = 0;
+
+	buckets = Malloc(nr_buckets * sizeof(struct bucket));
+	order = Malloc(nr_files * sizeof(int));
+	by_size = Malloc(nr_buckets * sizeof(int));
+	pos = Malloc(nr_buckets * sizeof(int));
+	taken = Malloc(nr_files);
+	memset(buckets, 0, nr_buckets * sizeof(struct bucket));
+	memset(taken, 0, nr_files);
+
+	/* group the files by bucket in order[] */
+	for (i = 0; i < nr_files; i++) {
+		b = pack_hash(files[i].name, files[i].len, 0) % nr_buckets;
+		buckets[b].nr++;
+	}
+	for (b = 0, k = 0; b < nr_buckets; b++) {
+		buckets[b].first = pos[b] = k;
+		k += buckets[b].nr;
+		by_size[b] = b;
+	}
+	for (i = 0; i < nr_files; i++) {
+		b = pack_hash(files[i].name, files[i].len, 0) % nr_buckets;
+		order[pos[b]++] = i;
+	}
+	sort_buckets = buckets;
+	qsort(by_size, nr_buckets, sizeof(int), bucket_cmp);
+
+	for (i = 0; i < nr_buckets; i++) {
+		struct bucket *bk = &buckets[by_size[i]];
+
+		disp[by_size[i]] = 0;
+		if (bk->nr == 0)
+			continue;
+		/* displacement 0 is the one that picks the bucket */
+		for (d = 1; d < MAX_DISP; d++) {
+			tries++;
+			for (k = 0; k < bk->nr; k++) {
+				struct file *f = &files[order[bk->first + k]];
+
+				f->slot = pack_hash(f->name, f->len, d) %
+					nr_files;
+				if (taken[f->slot])
+					break;
+				taken[f->slot] = 1;
+			}
+			if (k == bk->nr)
+				break;
+			/* undo the slots this displacement took */
+			while (k-- > 0)
+				taken[files[order[bk->first + k]].slot] = 0;
+		}
+		if (d == MAX_DISP) {
+			fprintf(stderr, "could not build the index\n");
+			exit(1);
+		}
+		disp[by_size[i]] = d;
+	}
+	free(buckets);
+	free(order);
+	free(by_size);
+	free(pos);
+	free(taken);
+	return tries;
+}
+
+static off_t
+align(off_t off)
+{
+	return (off + PACK_ALIGN - 1) & ~(off_t)(PACK_ALIGN - 1);
+}
+
+int
+main(int argc, const char *argv[])
+{
+	char c;
+	DIR *d;
+	struct dirent *p;
+	struct file *files = NULL;
+	uint32_t nr_files = 0, max_files = 0, nr_buckets, i;
+	struct pack_header hdr;
+	struct pack_entry *entries;
+	uint32_t *disp;
+	char *names, *meta, *buf = NULL;
+	char filename[1024], tmpname[1040];
+	off_t names_size = 0, meta_size, off, buf_size = 0;
+	long tries;
+	int fd, srcfd, len;
+	char *ext;
+
+	struct poptOption options_table[] = {
+		{NULL, 'd', POPT_ARG_STRING, &dir, 'd',
+		 "directory whose files are packed",
+		 " default: " STR(DEFAULT_DIR)},
+		{NULL, 'o', POPT_ARG_STRING, &out, 'o',
+		 "archive to create", " default: dir.pack"},
+		POPT_AUTOHELP {NULL, 0, 0, NULL, 0}
+	};
+
+	context = poptGetContext(NULL, argc, argv, options_table, 0);
+	while ((c = poptGetNextOpt(context)) >= 0);
+	if (c < -1) {	/* an error occurred during option processing */
+		fprintf(stderr, "%s: %s\n",
+			poptBadOption(context, POPT_BADOPTION_NOALIAS),
+			poptStrerror(c));
+		exit(1);
+	}
+	/* names are requested relative to where the server runs */
+	while (strncmp(dir, "./", 2) == 0)
+		dir += 2;
+	len = strlen(dir);
+	while (len > 1 && dir[len - 1] == '/')
+		dir[--len] = 0;
+	if (dir[0] == '/' || strstr(dir, "..") || len > 900) {
+		fprintf(stderr, "dir should be a relative path, without ..\n");
+		usage();
+	}
+	if (!out) {
+		snprintf(filename, sizeof(filename), "%s.pack", dir);
+		out = filename;
+	}
+
+	d = opendir(dir);
+	if (!d) {
+		fprintf(stderr, "opendir: %s: %s\n", dir, strerror(errno));
+		exit(1);
+	}
+	while ((p = readdir(d)) != NULL) {
+		char name[1024];
+		struct stat statbuf;
+
+		snprintf(name, sizeof(name), "%s/%s", dir, p->d_name);
+		if (stat(name, &statbuf) < 0 || !S_ISREG(statbuf.st_mode))
+			continue;
+		/* the server doesn't serve C or header files */
+		if ((ext = strrchr(p->d_name, '.')) != NULL &&
+		    (strcmp(ext, ".c") == 0 || strcmp(ext, ".h") == 0))
+			continue;
+		if (nr_files == max_files) {
+			max_files = max_files ? max_files * 2 : 256;
+			files = Realloc(files, max_files * sizeof(struct file));
+		}
+		files[nr_files].name = strdup(name);
+		files[nr_files].len = strlen(name);
+		files[nr_files].size = statbuf.st_size;
+		files[nr_files].mtime = statbuf.st_mtim;
+		names_size += files[nr_files].len + 1;
+		nr_files++;
+	}
+	closedir(d);
+	if (nr_files == 0) {
+		fprintf(stderr, "%s: no files to pack\n", dir);
+		exit(1);
+	}
+	/* the contents go in name order, as fileset created them */
+	qsort(files, nr_files, sizeof(struct file), file_cmp);
+
+	nr_buckets = nr_files / NAMES_PER_BUCKET + 1;
+	meta_size = sizeof(hdr) + nr_buckets * sizeof(uint32_t) +
+		nr_files * sizeof(struct pack_entry) + names_size;
+	if (meta_size > UINT32_MAX) {
+		fprintf(stderr, "too many files\n");
+		exit(1);
+	}
+	meta = Malloc(meta_size);
+	memset(meta, 0, meta_size);
+	disp = (uint32_t *)(meta + sizeof(hdr));
+	entries = (struct pack_entry *)(disp + nr_buckets);
+	names = (char *)(entries + nr_files);
+	tries = pack_index(files, nr_files, disp, nr_buckets);
+
+	/* write to a new file, and rename it over the old archive once it is
+	 * complete, since a running server may have the old one mapped */
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", out);
+	SYS(fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+	off = align(meta_size);
+	for (i = 0; i < nr_files; i++) {
+		struct file *f = &files[i];
+		struct pack_entry *e = &entries[f->slot];
+
+		if (f->size > buf_size) {
+			buf_size = f->size;
+			buf = Realloc(buf, buf_size);
+		}
+		SYS(srcfd = open(f->name, O_RDONLY, 0));
+		if (Rio_read(srcfd, buf, f->size) != f->size) {
+			fprintf(stderr, "%s: changed while packing\n", f->name);
+			exit(1);
+		}
+		SYS(close(srcfd));
+		SYS(lseek(fd, off, SEEK_SET));
+		Rio_write(fd, buf, f->size);
+
+		e->offset = off;
+		e->size = f->size;
+		e->mtime_sec = f->mtime.tv_sec;
+		e->mtime_nsec = f->mtime.tv_nsec;
+		e->csum = csum_bytes(buf, f->size);
+		e->name_off = names - meta;
+		e->name_len = f->len;
+		memcpy(names, f->name, f->len + 1);
+		names += f->len + 1;
+		off = align(off + f->size);
+	}
+
+	hdr.magic = PACK_MAGIC;
+	hdr.version = PACK_VERSION;
+	hdr.nr_files = nr_files;
+	hdr.nr_buckets = nr_buckets;
+	hdr.size = lseek(fd, 0, SEEK_END);
+	memcpy(meta, &hdr, sizeof(hdr));
+	SYS(lseek(fd, 0, SEEK_SET));
+	Rio_write(fd, meta, meta_size);
+	SYS(close(fd));
+	SYS(rename(tmpname, out));
+
+	printf("%s: %u files, %ld bytes, %u buckets, "
+	       "%.2f displacements tried per bucket\n", out, nr_files,
+	       (long)hdr.size, nr_buckets, (double)tries / nr_buckets);
+	exit(0);
+}
@@ -0,0 +1,64 @@
+#ifndef __PACK_H__
+#define __PACK_H__
+
+#include <stdint.h>
+
+/* The format of the archives built by pack and served by the server with -a
+ * (see archive.h). An archive holds a set of files, each under the name a
+ * client requests it by, without the leading slash, e.g.,
+ * "fileset_dir/00000". It is laid out as:
+ *
+ *	struct pack_header
+ *	uint32_t disp[nr_buckets]	displacements of the hash, see below
+ *	struct pack_entry[nr_files]	indexed by the hash of the name
+ *	names				NUL-terminated
+ *	file contents			each starting on a PACK_ALIGN boundary
+ *
+ * The index is a minimal perfect hash of the names (hash and displace): a
+ * name goes to bucket pack_hash(name, 0) % nr_buckets, and then to entry
+ * pack_hash(name, disp[bucket]) % nr_files. pack picks the displacements so
+ * that no two names share an entry, so a lookup is one probe, and one
+ * comparison to tell names that are not in the archive apart. */
+
+#define PACK_MAGIC 0x4b434150	/* "PACK" */
+#define PACK_VERSION 1
+#define PACK_ALIGN 4096
+
+struct pack_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nr_files;
+	uint32_t nr_buckets;
+	uint64_t size;		/* of the whole archive */
+};
+
+struct pack_entry {
+	uint64_t offset;	/* of the contents, from the archive start */
+	uint64_t size;
+	int64_t mtime_sec;
+	uint32_t mtime_nsec;
+	uint32_t csum;		/* see csum.h */
+	uint32_t name_off;	/* from the archive start */
+	uint32_t name_len;	/* without the NUL */
+};
+
+/* FNV-1a, with the seed mixed in first and a final mix so that the low bits,
+ * which the modulus keeps, depend on all of the name */
+static inline uint64_t
+pack_hash(const char *name, int len, uint32_t seed)
+{
+	uint64_t h = 14695981039346656037ULL ^
+		(seed * 0x9e3779b97f4a7c15ULL);
+	int i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)name[i];
+		h *= 1099511628211ULL;
+	}
+	h ^= h >> 31;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 29;
+	return h;
+}
+
+#endif /* __PACK_H__ */
@@ -0,0 +1,261 @@
+/*
+ * peer.c: a cache cluster of servers (see peer.h).
+ */
+
+#include <time.h>
+#include "common.h"
+#include "peer.h"
+#include "log.h"
+#include "bufpool.h"
+#include "chash.h"
+#include "upstream.h"
+
+#define PEER_MAX 64
+
+struct peer {
+	struct upstream u;
+	long retry;		/* when to try the peer again, while down */
+	/* statistics */
+	long fetches;
+	long bytes;
+	long failures;		/* fetches the peer could not serve */
+};
+
+struct peers {
+	struct peer *peers;
+	int nr_peers;
+	int self;		/* this server, among peers */
+	struct chash *ring;
+	int max_fetching;	/* fetches at once, leaving a thread free */
+	int fetching;
+	long busy;		/* fetches left to storage */
+};
+
+static long
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* peers that are down own no files until they are retried */
+static int
+peer_ok(void *arg, int i)
+{
+	struct peers *p = (struct peers *)arg;
+	struct peer *pe = &p->peers[i];
+
+	return i == p->self || pe->u.up || now_ms() >= pe->retry;
+}
+
+/* returns the owner of the file called name */
+static int
+peers_owner(struct peers *p, const char *name)
+{
+	return chash_pick(p->ring, name, strlen(name), peer_ok, p);
+}
+
+/* marks pe down, timedout if connecting to it, or a read or write, took
+ * longer than PEER_TIMEOUT_MS */
+static void
+peer_down(struct peer *pe, int timedout)
+{
+	pe->retry = now_ms() + PEER_RETRY_MS;
+	if (!pe->u.up)
+		return;
+	upstream_down(&pe->u);
+	log_msg(LOG_WARN, "peer %s is down%s", pe->u.name,
+		timedout ? ", it timed out" : "");
+}
+
+int
+peers_owns(struct peers *p, const char *name)
+{
+	return peers_owner(p, name) == p->self;
+}
+
+/* reads the body of the response r on fd, of r->length bytes, the first of
+ * which came with the headers, into a buffer from bufpool. Returns it, or
+ * NULL if the connection ends first. */
+static char *
+peer_read_body(int fd, const struct upstream_response *r)
+{
+	char *buf;
+	long n = r->n - r->hlen;
+	ssize_t got;
+
+	if (r->length == 0)
+		return NULL;
+	buf = bufpool_alloc(r->length);
+	if (n > r->length)
+		n = r->length;
+	memcpy(buf, r->buf + r->hlen, n);
+	while (n < r->length) {
+		got = read(fd, buf + n, r->length - n);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0) {
+			bufpool_free(buf);
+			return NULL;
+		}
+		n += got;
+	}
+	return buf;
+}
+
+/* fetches the file of data from peer pe */
+static int
+peer_fetch(struct peers *p, struct peer *pe, struct file_data *data,
+	   long max_size)
+{
+	char req[MAXLINE], head[MAXBUF], *buf;
+	struct upstream_response r;
+	const char *etag;
+	unsigned int size, csum;
+	long sec, nsec;
+	int fd, len, timedout;
+
+	len = snprintf(req, sizeof(req), "GET %s HTTP/1.0\r\n"
+		       PEER_HEADER ": %s\r\n"
+		       "Connection: keep-alive\r\n\r\n", data->file_name + 2,
+		       p->peers[p->self].u.name);
+	if (len >= (int)sizeof(req))
+		return 0;
+	if ((fd = upstream_request(&pe->u, req, len, head, sizeof(head),
+				   &r)) < 0) {
+		__sync_add_and_fetch(&pe->failures, 1);
+		peer_down(pe, fd == -3);
+		return 0;
+	}
+	if (!pe->u.up) {
+		pe->u.up = 1;
+		log_msg(LOG_WARN, "peer %s is up", pe->u.name);
+	}
+	if (r.length < 0 || r.length > max_size) {
+		upstream_done(&pe->u, fd, &r, 0);
+		__sync_add_and_fetch(&pe->failures, 1);
+		return 0;
+	}
+	errno = 0;
+	buf = peer_read_body(fd, &r);
+	if (r.length && !buf) {
+		/* SO_RCVTIMEO fails the read so */
+		timedout = errno == EAGAIN || errno == EWOULDBLOCK;
+		upstream_done(&pe->u, fd, &r, 0);
+		__sync_add_and_fetch(&pe->failures, 1);
+		if (timedout)
+			peer_down(pe, 1);
+		return 0;
+	}
+	upstream_done(&pe->u, fd, &r, 1);
+
+	/* the entity tag carries the rest of the file data, see
+	 * request_etag, so that peers send the same one for the file */
+	etag = upstream_header(&r, "ETag");
+	if (r.status != 200 || !etag ||
+	    sscanf(etag, "\"%x-%lx.%lx-%x\"", &size, &sec, &nsec,
+		   &csum) != 4 || size != r.length) {
+		bufpool_free(buf);
+		__sync_add_and_fetch(&pe->failures, 1);
+		return 0;
+	}
+	data->file_buf = buf;
+	data->file_size = size;
+	data->file_mtime.tv_sec = sec;
+	data->file_mtime.tv_nsec = nsec;
+	data->file_csum = csum;
+	__sync_add_and_fetch(&pe->fetches, 1);
+	__sync_add_and_fetch(&pe->bytes, size);
+	return 1;
+}
+
+int
+peers_fetch(struct peers *p, struct file_data *data, long max_size)
+{
+	int owner, ret;
+
+	owner = peers_owner(p, data->file_name);
+	/* names are "./" and the URI, see request_parse_URI */
+	if (owner == p->self || strncmp(data->file_name, "./", 2) != 0)
+		return 0;
+	if (__sync_add_and_fetch(&p->fetching, 1) > p->max_fetching) {
+		__sync_sub_and_fetch(&p->fetching, 1);
+		__sync_add_and_fetch(&p->busy, 1);
+		return 0;
+	}
+	ret = peer_fetch(p, &p->peers[owner], data, max_size);
+	__sync_sub_and_fetch(&p->fetching, 1);
+	return ret;
+}
+
+struct peers *
+peers_init(const char *list, int port, int nr_threads)
+{
+	struct peers *p;
+	char buf[MAXLINE], *spec, *save, *names[PEER_MAX];
+
+	p = Malloc(sizeof(struct peers));
+	p->peers = Malloc(PEER_MAX * sizeof(struct peer));
+	p->nr_peers = 0;
+	p->self = -1;
+	p->ring = NULL;
+	p->max_fetching = nr_threads - 1;
+	p->fetching = 0;
+	p->busy = 0;
+	snprintf(buf, sizeof(buf), "%s", list);
+	for (spec = strtok_r(buf, ",", &save); spec;
+	     spec = strtok_r(NULL, ",", &save)) {
+		struct peer *pe = &p->peers[p->nr_peers];
+
+		if (p->nr_peers == PEER_MAX || !upstream_init(&pe->u, spec)) {
+			fprintf(stderr, "bad peer: %s\n", spec);
+			peers_exit(p);
+			return NULL;
+		}
+		pe->u.timeout_ms = PEER_TIMEOUT_MS;
+		if (ntohs(pe->u.addr.sin_port) == port)
+			p->self = p->nr_peers;
+		names[p->nr_peers] = pe->u.name;
+		pe->retry = 0;
+		pe->fetches = pe->bytes = pe->failures = 0;
+		p->nr_peers++;
+	}
+	if (p->self < 0) {
+		fprintf(stderr, "port %d is not among the peers\n", port);
+		peers_exit(p);
+		return NULL;
+	}
+	p->ring = chash_init(names, p->nr_peers);
+	return p;
+}
+
+void
+peers_print_stats(struct peers *p, FILE *out)
+{
+	int i;
+
+	for (i = 0; i < p->nr_peers; i++) {
+		struct peer *pe = &p->peers[i];
+
+		if (i == p->self)
+			continue;
+		fprintf(out, "peer %s fetches %ld bytes %ld failures %ld\n",
+			pe->u.name, pe->fetches, pe->bytes, pe->failures);
+	}
+	fprintf(out, "peer fetches left to storage %ld\n", p->busy);
+}
+
+void
+peers_exit(struct peers *p)
+{
+	int i;
+
+	for (i = 0; i < p->nr_peers; i++)
+		upstream_destroy(&p->peers[i].u);
+	if (p->ring)
+		chash_destroy(p->ring);
+	free(p->peers);
+	free(p);
+}
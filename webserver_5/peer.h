@@ -0,0 +1,51 @@
+#ifndef __PEER_H__
+#define __PEER_H__
+
+#include <stdio.h>
+#include "request.h"
+
+/* A cache cluster of servers, the peers, each started with the same list of
+ * their ports. Every file has an owner among the peers, by a consistent hash
+ * of its name (see chash.h), and only the owner caches it: a server that
+ * misses in its cache on a file owned by another peer fetches the file from
+ * that peer's cache, with an internal GET, rather than reading it from
+ * storage. So the peers together cache as many files as their caches hold,
+ * rather than each caching the same hot files.
+ *
+ * A server fetches with fewer threads than it serves requests with, so
+ * that it always has one free to serve the fetches of other peers, which
+ * are never passed on. Without that, the threads of two peers could all be
+ * waiting on each other. A fetch that would take the last thread reads the
+ * file from storage instead.
+ *
+ * A peer that can't be reached, or takes longer than PEER_TIMEOUT_MS to
+ * accept a connection, respond, or send a file, is skipped, and its files
+ * move to the next peers on the ring, until it is tried again
+ * PEER_RETRY_MS later. Connections to the peers are kept open between
+ * fetches when they run with -e. */
+
+#define PEER_TIMEOUT_MS 1000
+#define PEER_RETRY_MS 1000
+#define PEER_HEADER "X-Peer"	/* marks the requests of peers */
+
+struct peers;
+
+/* list is a comma separated list of ports, or host:port, which includes
+ * port, the one this server listens on. nr_threads is the number of threads
+ * that serve requests, and may fetch, or the fewest there may be, if their
+ * number changes. Returns NULL, after printing why, if
+ * list is malformed. */
+struct peers *peers_init(const char *list, int port, int nr_threads);
+/* returns 1 if this server owns the file called name */
+int peers_owns(struct peers *p, const char *name);
+/* fetches the file of data, which another peer owns, from that peer into
+ * data. Returns 0 if the peer can't send it, e.g., if it does not exist, or
+ * is larger than max_size, or if there is no thread to spare for the fetch,
+ * so that it should be read from storage. */
+int peers_fetch(struct peers *p, struct file_data *data, long max_size);
+/* prints the fetches from each peer, those that failed, and those that
+ * were left to storage for want of a thread */
+void peers_print_stats(struct peers *p, FILE *out);
+void peers_exit(struct peers *p);
+
+#endif /* __PEER_H__ */
@@ -0,0 +1,364 @@
+/*
+ * pool.c: an adaptive pool of worker threads (see pool.h).
+ */
+
+#include <sys/syscall.h>
+#include "common.h"
+#include "pool.h"
+#include "log.h"
+
+#define CACHE_LINE 64
+
+enum pool_state {
+	POOL_FREE,		/* no thread */
+	POOL_RUNNING,
+	POOL_LEFT,		/* left the pool, not yet joined */
+};
+
+struct pool_thread {
+	struct pool *p;
+	pthread_t thread;
+	enum pool_state state;	/* under the pool's lock */
+	pid_t tid;		/* 0 until it has started */
+	long run_delay;		/* ns spent waiting for a CPU, when last read */
+	/* written by the thread only */
+	long busy_ns;		/* serving requests */
+	long cpu_ns;		/* running, while serving requests */
+} __attribute__((aligned(CACHE_LINE)));
+
+struct pool {
+	struct pool_limits limits;
+	void *(*worker)(void *arg);
+	int (*queued)(void *arg);
+	void (*wake)(void *arg);
+	void *arg;
+	int nr_cpus;
+	pthread_t controller;
+	pthread_mutex_t lock;	/* protects all below */
+	pthread_cond_t stop;
+	int stopped;
+	int nr;			/* workers in the pool */
+	int target;		/* workers there should be */
+	struct pool_thread *threads; /* limits.max of them */
+	/* statistics */
+	int peak;
+	int nr_grown;
+	int nr_shrunk;
+};
+
+/* the pool thread running this one, NULL for other threads */
+static __thread struct pool_thread *pool_self;
+
+static long
+ts_ns(const struct timespec *ts)
+{
+	return ts->tv_sec * 1000000000L + ts->tv_nsec;
+}
+
+int
+pool_parse(const char *spec, struct pool_limits *limits)
+{
+	if (sscanf(spec, "%d,%d", &limits->min, &limits->max) != 2 ||
+	    limits->min < 1 || limits->max < limits->min) {
+		fprintf(stderr, "pool limits should be min,max with "
+			"0 < min <= max\n");
+		return 0;
+	}
+	return 1;
+}
+
+static void *
+pool_main(void *arg)
+{
+	struct pool_thread *pt = (struct pool_thread *)arg;
+
+	pool_self = pt;
+	__atomic_store_n(&pt->tid, syscall(SYS_gettid), __ATOMIC_RELEASE);
+	return pt->p->worker(pt->p->arg);
+}
+
+/* adds nr workers. The lock must be held. */
+static void
+pool_grow(struct pool *p, int nr)
+{
+	struct pool_thread *pt;
+	int i;
+
+	for (i = 0; i < p->limits.max && nr > 0; i++) {
+		pt = &p->threads[i];
+		if (pt->state == POOL_LEFT) {
+			pthread_join(pt->thread, NULL);
+			pt->state = POOL_FREE;
+		}
+		if (pt->state != POOL_FREE)
+			continue;
+		pt->state = POOL_RUNNING;
+		pt->tid = 0;
+		pt->run_delay = 0;
+		pthread_create(&pt->thread, NULL, pool_main, pt);
+		p->nr++;
+		nr--;
+	}
+	p->target = p->nr;
+	if (p->nr > p->peak)
+		p->peak = p->nr;
+}
+
+/* joins the workers that left the pool. The lock must be held. */
+static void
+pool_reap(struct pool *p)
+{
+	int i;
+
+	for (i = 0; i < p->limits.max; i++) {
+		if (p->threads[i].state == POOL_LEFT) {
+			pthread_join(p->threads[i].thread, NULL);
+			p->threads[i].state = POOL_FREE;
+		}
+	}
+}
+
+/* the sums of the busy and CPU time of all the workers, past and present */
+static void
+pool_times(struct pool *p, long *busy, long *cpu)
+{
+	int i;
+
+	*busy = *cpu = 0;
+	for (i = 0; i < p->limits.max; i++) {
+		*busy += __atomic_load_n(&p->threads[i].busy_ns,
+					 __ATOMIC_RELAXED);
+		*cpu += __atomic_load_n(&p->threads[i].cpu_ns,
+					__ATOMIC_RELAXED);
+	}
+}
+
+/* returns the time the workers spent waiting for a CPU, while runnable,
+ * since the last call. It is part of the wall time of their requests, but
+ * is not time they were blocked. The lock must be held. */
+static long
+pool_run_delay(struct pool *p)
+{
+	struct pool_thread *pt;
+	char path[64];
+	long cpu, delay, sum = 0;
+	pid_t tid;
+	FILE *f;
+	int i;
+
+	for (i = 0; i < p->limits.max; i++) {
+		pt = &p->threads[i];
+		tid = __atomic_load_n(&pt->tid, __ATOMIC_ACQUIRE);
+		if (pt->state != POOL_RUNNING || tid == 0)
+			continue;
+		/* the CPU time, the time waiting for a CPU, and the number of
+		 * times the thread ran, see sched-stats.rst */
+		snprintf(path, sizeof(path), "/proc/self/task/%d/schedstat",
+			 (int)tid);
+		if (!(f = fopen(path, "r")))
+			continue;
+		if (fscanf(f, "%ld %ld", &cpu, &delay) == 2 &&
+		    delay > pt->run_delay) {
+			sum += delay - pt->run_delay;
+			pt->run_delay = delay;
+		}
+		fclose(f);
+	}
+	return sum;
+}
+
+static void *
+pool_controller(void *arg)
+{
+	struct pool *p = (struct pool *)arg;
+	struct timespec deadline;
+	long busy, cpu, last_busy, last_cpu, wait, blocked_ns;
+	int util, blocked, queued, nr, step, i;
+	int grow_ticks = 0, shrink_ticks = 0;
+
+	pool_times(p, &last_busy, &last_cpu);
+	pthread_mutex_lock(&p->lock);
+	while (!p->stopped) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += POOL_TICK_MS * 1000000L;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+		deadline.tv_nsec %= 1000000000L;
+		pthread_cond_timedwait(&p->stop, &p->lock, &deadline);
+		if (p->stopped)
+			break;
+		pool_reap(p);
+		nr = p->nr;
+		wait = pool_run_delay(p);
+		pthread_mutex_unlock(&p->lock);
+
+		pool_times(p, &busy, &cpu);
+		util = (busy - last_busy) * 100 /
+			((long)POOL_TICK_MS * 1000000L * (nr > 0 ? nr : 1));
+		blocked_ns = busy - last_busy - (cpu - last_cpu) - wait;
+		blocked = busy > last_busy && blocked_ns > 0 ?
+			blocked_ns * 100 / (busy - last_busy) : 0;
+		last_busy = busy;
+		last_cpu = cpu;
+		queued = p->queued(p->arg);
+
+		if (queued > 0 && util >= POOL_HIGH_PCT &&
+		    (blocked >= POOL_BLOCKED_PCT || nr < p->nr_cpus))
+			grow_ticks++;
+		else
+			grow_ticks = 0;
+		if ((queued == 0 && util < POOL_LOW_PCT) ||
+		    (nr > p->nr_cpus && util > 0 &&
+		     blocked < POOL_CPU_BOUND_PCT))
+			shrink_ticks++;
+		else
+			shrink_ticks = 0;
+
+		pthread_mutex_lock(&p->lock);
+		if (grow_ticks >= POOL_GROW_TICKS && nr < p->limits.max) {
+			step = (nr > queued ? nr : queued) / 4;
+			if (step < 1)
+				step = 1;
+			if (step > p->limits.max - nr)
+				step = p->limits.max - nr;
+			pool_grow(p, step);
+			p->nr_grown++;
+			log_msg(LOG_INFO, "pool: %d -> %d threads, busy %d%% "
+				"blocked %d%% queued %d", nr, p->nr, util,
+				blocked, queued);
+			grow_ticks = shrink_ticks = 0;
+		} else if (shrink_ticks >= POOL_SHRINK_TICKS &&
+			   nr > p->limits.min) {
+			step = nr / 8 > 1 ? nr / 8 : 1;
+			if (step > nr - p->limits.min)
+				step = nr - p->limits.min;
+			p->target = nr - step;
+			p->nr_shrunk++;
+			log_msg(LOG_INFO, "pool: %d -> %d threads, busy %d%% "
+				"blocked %d%% queued %d", nr, p->target, util,
+				blocked, queued);
+			grow_ticks = shrink_ticks = 0;
+			/* busy workers leave once done with their request,
+			 * idle ones must be woken */
+			if (queued == 0) {
+				pthread_mutex_unlock(&p->lock);
+				for (i = 0; i < step; i++)
+					p->wake(p->arg);
+				pthread_mutex_lock(&p->lock);
+			}
+		}
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+struct pool *
+pool_init(const struct pool_limits *limits, int nr_threads,
+	  void *(*worker)(void *arg), int (*queued)(void *arg),
+	  void (*wake)(void *arg), void *arg)
+{
+	struct pool *p;
+	void *threads = NULL;
+	int i;
+
+	p = Malloc(sizeof(struct pool));
+	memset(p, 0, sizeof(struct pool));
+	p->limits = *limits;
+	p->worker = worker;
+	p->queued = queued;
+	p->wake = wake;
+	p->arg = arg;
+	p->nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->stop, NULL);
+	if (posix_memalign(&threads, CACHE_LINE,
+			   limits->max * sizeof(struct pool_thread)) != 0)
+		unix_error("posix_memalign error");
+	p->threads = threads;
+	memset(p->threads, 0, limits->max * sizeof(struct pool_thread));
+	for (i = 0; i < limits->max; i++)
+		p->threads[i].p = p;
+	if (nr_threads < limits->min)
+		nr_threads = limits->min;
+	if (nr_threads > limits->max)
+		nr_threads = limits->max;
+	pthread_mutex_lock(&p->lock);
+	pool_grow(p, nr_threads);
+	pthread_mutex_unlock(&p->lock);
+	pthread_create(&p->controller, NULL, pool_controller, p);
+	return p;
+}
+
+void
+pool_begin(struct pool_clock *c)
+{
+	clock_gettime(CLOCK_MONOTONIC, &c->wall);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &c->cpu);
+}
+
+void
+pool_end(struct pool *p, struct pool_clock *c)
+{
+	struct pool_thread *pt = pool_self;
+	struct timespec wall, cpu;
+
+	if (!pt)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &wall);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+	__atomic_store_n(&pt->busy_ns, pt->busy_ns + ts_ns(&wall) -
+			 ts_ns(&c->wall), __ATOMIC_RELAXED);
+	__atomic_store_n(&pt->cpu_ns, pt->cpu_ns + ts_ns(&cpu) -
+			 ts_ns(&c->cpu), __ATOMIC_RELAXED);
+}
+
+int
+pool_leave(struct pool *p)
+{
+	int leave = 0;
+
+	if (!pool_self || __atomic_load_n(&p->nr, __ATOMIC_RELAXED) <=
+	    __atomic_load_n(&p->target, __ATOMIC_RELAXED))
+		return 0;
+	pthread_mutex_lock(&p->lock);
+	if (p->nr > p->target) {
+		p->nr--;
+		pool_self->state = POOL_LEFT;
+		leave = 1;
+	}
+	pthread_mutex_unlock(&p->lock);
+	return leave;
+}
+
+int
+pool_size(struct pool *p)
+{
+	return __atomic_load_n(&p->nr, __ATOMIC_RELAXED);
+}
+
+void
+pool_print_stats(struct pool *p, FILE *out)
+{
+	fprintf(out, "pool min %d max %d threads %d peak %d grown %d "
+		"shrunk %d\n", p->limits.min, p->limits.max, p->nr, p->peak,
+		p->nr_grown, p->nr_shrunk);
+}
+
+void
+pool_exit(struct pool *p)
+{
+	int i;
+
+	pthread_mutex_lock(&p->lock);
+	p->stopped = 1;
+	pthread_cond_signal(&p->stop);
+	pthread_mutex_unlock(&p->lock);
+	pthread_join(p->controller, NULL);
+	for (i = 0; i < p->limits.max; i++) {
+		if (p->threads[i].state != POOL_FREE)
+			pthread_join(p->threads[i].thread, NULL);
+	}
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->stop);
+	free(p->threads);
+	free(p);
+}
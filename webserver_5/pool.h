@@ -0,0 +1,82 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <stdio.h>
+#include <time.h>
+
+/* A pool of worker threads whose size adapts to the load, between a min
+ * and a max, instead of nr_threads fixed at startup. A controller thread
+ * looks at the pool every POOL_TICK_MS:
+ *	- the connections queued for the workers
+ *	- the utilisation of the workers, the part of their time spent
+ *	  serving requests
+ *	- the part of that time they were blocked, e.g., reading files or
+ *	  sending to slow clients, which is the wall time of the requests
+ *	  less the CPU time of the threads and the time they were runnable
+ *	  but waiting for a CPU (from /proc/self/task/TID/schedstat)
+ *
+ * The pool grows, by a quarter, or by a quarter of the connections queued
+ * if there are more of them, while connections are queued and the
+ * workers are over POOL_HIGH_PCT busy, for POOL_GROW_TICKS in a row, as
+ * long as the workers are blocked at least POOL_BLOCKED_PCT of the time,
+ * or there are fewer workers than CPUs: more threads only help when the
+ * ones there are wait for something other than the CPU.
+ *
+ * It shrinks, by an eighth, when it has been idle, with nothing queued and
+ * the workers under POOL_LOW_PCT busy, or has had more workers than CPUs
+ * while they were blocked under POOL_CPU_BOUND_PCT of the time, for
+ * POOL_SHRINK_TICKS in a row. The gaps between the thresholds, and growing
+ * quickly but shrinking slowly, keep the pool from swinging back and forth.
+ *
+ * A worker leaves the pool once it is done with a request, or woken up
+ * for the purpose, when the pool is larger than it should be.
+ *
+ * The limits are given as min,max. */
+
+#define POOL_TICK_MS 100
+#define POOL_HIGH_PCT 80
+#define POOL_LOW_PCT 30
+#define POOL_BLOCKED_PCT 50
+#define POOL_CPU_BOUND_PCT 10
+#define POOL_GROW_TICKS 2
+#define POOL_SHRINK_TICKS 20
+
+struct pool_limits {
+	int min;
+	int max;
+};
+
+/* the start of a request, see pool_end */
+struct pool_clock {
+	struct timespec wall;
+	struct timespec cpu;
+};
+
+struct pool;
+
+/* fills in limits from spec. Returns 0 if spec is malformed. */
+int pool_parse(const char *spec, struct pool_limits *limits);
+/* starts nr_threads workers, within limits, that run worker(arg), and the
+ * controller. queued(arg) returns the connections waiting for the workers,
+ * and wake(arg) wakes up an idle worker, so that it may leave the pool,
+ * without adding to what queued returns. */
+struct pool *pool_init(const struct pool_limits *limits, int nr_threads,
+		       void *(*worker)(void *arg), int (*queued)(void *arg),
+		       void (*wake)(void *arg), void *arg);
+/* a worker starts serving a request */
+void pool_begin(struct pool_clock *c);
+/* the worker is done with the request started at c */
+void pool_end(struct pool *p, struct pool_clock *c);
+/* returns 1 if the calling worker should leave the pool, by returning
+ * from worker, which it must then do */
+int pool_leave(struct pool *p);
+/* returns the number of workers in the pool */
+int pool_size(struct pool *p);
+/* prints the limits, and the size of the pool now, at its peak, and the
+ * times it grew and shrank */
+void pool_print_stats(struct pool *p, FILE *out);
+/* stops the controller and waits for the workers, which must have been
+ * told to exit, to do so */
+void pool_exit(struct pool *p);
+
+#endif /* __POOL_H__ */
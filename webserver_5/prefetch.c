@@ -0,0 +1,490 @@
+/*
+ * prefetch.c: a Markov prefetcher (see prefetch.h).
+ */
+
+#include <time.h>
+#include "common.h"
+#include "prefetch.h"
+#include "storage.h"
+#include "bufpool.h"
+
+/* a file that came next after another */
+struct prefetch_next {
+	int file;		/* in files */
+	unsigned int hash;	/* of its name, the file is gone if it differs */
+	int count;		/* 0 for none */
+};
+
+struct prefetch_file {
+	char *name;		/* NULL for none */
+	unsigned int hash;	/* read by the other shards, see file_hash */
+	int total;		/* of the counts of next */
+	struct prefetch_next next[PREFETCH_NEXT];
+};
+
+struct prefetch_client {
+	unsigned char addr[16];	/* IPv6, or IPv4 mapped to IPv6 */
+	int file;		/* the last file it asked for, -1 for none */
+	unsigned int hash;
+	long time;		/* of that request, in ms */
+};
+
+struct prefetch_item {
+	char *name;
+	long time;		/* when it was queued, in ms */
+};
+
+/* the client on a connection, recorded when it was accepted */
+struct prefetch_conn {
+	unsigned char addr[16];
+	int known;
+};
+
+struct prefetch {
+	long (*load)(void *arg, const char *name);
+	void *arg;
+	int nr_threads;
+	pthread_t *threads;
+	/* file i and client i are protected by shard i % PREFETCH_SHARDS */
+	pthread_mutex_t shards[PREFETCH_SHARDS];
+	struct prefetch_file files[PREFETCH_FILES];
+	struct prefetch_client clients[PREFETCH_CLIENTS];
+	struct prefetch_conn *conns; /* by descriptor, see prefetch_accept */
+	pthread_mutex_t lock;	/* protects all below */
+	pthread_cond_t queued;
+	pthread_cond_t loaded;	/* a file being read is in the cache */
+	char **loading;		/* files being read, one slot per thread */
+	int stopped;
+	struct prefetch_item queue[PREFETCH_QUEUE];
+	int head;		/* of the queue */
+	int nr_queued;
+	/* statistics */
+	long nr_learned;	/* transitions, counted without the lock */
+	long nr_issued;		/* prefetches that read a file */
+	long issued_bytes;
+	long nr_used;		/* prefetched files then requested */
+	long used_bytes;
+	long nr_joined;		/* requests that waited for a prefetch */
+	long nr_dropped;	/* stale, or pushed out of the queue */
+	long nr_skipped;	/* cached already, or could not be read */
+};
+
+static long
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static unsigned int
+prefetch_hash(const unsigned char *key, int len)
+{
+	unsigned int h = 2166136261u;
+	int i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ key[i]) * 16777619u;
+	return h;
+}
+
+static pthread_mutex_t *
+shard(struct prefetch *p, int i)
+{
+	return &p->shards[i % PREFETCH_SHARDS];
+}
+
+/* returns a copy of name, which bufpool_free frees */
+static char *
+prefetch_name(const char *name)
+{
+	char *copy = bufpool_alloc(strlen(name) + 1);
+
+	strcpy(copy, name);
+	return copy;
+}
+
+/* the address sa, as IPv6 */
+static void
+prefetch_sockaddr(const struct sockaddr *sa, unsigned char *addr)
+{
+	memset(addr, 0, 16);
+	if (sa->sa_family == AF_INET) {
+		addr[10] = addr[11] = 0xff;
+		memcpy(addr + 12, &((struct sockaddr_in *)sa)->sin_addr, 4);
+	} else if (sa->sa_family == AF_INET6) {
+		memcpy(addr, &((struct sockaddr_in6 *)sa)->sin6_addr, 16);
+	}
+}
+
+/* the address of the client on connfd, as recorded by prefetch_accept, or
+ * else as getpeername says */
+static void
+prefetch_addr(struct prefetch *p, int connfd, unsigned char *addr)
+{
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof(ss);
+
+	if (connfd < PREFETCH_CONNS && p->conns[connfd].known) {
+		memcpy(addr, p->conns[connfd].addr, 16);
+		return;
+	}
+	memset(addr, 0, 16);
+	if (getpeername(connfd, (struct sockaddr *)&ss, &len) == 0)
+		prefetch_sockaddr((struct sockaddr *)&ss, addr);
+}
+
+/* the hash of file i, which may be in another shard than the one held */
+static unsigned int
+file_hash(struct prefetch *p, int i)
+{
+	return __atomic_load_n(&p->files[i].hash, __ATOMIC_RELAXED);
+}
+
+/* makes the file called name the one in its slot of the table, taking the
+ * slot from any other file. The lock of its shard must be held. */
+static void
+file_get(struct prefetch *p, const char *name, unsigned int hash)
+{
+	struct prefetch_file *f = &p->files[hash % PREFETCH_FILES];
+
+	if (f->name && f->hash == hash && strcmp(f->name, name) == 0)
+		return;
+	bufpool_free(f->name);
+	f->name = prefetch_name(name);
+	f->total = 0;
+	memset(f->next, 0, sizeof(f->next));
+	__atomic_store_n(&f->hash, hash, __ATOMIC_RELAXED);
+}
+
+/* returns 1 if n is a file that is still in the table */
+static int
+next_valid(struct prefetch *p, const struct prefetch_next *n)
+{
+	return n->count > 0 && file_hash(p, n->file) == n->hash;
+}
+
+/* counts a transition from file from to file to, whose hash is hash. The
+ * lock of the shard of from must be held. */
+static void
+file_learn(struct prefetch *p, int from, int to, unsigned int hash)
+{
+	struct prefetch_file *f = &p->files[from];
+	struct prefetch_next *n, *least = NULL;
+	int i;
+
+	__sync_add_and_fetch(&p->nr_learned, 1);
+	for (i = 0; i < PREFETCH_NEXT; i++) {
+		n = &f->next[i];
+		if (!next_valid(p, n)) {
+			f->total -= n->count;
+			n->count = 0;
+		} else if (n->file == to && n->hash == hash) {
+			break;
+		}
+		if (!least || n->count < least->count)
+			least = n;
+	}
+	if (i == PREFETCH_NEXT) {
+		n = least;
+		f->total -= n->count;
+		n->file = to;
+		n->hash = hash;
+		n->count = 0;
+	}
+	n->count++;
+	f->total++;
+	if (f->total >= PREFETCH_DECAY) {
+		f->total = 0;
+		for (i = 0; i < PREFETCH_NEXT; i++) {
+			f->next[i].count /= 2;
+			f->total += f->next[i].count;
+		}
+	}
+}
+
+/* queues a prefetch of name, unless it is queued already */
+static void
+prefetch_push(struct prefetch *p, const char *name, long now)
+{
+	struct prefetch_item *it;
+	char *copy = prefetch_name(name);
+	int i;
+
+	pthread_mutex_lock(&p->lock);
+	for (i = 0; i < p->nr_queued; i++) {
+		if (strcmp(p->queue[(p->head + i) % PREFETCH_QUEUE].name,
+			   name) == 0) {
+			pthread_mutex_unlock(&p->lock);
+			bufpool_free(copy);
+			return;
+		}
+	}
+	if (p->nr_queued == PREFETCH_QUEUE) {
+		bufpool_free(p->queue[p->head].name);
+		p->head = (p->head + 1) % PREFETCH_QUEUE;
+		p->nr_queued--;
+		p->nr_dropped++;
+	}
+	it = &p->queue[(p->head + p->nr_queued) % PREFETCH_QUEUE];
+	it->name = copy;
+	it->time = now;
+	p->nr_queued++;
+	pthread_cond_signal(&p->queued);
+	pthread_mutex_unlock(&p->lock);
+}
+
+/* copies the name of the file n refers to into name, of MAXLINE bytes.
+ * Returns 0 if it is no longer in the table. */
+static int
+next_name(struct prefetch *p, const struct prefetch_next *n, char *name)
+{
+	struct prefetch_file *f = &p->files[n->file];
+	int found;
+
+	pthread_mutex_lock(shard(p, n->file));
+	if ((found = f->name && f->hash == n->hash))
+		snprintf(name, MAXLINE, "%s", f->name);
+	pthread_mutex_unlock(shard(p, n->file));
+	return found;
+}
+
+/* queues the files likely to be asked for after file, whose hash is hash,
+ * and, to be read in time, those likely after the most likely of them, up
+ * to PREFETCH_DEPTH files ahead. Only one shard is locked at a time, each
+ * file's next files being copied out of it. */
+static void
+prefetch_predict(struct prefetch *p, int file, unsigned int hash, long now)
+{
+	struct prefetch_next next[PREFETCH_NEXT], *n, *best;
+	char name[MAXLINE];
+	int depth, i, total, pct = 100;
+
+	for (depth = 0; depth < PREFETCH_DEPTH; depth++) {
+		pthread_mutex_lock(shard(p, file));
+		if (p->files[file].hash != hash) {
+			pthread_mutex_unlock(shard(p, file));
+			break;
+		}
+		memcpy(next, p->files[file].next, sizeof(next));
+		total = p->files[file].total;
+		pthread_mutex_unlock(shard(p, file));
+		best = NULL;
+		for (i = 0; i < PREFETCH_NEXT; i++) {
+			n = &next[i];
+			/* the chance of getting to n from the first file */
+			if (!next_valid(p, n) || n->count < PREFETCH_MIN ||
+			    pct * n->count < total * PREFETCH_MIN_PCT)
+				continue;
+			if (next_name(p, n, name))
+				prefetch_push(p, name, now);
+			if (!best || n->count > best->count)
+				best = n;
+		}
+		if (!best)
+			break;
+		pct = pct * best->count / total;
+		file = best->file;
+		hash = best->hash;
+	}
+}
+
+void
+prefetch_accept(struct prefetch *p, int connfd, const struct sockaddr *sa)
+{
+	if (connfd >= PREFETCH_CONNS)
+		return;
+	if (sa)
+		prefetch_sockaddr(sa, p->conns[connfd].addr);
+	p->conns[connfd].known = sa != NULL;
+}
+
+void
+prefetch_request(struct prefetch *p, int connfd, const char *name)
+{
+	unsigned char addr[16];
+	unsigned int hash = prefetch_hash((const unsigned char *)name,
+					  strlen(name)), from_hash = 0;
+	struct prefetch_client *c;
+	long now = now_ms();
+	int i = hash % PREFETCH_FILES, ci, from = -1;
+
+	prefetch_addr(p, connfd, addr);
+	ci = prefetch_hash(addr, 16) % PREFETCH_CLIENTS;
+	c = &p->clients[ci];
+
+	/* the file the client asked for before this one */
+	pthread_mutex_lock(shard(p, ci));
+	if (c->time && memcmp(c->addr, addr, 16) == 0 && c->file != i &&
+	    now - c->time <= PREFETCH_GAP_MS) {
+		from = c->file;
+		from_hash = c->hash;
+	}
+	memcpy(c->addr, addr, 16);
+	c->file = i;
+	c->hash = hash;
+	c->time = now;
+	pthread_mutex_unlock(shard(p, ci));
+
+	pthread_mutex_lock(shard(p, i));
+	file_get(p, name, hash);
+	pthread_mutex_unlock(shard(p, i));
+
+	if (from >= 0) {
+		pthread_mutex_lock(shard(p, from));
+		if (p->files[from].name && p->files[from].hash == from_hash)
+			file_learn(p, from, i, hash);
+		pthread_mutex_unlock(shard(p, from));
+	}
+	prefetch_predict(p, i, hash, now);
+}
+
+void
+prefetch_used(struct prefetch *p, long size)
+{
+	pthread_mutex_lock(&p->lock);
+	p->nr_used++;
+	p->used_bytes += size;
+	pthread_mutex_unlock(&p->lock);
+}
+
+/* waits for storage to be idle, until the prefetch queued at time is stale.
+ * Returns 0 if it went stale. */
+static int
+prefetch_wait(struct prefetch *p, long time)
+{
+	while (!storage_idle()) {
+		if (p->stopped || now_ms() - time > PREFETCH_STALE_MS)
+			return 0;
+		usleep(1000);
+	}
+	return now_ms() - time <= PREFETCH_STALE_MS;
+}
+
+static void *
+prefetch_thread(void *arg)
+{
+	struct prefetch *p = (struct prefetch *)arg;
+	struct prefetch_item it;
+	long size = 0;
+	int ready, slot;
+
+	while (1) {
+		pthread_mutex_lock(&p->lock);
+		while (p->nr_queued == 0 && !p->stopped)
+			pthread_cond_wait(&p->queued, &p->lock);
+		if (p->stopped) {
+			pthread_mutex_unlock(&p->lock);
+			break;
+		}
+		/* the newest first, the client may be past the others */
+		it = p->queue[(p->head + --p->nr_queued) % PREFETCH_QUEUE];
+		for (slot = 0; p->loading[slot]; slot++)
+			;
+		p->loading[slot] = it.name;
+		pthread_mutex_unlock(&p->lock);
+
+		if ((ready = prefetch_wait(p, it.time)))
+			size = p->load(p->arg, it.name);
+
+		pthread_mutex_lock(&p->lock);
+		p->loading[slot] = NULL;
+		pthread_cond_broadcast(&p->loaded);
+		if (!ready) {
+			p->nr_dropped++;
+		} else if (size > 0) {
+			p->nr_issued++;
+			p->issued_bytes += size;
+		} else {
+			p->nr_skipped++;
+		}
+		pthread_mutex_unlock(&p->lock);
+		bufpool_free(it.name);
+	}
+	return NULL;
+}
+
+int
+prefetch_join(struct prefetch *p, const char *name)
+{
+	int i, joined = 0;
+
+	pthread_mutex_lock(&p->lock);
+	for (i = 0; i < p->nr_threads; i++) {
+		if (p->loading[i] && strcmp(p->loading[i], name) == 0) {
+			if (!joined++)
+				p->nr_joined++;
+			pthread_cond_wait(&p->loaded, &p->lock);
+			i = -1;	/* look again */
+		}
+	}
+	pthread_mutex_unlock(&p->lock);
+	return joined > 0;
+}
+
+struct prefetch *
+prefetch_init(int nr_threads, long (*load)(void *arg, const char *name),
+	      void *arg)
+{
+	struct prefetch *p;
+	int i;
+
+	p = Malloc(sizeof(struct prefetch));
+	memset(p, 0, sizeof(struct prefetch));
+	p->load = load;
+	p->arg = arg;
+	for (i = 0; i < PREFETCH_SHARDS; i++)
+		pthread_mutex_init(&p->shards[i], NULL);
+	p->conns = Malloc(PREFETCH_CONNS * sizeof(struct prefetch_conn));
+	memset(p->conns, 0, PREFETCH_CONNS * sizeof(struct prefetch_conn));
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->queued, NULL);
+	pthread_cond_init(&p->loaded, NULL);
+	p->nr_threads = nr_threads;
+	p->loading = Malloc(nr_threads * sizeof(char *));
+	memset(p->loading, 0, nr_threads * sizeof(char *));
+	p->threads = Malloc(nr_threads * sizeof(pthread_t));
+	for (i = 0; i < nr_threads; i++)
+		pthread_create(&p->threads[i], NULL, prefetch_thread, p);
+	return p;
+}
+
+void
+prefetch_print_stats(struct prefetch *p, FILE *out)
+{
+	long wasted = p->issued_bytes - p->used_bytes;
+
+	fprintf(out, "prefetch learned %ld issued %ld (%ld bytes) used %ld "
+		"(%ld waited) accuracy %.1f%% wasted %ld bytes dropped %ld "
+		"skipped %ld\n", p->nr_learned, p->nr_issued, p->issued_bytes,
+		p->nr_used, p->nr_joined,
+		p->nr_issued ? 100.0 * p->nr_used / p->nr_issued : 0.0,
+		wasted > 0 ? wasted : 0, p->nr_dropped, p->nr_skipped);
+}
+
+void
+prefetch_exit(struct prefetch *p)
+{
+	int i;
+
+	pthread_mutex_lock(&p->lock);
+	p->stopped = 1;
+	pthread_cond_broadcast(&p->queued);
+	pthread_mutex_unlock(&p->lock);
+	for (i = 0; i < p->nr_threads; i++)
+		pthread_join(p->threads[i], NULL);
+	for (i = 0; i < p->nr_queued; i++)
+		bufpool_free(p->queue[(p->head + i) % PREFETCH_QUEUE].name);
+	for (i = 0; i < PREFETCH_FILES; i++)
+		bufpool_free(p->files[i].name);
+	for (i = 0; i < PREFETCH_SHARDS; i++)
+		pthread_mutex_destroy(&p->shards[i]);
+	free(p->conns);
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->queued);
+	pthread_cond_destroy(&p->loaded);
+	free(p->loading);
+	free(p->threads);
+	free(p);
+}
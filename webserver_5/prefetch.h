@@ -0,0 +1,80 @@
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+#include <stdio.h>
+
+/* A prefetcher, which learns which files clients ask for after which, e.g.,
+ * a page and then its images, and reads the files a client is likely to ask
+ * for next into the cache before it does.
+ *
+ * It keeps a Markov table of the transitions from each file to the next
+ * file the same client asked for, clients being told apart by address as in
+ * fairq.h, and requests more than PREFETCH_GAP_MS apart not counting. A file
+ * keeps the PREFETCH_NEXT files that most often came next, with a count of
+ * each, and a new one takes the place of the least counted. The counts decay:
+ * they are halved whenever they add up to PREFETCH_DECAY, so that the table
+ * follows changes in what clients ask for.
+ *
+ * When a client asks for a file, the files that came next after it at least
+ * PREFETCH_MIN times, and at least PREFETCH_MIN_PCT percent of the time, are
+ * queued for the prefetch threads. So are the files likely to come next
+ * after the most likely of those, as long as the chance of getting to them
+ * is PREFETCH_MIN_PCT, up to PREFETCH_DEPTH files ahead, so that a client
+ * asking for files one after another does not catch up with the reads.
+ *
+ * The prefetch threads take the newest prefetches first, and read a file
+ * into the cache, unless it is cached already, only while storage is idle
+ * (see storage.h), so that prefetches don't hold up the reads of requests.
+ * Prefetches still waiting after PREFETCH_STALE_MS are dropped, as are the
+ * oldest when the queue is full. A request for a file that is being
+ * prefetched waits for the read, rather than reading the file again.
+ *
+ * The table is split into PREFETCH_SHARDS, each with a lock of its own, so
+ * that workers serving different files rarely wait for each other, and no
+ * more than one is locked at a time. The address of a client is recorded
+ * when its connection is accepted, rather than looked up for each request.
+ *
+ * The accuracy of the prefetches is the part of the files prefetched that
+ * were then requested while still cached. The bytes of the others are
+ * wasted. */
+
+#define PREFETCH_FILES 4096	/* files in the table */
+#define PREFETCH_NEXT 4		/* files that may come next, for each */
+#define PREFETCH_DECAY 64
+#define PREFETCH_MIN 2
+#define PREFETCH_MIN_PCT 30
+#define PREFETCH_DEPTH 3
+#define PREFETCH_CLIENTS 1024	/* clients whose last file is known */
+#define PREFETCH_GAP_MS 2000
+#define PREFETCH_QUEUE 64
+#define PREFETCH_STALE_MS 200
+#define PREFETCH_SHARDS 16	/* divides PREFETCH_FILES and _CLIENTS */
+#define PREFETCH_CONNS 65536	/* descriptors whose client is recorded */
+
+struct prefetch;
+struct sockaddr;
+
+/* starts nr_threads prefetch threads. load(arg, name) reads the file called
+ * name into the cache, and returns its size, or 0 if it was not read, e.g.,
+ * because it was cached already. */
+struct prefetch *prefetch_init(int nr_threads,
+			       long (*load)(void *arg, const char *name),
+			       void *arg);
+/* records the address sa of the client on connfd, which was just accepted,
+ * or, if sa is NULL, that it is not known. Connections on descriptors past
+ * PREFETCH_CONNS are looked up instead. */
+void prefetch_accept(struct prefetch *p, int connfd, const struct sockaddr *sa);
+/* the client on connfd asks for the file called name */
+void prefetch_request(struct prefetch *p, int connfd, const char *name);
+/* waits for the prefetch of the file called name, if one is reading it.
+ * Returns 1 if there was one, so the file may be cached now. */
+int prefetch_join(struct prefetch *p, const char *name);
+/* a prefetched file of size bytes was requested while cached */
+void prefetch_used(struct prefetch *p, long size);
+/* prints the transitions learned, the prefetches, those used, and waited
+ * for, their accuracy and the bytes wasted, and those dropped or skipped */
+void prefetch_print_stats(struct prefetch *p, FILE *out);
+/* stops the prefetch threads */
+void prefetch_exit(struct prefetch *p);
+
+#endif /* __PREFETCH_H__ */
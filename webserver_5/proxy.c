@@ -0,0 +1,422 @@
+/*
+ * proxy.c: a reverse proxy over backend server processes (see proxy.h).
+ */
+
+#include <time.h>
+#include "common.h"
+#include "proxy.h"
+#include "http_parse.h"
+#include "log.h"
+#include "chash.h"
+#include "upstream.h"
+
+#define PROXY_MAX_BACKENDS 64
+#define PROXY_CONNECT_MS 200	/* before a health check gives up */
+
+enum {
+	PROXY_HASH,
+	PROXY_LEAST,
+};
+
+struct backend {
+	struct upstream u;
+	int outstanding;	/* requests being forwarded to it */
+	long hold_until;	/* kept down until then, after a timeout */
+	/* statistics */
+	long requests;
+	long failures;		/* requests it could not take */
+	long reused;		/* requests sent on a kept connection */
+	long downs;		/* times it was found to be down */
+};
+
+struct proxy {
+	struct backend *backends;
+	int nr_backends;
+	int policy;
+	struct chash *ring;
+	unsigned int next;	/* where least starts looking, to break ties */
+	int header_ms;		/* client deadlines, 0 for none */
+	int write_ms;
+	pthread_t checker;
+	pthread_mutex_t lock;	/* protects exiting */
+	pthread_cond_t exiting_cond;
+	int exiting;
+	/* statistics */
+	long header_timeouts;	/* clients answered 408 */
+	long write_timeouts;	/* clients whose response stalled */
+};
+
+static long
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* marks b down, and keeps it down for PROXY_HOLD_MS if it timed out */
+static void
+backend_down(struct backend *b, int timedout)
+{
+	if (timedout)
+		b->hold_until = now_ms() + PROXY_HOLD_MS;
+	if (!b->u.up)
+		return;
+	upstream_down(&b->u);
+	__sync_add_and_fetch(&b->downs, 1);
+	log_msg(LOG_WARN, "backend %s is down%s", b->u.name,
+		timedout ? ", it timed out" : "");
+}
+
+/* what proxy_pick may pick */
+struct pick {
+	struct proxy *p;
+	uint64_t tried;
+	int up;			/* only backends that are up */
+};
+
+static int
+pick_ok(void *arg, int i)
+{
+	struct pick *pk = (struct pick *)arg;
+
+	return !(pk->tried & (1ULL << i)) &&
+		(!pk->up || pk->p->backends[i].u.up);
+}
+
+/* picks a backend for uri that is not in tried, by the policy. Backends
+ * that are down are only picked when all others are, in case they have
+ * come back since the last check. Returns -1 if all have been tried. */
+static int
+proxy_pick(struct proxy *p, const struct http_slice *uri, uint64_t tried)
+{
+	struct pick pk = { p, tried, 1 };
+	int i, b, best = -1;
+	unsigned int start;
+
+	if (p->policy == PROXY_HASH) {
+		if ((b = chash_pick(p->ring, uri->p, uri->len, pick_ok,
+				    &pk)) >= 0)
+			return b;
+		pk.up = 0;
+		return chash_pick(p->ring, uri->p, uri->len, pick_ok, &pk);
+	}
+	start = __sync_fetch_and_add(&p->next, 1);
+	for (i = 0; i < p->nr_backends; i++) {
+		b = (start + i) % p->nr_backends;
+		if (!pick_ok(&pk, b))
+			continue;
+		if (best < 0 || p->backends[b].outstanding <
+		    p->backends[best].outstanding)
+			best = b;
+	}
+	if (best >= 0)
+		return best;
+	pk.up = 0;
+	for (i = 0; i < p->nr_backends; i++) {
+		if (pick_ok(&pk, i))
+			return i;
+	}
+	return -1;
+}
+
+static void
+proxy_error(int connfd, const char *status)
+{
+	char buf[MAXLINE];
+	int n;
+
+	n = snprintf(buf, sizeof(buf), "HTTP/1.0 %s\r\n"
+		     "Server: OS Web Server\r\n"
+		     "Content-Length: 0\r\n\r\n", status);
+	upstream_write(connfd, buf, n);
+	log_msg(LOG_ERROR, "%s", status);
+}
+
+/* sends the request in req to backend b, and the response on to the client
+ * on connfd. Returns the length of the response body relayed, or -1 if the
+ * backend failed before any of the response was relayed, so that another
+ * backend may be tried. */
+static long
+proxy_forward(struct proxy *p, struct backend *b, int connfd, const char *req,
+	      int req_len)
+{
+	char buf[MAXBUF], out[MAXBUF], *line, *eol;
+	struct upstream_response r;
+	int fd, n, out_len = 0, client_ok;
+	long sent;
+	ssize_t got;
+
+	if ((fd = upstream_request(&b->u, req, req_len, buf, sizeof(buf),
+				   &r)) < 0) {
+		__sync_add_and_fetch(&b->failures, 1);
+		if (fd == -1 || fd == -3)
+			backend_down(b, fd == -3);
+		return -1;
+	}
+	if (r.reused)
+		__sync_add_and_fetch(&b->reused, 1);
+
+	/* pass the headers on, but for Connection, which is between us and
+	 * the backend */
+	for (line = buf; line < buf + r.hlen; line = eol + 2) {
+		eol = strstr(line, "\r\n");
+		if (strncasecmp(line, "Connection:", 11) == 0)
+			continue;
+		memcpy(out + out_len, line, eol + 2 - line);
+		out_len += eol + 2 - line;
+	}
+	client_ok = upstream_write(connfd, out, out_len);
+
+	/* then the body, starting with what came with the headers */
+	n = r.n - r.hlen;
+	if (r.length >= 0 && n > r.length)
+		n = r.length;	/* not pipelined, so this does not happen */
+	if (n > 0 && client_ok)
+		client_ok = upstream_write(connfd, buf + r.hlen, n);
+	sent = n;
+	while (client_ok && (r.length < 0 || sent < r.length)) {
+		got = read(fd, buf, r.length < 0 ||
+			   r.length - sent > sizeof(buf) ?
+			   sizeof(buf) : r.length - sent);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			backend_down(b, 1);
+		if (got <= 0)
+			break;
+		client_ok = upstream_write(connfd, buf, got);
+		sent += got;
+	}
+	/* SO_SNDTIMEO fails the write to a client that stopped reading so */
+	if (!client_ok && (errno == EAGAIN || errno == EWOULDBLOCK))
+		__sync_add_and_fetch(&p->write_timeouts, 1);
+	upstream_done(&b->u, fd, &r, sent == r.length);
+	return sent;
+}
+
+/* waits for the client on connfd to send more of its request, until
+ * deadline. Returns 0 if it has not by then. */
+static int
+proxy_wait_client(int connfd, long deadline)
+{
+	struct pollfd pfd;
+	long left;
+	int r;
+
+	pfd.fd = connfd;
+	pfd.events = POLLIN;
+	do {
+		if ((left = deadline - now_ms()) <= 0)
+			return 0;
+	} while ((r = poll(&pfd, 1, left)) < 0 && errno == EINTR);
+	return r == 1;
+}
+
+long
+proxy_serve(struct proxy *p, int connfd)
+{
+	char req[MAXLINE], fwd[MAXLINE + 64];
+	struct http_parser hp;
+	struct backend *b;
+	uint64_t tried = 0;
+	int i, n = 0, len, parsed = HTTP_PARSE_AGAIN;
+	long sent = -1, deadline = now_ms() + p->header_ms;
+	ssize_t r;
+
+	if (p->write_ms) {
+		struct timeval tv = { p->write_ms / 1000,
+				      p->write_ms % 1000 * 1000 };
+
+		setsockopt(connfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	}
+	http_parser_init(&hp);
+	while (parsed == HTTP_PARSE_AGAIN && n < (int)sizeof(req)) {
+		if (p->header_ms && !proxy_wait_client(connfd, deadline)) {
+			__sync_add_and_fetch(&p->header_timeouts, 1);
+			proxy_error(connfd, "408 Request Timeout");
+			SYS(close(connfd));
+			return 0;
+		}
+		r = read(connfd, req + n, sizeof(req) - n);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		n += r;
+		parsed = http_parse(&hp, req, n);
+	}
+	if (n == 0) { /* the client hung up without sending a request */
+		SYS(close(connfd));
+		return 0;
+	}
+	if (parsed != HTTP_PARSE_DONE) {
+		proxy_error(connfd, "400 Bad Request");
+		SYS(close(connfd));
+		return 0;
+	}
+
+	/* the same request, asking the backend to keep the connection */
+	len = snprintf(fwd, sizeof(fwd), "%.*s %.*s HTTP/1.0\r\n",
+		       hp.method.len, hp.method.p, hp.uri.len, hp.uri.p);
+	for (i = 0; i < hp.nr_headers; i++) {
+		const struct http_header *h = &hp.headers[i];
+
+		if (http_slice_eq(&h->name, "Connection") ||
+		    http_slice_eq(&h->name, "Keep-Alive"))
+			continue;
+		len += snprintf(fwd + len, sizeof(fwd) - len, "%.*s: %.*s\r\n",
+				h->name.len, h->name.p, h->value.len,
+				h->value.p);
+	}
+	len += snprintf(fwd + len, sizeof(fwd) - len,
+			"Connection: keep-alive\r\n\r\n");
+	if (len >= (int)sizeof(fwd)) {
+		proxy_error(connfd, "400 Bad Request");
+		SYS(close(connfd));
+		return 0;
+	}
+
+	/* requests are GETs, so one that failed can be sent elsewhere */
+	while (sent < 0 && (i = proxy_pick(p, &hp.uri, tried)) >= 0) {
+		tried |= 1ULL << i;
+		b = &p->backends[i];
+		__sync_add_and_fetch(&b->requests, 1);
+		__sync_add_and_fetch(&b->outstanding, 1);
+		sent = proxy_forward(p, b, connfd, fwd, len);
+		__sync_sub_and_fetch(&b->outstanding, 1);
+	}
+	if (sent < 0) {
+		proxy_error(connfd, "502 Bad Gateway");
+		sent = 0;
+	}
+	SYS(close(connfd));
+	return sent;
+}
+
+static void *
+proxy_checker(void *arg)
+{
+	struct proxy *p = (struct proxy *)arg;
+	struct timespec ts;
+	int i;
+
+	pthread_mutex_lock(&p->lock);
+	while (!p->exiting) {
+		pthread_mutex_unlock(&p->lock);
+		for (i = 0; i < p->nr_backends; i++) {
+			struct backend *b = &p->backends[i];
+
+			if (!upstream_check(&b->u, PROXY_CONNECT_MS)) {
+				backend_down(b, 0);
+			} else if (!b->u.up && now_ms() >= b->hold_until) {
+				b->u.up = 1;
+				log_msg(LOG_WARN, "backend %s is up",
+					b->u.name);
+			}
+		}
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += PROXY_CHECK_MS * 1000000L;
+		ts.tv_sec += ts.tv_nsec / 1000000000L;
+		ts.tv_nsec %= 1000000000L;
+		pthread_mutex_lock(&p->lock);
+		if (!p->exiting)
+			pthread_cond_timedwait(&p->exiting_cond, &p->lock, &ts);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+struct proxy *
+proxy_init(const char *backends, const char *policy, int header_ms,
+	   int write_ms)
+{
+	struct proxy *p;
+	char buf[MAXLINE], *spec, *save, *names[PROXY_MAX_BACKENDS];
+	int i;
+
+	p = Malloc(sizeof(struct proxy));
+	memset(p, 0, sizeof(struct proxy));
+	p->header_ms = header_ms;
+	p->write_ms = write_ms;
+	if (!policy || strcmp(policy, "hash") == 0) {
+		p->policy = PROXY_HASH;
+	} else if (strcmp(policy, "least") == 0) {
+		p->policy = PROXY_LEAST;
+	} else {
+		fprintf(stderr, "bad proxy policy: %s\n", policy);
+		free(p);
+		return NULL;
+	}
+	p->backends = Malloc(PROXY_MAX_BACKENDS * sizeof(struct backend));
+	snprintf(buf, sizeof(buf), "%s", backends);
+	for (spec = strtok_r(buf, ",", &save); spec;
+	     spec = strtok_r(NULL, ",", &save)) {
+		struct backend *b = &p->backends[p->nr_backends];
+
+		if (p->nr_backends == PROXY_MAX_BACKENDS ||
+		    !upstream_init(&b->u, spec)) {
+			fprintf(stderr, "bad backend: %s\n", spec);
+			for (i = 0; i < p->nr_backends; i++)
+				upstream_destroy(&p->backends[i].u);
+			free(p->backends);
+			free(p);
+			return NULL;
+		}
+		/* backends are up until the first check says otherwise */
+		b->u.timeout_ms = PROXY_TIMEOUT_MS;
+		names[p->nr_backends] = b->u.name;
+		b->outstanding = 0;
+		b->hold_until = 0;
+		b->requests = b->failures = b->reused = b->downs = 0;
+		p->nr_backends++;
+	}
+	if (p->nr_backends == 0) {
+		fprintf(stderr, "no backends\n");
+		free(p->backends);
+		free(p);
+		return NULL;
+	}
+
+	p->ring = chash_init(names, p->nr_backends);
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->exiting_cond, NULL);
+	pthread_create(&p->checker, NULL, proxy_checker, p);
+	return p;
+}
+
+void
+proxy_print_stats(struct proxy *p, FILE *out)
+{
+	int i;
+
+	for (i = 0; i < p->nr_backends; i++) {
+		struct backend *b = &p->backends[i];
+
+		fprintf(out, "proxy backend %s requests %ld failures %ld "
+			"reused %ld down %ld\n", b->u.name, b->requests,
+			b->failures, b->reused, b->downs);
+	}
+	fprintf(out, "proxy timeouts header %ld write %ld\n",
+		p->header_timeouts, p->write_timeouts);
+}
+
+void
+proxy_exit(struct proxy *p)
+{
+	int i;
+
+	pthread_mutex_lock(&p->lock);
+	p->exiting = 1;
+	pthread_cond_signal(&p->exiting_cond);
+	pthread_mutex_unlock(&p->lock);
+	pthread_join(p->checker, NULL);
+	for (i = 0; i < p->nr_backends; i++)
+		upstream_destroy(&p->backends[i].u);
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->exiting_cond);
+	chash_destroy(p->ring);
+	free(p->backends);
+	free(p);
+}
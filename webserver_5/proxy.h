@@ -0,0 +1,42 @@
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include <stdio.h>
+
+/* A reverse proxy in front of other server processes, the backends. Each
+ * client request is forwarded to one backend, picked by policy:
+ *	least	the backend with the fewest requests outstanding
+ *	hash	a consistent hash of the URI, so that each backend caches
+ *		its own part of the files. When a backend is down, only its
+ *		part moves, to the next backends on the hash ring.
+ * Backends are checked by connecting to them every PROXY_CHECK_MS, and are
+ * skipped while they are down. A backend is also down once connecting to
+ * it, or a read or write of a request to it, takes longer than
+ * PROXY_TIMEOUT_MS, and since the check would find it up as long as it
+ * accepts connections, it stays down for PROXY_HOLD_MS before the checks may
+ * bring it back. Connections to backends are kept open between requests,
+ * with HTTP/1.0 keep-alive, which backends support when they run with event
+ * loops (-e). */
+
+#define PROXY_CHECK_MS 500
+#define PROXY_TIMEOUT_MS 5000
+#define PROXY_HOLD_MS 5000
+
+struct proxy;
+
+/* backends is a comma separated list of ports, or host:port, and policy is
+ * least or hash (the default). Clients are answered 408 if their request
+ * has not all arrived header_ms after a worker takes them, and dropped if
+ * their response makes no progress for write_ms, 0 for no deadline. Returns
+ * NULL, after printing why, if either list is malformed. */
+struct proxy *proxy_init(const char *backends, const char *policy,
+			 int header_ms, int write_ms);
+/* forwards the request of the client on connfd, and closes connfd.
+ * Returns the length of the response body sent to the client. */
+long proxy_serve(struct proxy *p, int connfd);
+/* prints the requests, failures and reused connections of each backend,
+ * and the clients that ran out of time */
+void proxy_print_stats(struct proxy *p, FILE *out);
+void proxy_exit(struct proxy *p);
+
+#endif /* __PROXY_H__ */
@@ -3,6 +3,7 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include "common.h"
+#include "bufpool.h"
 
 
 REQ_QUEUE* create_request_queue(int size)
@@ -23,7 +24,7 @@ bool queue_empty(REQ_QUEUE* queue)
 
 
 void push_back_helper(REQUEST_NODE** head, REQUEST_NODE** tail, int connfd){
-    REQUEST_NODE* node = (REQUEST_NODE*) Malloc(sizeof(REQUEST_NODE));
+    REQUEST_NODE* node = (REQUEST_NODE*) bufpool_alloc(sizeof(REQUEST_NODE));
     assert(node);
     node->connfd = connfd;
     node->next = NULL;
@@ -71,7 +72,7 @@ bool pop_front_helper(REQUEST_NODE** head, REQUEST_NODE** tail, int* connfd){
         // This is the last one
         *tail = NULL;
     }
-    free(*head);
+    bufpool_free(*head);
     *head = new_front;
     return true;
 }
@@ -113,10 +114,10 @@ FILESIZE_QUEUE* create_filesize_queue() {
 
 void insert_into_filesize_queue(FILESIZE_QUEUE* queue, int filesize, char* filename)
 {
-    FILESIZE_NODE* node = (FILESIZE_NODE*) Malloc(sizeof(FILESIZE_NODE));
+    FILESIZE_NODE* node = (FILESIZE_NODE*) bufpool_alloc(sizeof(FILESIZE_NODE));
     assert(node);
     node->filesize = filesize;
-    node->filename = Malloc(sizeof(char) * (strlen(filename) + 1));
+    node->filename = bufpool_alloc(sizeof(char) * (strlen(filename) + 1));
     strcpy(node->filename, filename);
     node->next = NULL;
 
@@ -162,15 +163,14 @@ bool pop_front_fq(FILESIZE_QUEUE* queue, char** return_filename, int* popped_fil
 {
     if (queue->head != NULL && queue->tail != NULL) {
         FILESIZE_NODE* new_head = queue->head->next;
-        *return_filename = Malloc(sizeof(char) * (strlen(queue->head->filename) + 1));
-        strcpy(*return_filename, queue->head->filename);
+        // hand the node's filename over to the caller instead of copying it
+        *return_filename = queue->head->filename;
         *popped_file_size = queue->head->filesize;
         
         if (new_head == NULL) {
             queue->tail = NULL;
         }
-        free(queue->head->filename);
-        free(queue->head);
+        bufpool_free(queue->head);
         queue->head = new_head;
         return true;
     }
@@ -183,8 +183,8 @@ void delete_queue_fq(FILESIZE_QUEUE* queue) {
     while (curr_node != NULL)
     {
         FILESIZE_NODE* next_node = curr_node->next;
-        free(curr_node->filename);
-        free(curr_node);
+        bufpool_free(curr_node->filename);
+        bufpool_free(curr_node);
         curr_node = next_node;
     }
     free(queue);
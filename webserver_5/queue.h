@@ -45,6 +45,7 @@ typedef struct filesize_queue {
 
 FILESIZE_QUEUE* create_filesize_queue();
 void insert_into_filesize_queue(FILESIZE_QUEUE* queue, int filesize, char* filename);
+// the caller owns *return_filename and frees it with bufpool_free
 bool pop_front_fq(FILESIZE_QUEUE* queue, char** return_filename, int* popped_file_size);
 void delete_queue_fq(FILESIZE_QUEUE* queue);
 
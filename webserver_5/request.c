@@ -2,20 +2,309 @@
  * request.c: Does the bulk of the work for the web server.
  */
 
+#define _GNU_SOURCE	/* for strptime */
+#include <aio.h>
+#include <limits.h>
+#include <zlib.h>
 #include "common.h"
 #include "request.h"
+#include "csum.h"
+#include "bufpool.h"
+#include "forkjoin.h"
+#include "storage.h"
+#include "log.h"
 
+/* files larger than stream_size are sent in chunks instead of being read into
+ * memory as a whole, so they need 2 * STREAM_CHUNK bytes of memory however
+ * large they are. 0 disables streaming. */
+static int stream_size;
 
+#define STREAM_CHUNK (64 * 1024)
 
-/* requestError(fd, filename, "404", "Not found", 
+/* files are read with O_DIRECT, bypassing the page cache, in requests of up
+ * to DIRECT_CHUNK bytes */
+static int direct_io;
+
+#define DIRECT_CHUNK (1024 * 1024)
+
+/* checksums of streamed files remembered, see stream_csum */
+#define STREAM_CSUMS 256
+
+/* requests asking for more ranges than this get the whole file */
+#define MAX_RANGES 16
+
+/* text files at least this large get a gzip encoded variant, which is kept
+ * if it is no larger than GZIP_MAX of the file size */
+#define GZIP_MIN_SIZE 256
+#define GZIP_MAX(size) ((long)(size) * 7 / 8)
+
+/* buffers larger than this are checksummed and processed in chunks of this
+ * size, in parallel by the forkjoin helpers */
+#define PAR_CHUNK (256 * 1024)
+
+/* a paced body is written in pieces of this size, see request_set_pace */
+#define PACE_CHUNK (16 * 1024)
+
+/* separates the parts of a multipart/byteranges response */
+#define BOUNDARY "OS_WEB_SERVER_BYTERANGES"
+
+/* a file being streamed. While one half of the ring is sent to the client,
+ * the next chunk is read into the other half by an asynchronous read. */
+struct stream {
+	int fd;
+	dev_t dev;
+	ino_t ino;
+	long size;
+	struct timespec mtime;
+	long off;		/* file offset of the read in flight */
+	long end;		/* reads stop at this offset */
+	char *ring[2];
+	int cur;		/* ring slot of the read in flight */
+	int pending;		/* a read is in flight */
+	struct aiocb cb;
+};
+
+static struct stream *
+stream_open(int fd, struct stat *sbuf, struct arena *arena)
+{
+	struct stream *st;
+
+	st = arena_alloc(arena, sizeof(struct stream));
+	st->fd = fd;
+	st->dev = sbuf->st_dev;
+	st->ino = sbuf->st_ino;
+	st->size = sbuf->st_size;
+	st->mtime = sbuf->st_mtim;
+	st->off = 0;
+	st->end = st->size;
+	st->ring[0] = bufpool_alloc(STREAM_CHUNK);
+	st->ring[1] = bufpool_alloc(STREAM_CHUNK);
+	st->cur = 0;
+	st->pending = 0;
+	return st;
+}
+
+/* starts reading the chunk at st->off into ring slot st->cur */
+static void
+stream_start_read(struct stream *st)
+{
+	long left = st->end - st->off;
+
+	if (left <= 0) {
+		st->pending = 0;
+		return;
+	}
+	memset(&st->cb, 0, sizeof(st->cb));
+	st->cb.aio_fildes = st->fd;
+	st->cb.aio_buf = st->ring[st->cur];
+	st->cb.aio_nbytes = left < STREAM_CHUNK ? left : STREAM_CHUNK;
+	st->cb.aio_offset = st->off;
+	SYS(aio_read(&st->cb));
+	st->pending = 1;
+}
+
+/* waits for the read in flight to finish */
+static ssize_t
+stream_wait(struct stream *st)
+{
+	const struct aiocb *list[1] = { &st->cb };
+
+	while (aio_error(&st->cb) == EINPROGRESS) {
+		aio_suspend(list, 1, NULL);
+	}
+	st->pending = 0;
+	return aio_return(&st->cb);
+}
+
+/* makes the stream read bytes start to end - 1 of the file next */
+static void
+stream_seek(struct stream *st, long start, long end)
+{
+	assert(!st->pending);
+	st->off = start;
+	st->end = end < st->size ? end : st->size;
+}
+
+/* returns the length of the next chunk of the file, and points buf at it.
+ * The chunk stays valid until the following call. Returns 0 at the end of the
+ * file (or of the part set by stream_seek), or if the file shrank underneath
+ * us. */
+static long
+stream_next(struct stream *st, char **buf)
+{
+	ssize_t n;
+
+	if (!st->pending)
+		return 0;
+	n = stream_wait(st);
+	if (n <= 0)
+		return 0;
+	*buf = st->ring[st->cur];
+	st->off += n;
+	/* overlap reading the next chunk with sending this one */
+	st->cur = !st->cur;
+	stream_start_read(st);
+	return n;
+}
+
+/* checksum of bytes start to end - 1 of the file, read with pread so that
+ * the reads of the stream are not disturbed */
+static unsigned int
+stream_sum(struct stream *st, long start, long end)
+{
+	unsigned int csum = 0;
+	ssize_t n;
+	long off, left;
+
+	for (off = start; off < end; off += n) {
+		left = end - off;
+		n = pread(st->fd, st->ring[0],
+			  left < STREAM_CHUNK ? left : STREAM_CHUNK, off);
+		if (n <= 0)
+			break;
+		csum += csum_bytes(st->ring[0], n);
+	}
+	return csum;
+}
+
+struct par_csum {
+	const char *buf;
+	unsigned int csum;
+};
+
+static void
+request_csum_chunk(void *arg, long start, long end)
+{
+	struct par_csum *pc = (struct par_csum *)arg;
+
+	__sync_fetch_and_add(&pc->csum, csum_bytes(pc->buf + start,
+						   end - start));
+}
+
+/* checksum of buf, which adds up the checksums of its chunks. Large buffers
+ * are checksummed in parallel. */
+static unsigned int
+request_csum_buf(const char *buf, long len)
+{
+	struct par_csum pc = { buf, 0 };
+
+	forkjoin_for(len, PAR_CHUNK, request_csum_chunk, &pc);
+	return pc.csum;
+}
+
+/* the checksum of a streamed file, as of the size and mtime it belongs to */
+struct stream_csum {
+	dev_t dev;
+	ino_t ino;
+	long size;
+	struct timespec mtime;
+	unsigned int csum;
+};
+
+/* one slot per file, by inode, a file evicting the one that was there */
+static struct stream_csum stream_csums[STREAM_CSUMS];
+static pthread_mutex_t stream_csums_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the checksum goes in the response header, so for a streamed file it has to
+ * be known before the file is read. Streamed files are too large for the
+ * cache, so their checksums are remembered in stream_csums instead. When it
+ * is missing or stale, it is computed with one extra pass over the file. */
+static unsigned int
+stream_csum(struct stream *st)
+{
+	struct stream_csum *sc;
+	unsigned int csum;
+
+	assert(!st->pending);
+	sc = &stream_csums[(st->ino ^ st->dev) % STREAM_CSUMS];
+	pthread_mutex_lock(&stream_csums_lock);
+	if (sc->ino == st->ino && sc->dev == st->dev && sc->size == st->size &&
+	    sc->mtime.tv_sec == st->mtime.tv_sec &&
+	    sc->mtime.tv_nsec == st->mtime.tv_nsec) {
+		csum = sc->csum;
+		pthread_mutex_unlock(&stream_csums_lock);
+		return csum;
+	}
+	pthread_mutex_unlock(&stream_csums_lock);
+	csum = stream_sum(st, 0, st->size);
+	pthread_mutex_lock(&stream_csums_lock);
+	sc->dev = st->dev;
+	sc->ino = st->ino;
+	sc->size = st->size;
+	sc->mtime = st->mtime;
+	sc->csum = csum;
+	pthread_mutex_unlock(&stream_csums_lock);
+	return csum;
+}
+
+static void
+stream_close(struct stream *st)
+{
+	if (st->pending) {
+		aio_cancel(st->fd, &st->cb);
+		stream_wait(st);
+	}
+	SYS(posix_fadvise(st->fd, 0, st->size, POSIX_FADV_DONTNEED));
+	SYS(close(st->fd));
+	bufpool_free(st->ring[0]);
+	bufpool_free(st->ring[1]);
+}
+
+void
+request_set_stream_size(int size)
+{
+	stream_size = size;
+}
+
+void
+request_set_direct_io(int on)
+{
+	direct_io = on;
+}
+
+
+
+/* writes response bytes to the client. blocking requests write straight to
+ * the socket. nonblocking requests (event loop mode) stage the bytes in rq->out
+ * instead, and request_flush sends them once the socket is writable. */
+static void
+request_write(struct request *rq, void *buf, int n)
+{
+	if (!rq->nonblock) {
+		Rio_write(rq->fd, buf, n);
+		return;
+	}
+	if (rq->out_len + n > rq->out_cap) {
+		int cap = rq->out_cap ? rq->out_cap : 512;
+
+		while (cap < rq->out_len + n)
+			cap *= 2;
+		rq->out = arena_realloc(rq->arena, rq->out, rq->out_len, cap);
+		rq->out_cap = cap;
+	}
+	memcpy(rq->out + rq->out_len, buf, n);
+	rq->out_len += n;
+}
+
+/* the Connection header of the response, if any, into buf. Returns its
+ * length. */
+static int
+request_connection(struct request *rq, char *buf)
+{
+	if (!rq->keep_alive)
+		return 0;
+	return sprintf(buf, "Connection: keep-alive\r\n");
+}
+
+/* requestError(rq, filename, "404", "Not found", 
  *		"OS server could not find this file");
  */
 static void
-request_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg)
+request_error(struct request *rq, char *cause, char *errnum, char *shortmsg,
+	      char *longmsg)
 {
 	char buf[MAXLINE], body[MAXBUF];
-	int i;
-	unsigned int csum = 0;
+	unsigned int csum;
 
 	/* create the body of the error message */
 	sprintf(body, "<html><title>OS Web Server Error</title>");
@@ -26,45 +315,52 @@ request_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg)
 
 	/* write out the header information for this response */
 	sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
+	request_write(rq, buf, strlen(buf));
 
 	sprintf(buf, "Content-Type: text/html\r\n");
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
+	request_write(rq, buf, strlen(buf));
+	request_write(rq, buf, request_connection(rq, buf));
 
 	sprintf(buf, "Content-Length: %ld\r\n", strlen(body));
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
+	request_write(rq, buf, strlen(buf));
 
 	/* generate a very trivial checksum */
-	for (i = 0; i < strlen(body); i++) {
-		csum += (unsigned char)(body[i]);
-	}
+	csum = csum_bytes(body, strlen(body));
 	sprintf(buf, "Content-Csum: %u\r\n\r\n", csum);
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
+	request_write(rq, buf, strlen(buf));
 
 	/* write out the content */
-	Rio_write(fd, body, strlen(body));
-	printf("%s", body);
+	request_write(rq, body, strlen(body));
 
+	log_msg(LOG_ERROR, "%s %s: %s", errnum, shortmsg, cause);
+	rq->length = strlen(body);
+	log_access(atoi(errnum), rq->length, cause);
+	rq->responded = 1;
 }
 
-/* reads and discards everything up to an empty text line */
-static void
-request_read_headers(struct rio *rp)
+/* reads from fd into buf, which holds MAXLINE bytes, until the blank line
+ * that ends the headers, parsing them with hp.
+ * Returns the result of http_parse, or HTTP_PARSE_AGAIN if the client hung up
+ * or the headers do not fit in buf. */
+static int
+request_read_headers(int fd, char *buf, struct http_parser *hp)
 {
-	char buf[MAXLINE];
+	int len = 0, ret = HTTP_PARSE_AGAIN;
+	ssize_t n;
 
-	Rio_readlineb(rp, buf, MAXLINE);
-	while (strcmp(buf, "\r\n")) {
-		Rio_readlineb(rp, buf, MAXLINE);
+	http_parser_init(hp);
+	while (ret == HTTP_PARSE_AGAIN && len < MAXLINE) {
+		n = read(fd, buf + len, MAXLINE - len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		len += n;
+		ret = http_parse(hp, buf, len);
 	}
-	return;
+	return ret;
 }
 
-
 /* Calculates filename from uri. 
  * for this simple server, filename = .uri
  *
@@ -72,10 +368,13 @@ request_read_headers(struct rio *rp)
  * which the webserver is running.
  *
  * Also, we don't serve files with a .. in the path (see request_readfile). */
-static void
-request_parse_URI(char *uri, char *filename, size_t max)
+static char *
+request_parse_URI(const struct http_slice *uri)
 {
-	snprintf(filename, max, "./%s", uri);
+	char *filename = bufpool_alloc(uri->len + 3);
+
+	sprintf(filename, "./%.*s", uri->len, uri->p);
+	return filename;
 }
 
 /* Fills in the filetype given the filename */
@@ -92,40 +391,261 @@ request_get_file_type(char *filename, char *filetype)
 		strcpy(filetype, "text/plain");
 }
 
-/* entry point to this file */
-/* returns a pointer to a request struct, filling rq->fd with connfd,
- * and rq->file_name with the file that is being requested.
- * Returns NULL on failure.
- */
-struct request *
-request_init(int connfd, struct file_data *data)
+/* parses the decimal number at *p, moving *p past it. Returns 0 if there is
+ * no number there, or it is too large. */
+static int
+range_number(const char **p, const char *end, long *val)
+{
+	const char *s = *p;
+
+	*val = 0;
+	while (*p < end && isdigit((unsigned char)**p)) {
+		if (*val > (LONG_MAX - 9) / 10)
+			return 0;
+		*val = *val * 10 + (**p - '0');
+		(*p)++;
+	}
+	return *p > s;
+}
+
+/* fills rq->ranges from the Range header of the request, for a file of the
+ * given size. Ranges lying past the end of the file are dropped, and the
+ * others are clipped to it.
+ * Returns the number of ranges, 0 if the whole file should be sent because
+ * there is no Range header or it is malformed, or -1 if none of the ranges
+ * can be satisfied. */
+static int
+request_parse_ranges(struct request *rq, long size)
+{
+	const struct http_slice *h;
+	const char *p, *end;
+	struct byte_range *r;
+	long start, last;
+	int n = 0, specs = 0;
+
+	if (!rq->hp || !(h = http_header(rq->hp, "Range")))
+		return 0;
+	p = h->p;
+	end = h->p + h->len;
+	if (h->len < 6 || strncasecmp(p, "bytes=", 6) != 0)
+		return 0;
+	p += 6;
+	r = arena_alloc(rq->arena, MAX_RANGES * sizeof(struct byte_range));
+	while (1) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+			p++;
+		if (p == end)
+			break;
+		if (++specs > MAX_RANGES)
+			return 0;
+		if (*p == '-') {
+			/* suffix range, the last bytes of the file */
+			p++;
+			if (!range_number(&p, end, &last))
+				return 0;
+			start = last < size ? size - last : 0;
+			last = size - 1;
+			if (start > last)
+				start = size; /* unsatisfiable */
+		} else {
+			if (!range_number(&p, end, &start))
+				return 0;
+			if (p == end || *p++ != '-')
+				return 0;
+			if (p < end && isdigit((unsigned char)*p)) {
+				if (!range_number(&p, end, &last) ||
+				    last < start)
+					return 0;
+			} else {
+				last = size - 1;
+			}
+		}
+		while (p < end && (*p == ' ' || *p == '\t'))
+			p++;
+		if (p < end && *p != ',')
+			return 0;
+		if (start >= size)
+			continue;
+		r[n].start = start;
+		r[n].end = last < size ? last : size - 1;
+		n++;
+	}
+	if (specs == 0)
+		return 0;
+	if (n == 0)
+		return -1;
+	rq->ranges = r;
+	rq->nr_ranges = n;
+	rq->multipart = n > 1;
+	return n;
+}
+
+/* checks the parsed request and fills rq->data->file_name. parsed is the
+ * result of http_parse. Returns 0, after responding with an error, if the
+ * request is malformed or its method is not supported. */
+static int
+request_parse(struct request *rq, const struct http_parser *hp, int parsed)
+{
+	const struct http_slice *conn;
+	char method[64];
+
+	if (parsed != HTTP_PARSE_DONE) {
+		request_error(rq, "request", "400", "Bad Request",
+			      "OS Web Server could not parse this");
+		return 0;
+	}
+	// printf("%.*s %.*s, fd = %d\n", hp->method.len, hp->method.p,
+	//	  hp->uri.len, hp->uri.p, rq->fd);
+	if (!http_slice_eq(&hp->method, "GET")) {
+		snprintf(method, sizeof(method), "%.*s", hp->method.len,
+			 hp->method.p);
+		request_error(rq, method, "501", "Not Implemented",
+			     "OS Web Server does not implement this method");
+		return 0;
+	}
+	rq->data->file_name = request_parse_URI(&hp->uri);
+	rq->hp = hp;
+	/* HTTP/1.0 style keep-alive, which only the event loops support,
+	 * since they wait for the next request without holding a thread */
+	conn = http_header(hp, "Connection");
+	rq->keep_alive = rq->nonblock && conn &&
+		http_slice_eq(conn, "keep-alive");
+	return 1;
+}
+
+static struct request *
+request_alloc(int connfd, struct file_data *data, int nonblock,
+	      struct arena *arena)
 {
-	char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-	struct rio *rio;
 	struct request *rq;
 
 	assert(data);
-	rq = Malloc(sizeof(struct request));
+	rq = arena_alloc(arena, sizeof(struct request));
 	rq->fd = connfd;
 	rq->data = data;
-	data->file_name = Malloc(MAXLINE);
+	rq->nonblock = nonblock;
+	rq->responded = 0;
+	rq->arena = arena;
+	rq->out = NULL;
+	rq->out_len = rq->out_sent = rq->out_cap = 0;
+	rq->body = NULL;
+	rq->body_len = rq->body_sent = 0;
+	rq->stream = NULL;
+	rq->src = NULL;
+	rq->ranges = NULL;
+	rq->nr_ranges = rq->range = rq->multipart = 0;
+	rq->hp = NULL;
+	rq->length = 0;
+	rq->keep_alive = 0;
+	rq->pace = NULL;
+	data->file_name = NULL;
 	data->file_buf = NULL;
 	data->file_size = 0;
-	rio = Rio_init(rq->fd);
-	Rio_readlineb(rio, buf, MAXLINE);
-	sscanf(buf, "%s %s %s", method, uri, version);
+	data->file_csum = 0;
+	data->gz_buf = NULL;
+	data->gz_size = 0;
+	data->gz_csum = 0;
+	return rq;
+}
 
-	// printf("%s %s %s, fd = %d\n", method, uri, version, connfd);
-	if (strcasecmp(method, "GET")) {
-		request_error(rq->fd, method, "501", "Not Implemented",
-			     "OS Web Server does not implement this method");
-		Rio_destroy(rio);
+/* initialize file data, with one reference held by the caller */
+struct file_data *
+file_data_init(void)
+{
+	struct file_data *data;
+
+	data = bufpool_alloc(sizeof(struct file_data));
+	data->file_name = NULL;
+	data->file_buf = NULL;
+	data->file_size = 0;
+	data->file_mtime.tv_sec = data->file_mtime.tv_nsec = 0;
+	data->file_csum = 0;
+	data->gz_buf = NULL;
+	data->gz_size = 0;
+	data->gz_csum = 0;
+	data->prefetched = 0;
+	data->refs = 1;
+	return data;
+}
+
+/* file data is shared read-only between the cache and the requests sending
+ * it, each holding a reference */
+void
+file_data_ref(struct file_data *data)
+{
+	__sync_add_and_fetch(&data->refs, 1);
+}
+
+/* drop a reference, and free all file data with the last one */
+void
+file_data_free(struct file_data *data)
+{
+	if (__sync_sub_and_fetch(&data->refs, 1) > 0)
+		return;
+	bufpool_free(data->file_name);
+	bufpool_free(data->file_buf);
+	bufpool_free(data->gz_buf);
+	bufpool_free(data);
+}
+
+/* bytes of file contents held by data, counting the gzip variant */
+int
+file_data_size(struct file_data *data)
+{
+	return data->file_size + data->gz_size;
+}
+
+/* bytes of memory data costs the cache: the buffers holding its contents,
+ * which bufpool rounds up to the size of their class */
+int
+file_data_charge(struct file_data *data)
+{
+	return bufpool_size(data->file_buf) + bufpool_size(data->gz_buf);
+}
+
+/* entry point to this file */
+/* returns a pointer to a request struct, filling rq->fd with connfd,
+ * and rq->file_name with the file that is being requested.
+ * The request, and the headers it was read from, are allocated from arena,
+ * which request_destroy resets. So the request may be passed on to other
+ * threads.
+ * Returns NULL on failure.
+ */
+struct request *
+request_init(int connfd, struct file_data *data, struct arena *arena)
+{
+	struct request *rq;
+	struct http_parser *hp;
+	int parsed;
+
+	rq = request_alloc(connfd, data, 0, arena);
+	hp = arena_alloc(arena, sizeof(struct http_parser));
+	parsed = request_read_headers(connfd, arena_alloc(arena, MAXLINE), hp);
+	if (parsed == HTTP_PARSE_AGAIN && hp->pos == 0) {
+		/* the client hung up without sending a request */
 		request_destroy(rq);
 		return NULL;
 	}
-	request_read_headers(rio);
-	request_parse_URI(uri, data->file_name, MAXLINE);
-	Rio_destroy(rio);
+	if (!request_parse(rq, hp, parsed)) {
+		request_destroy(rq);
+		return NULL;
+	}
+	return rq;
+}
+
+/* same as request_init, for a connection whose headers an event loop has
+ * already read and parsed with hp. parsed is the result of http_parse. The
+ * response is staged in the request rather than written, so the request is
+ * always returned: check rq->responded to see whether an error has already
+ * been produced. */
+struct request *
+request_init_nb(int connfd, struct file_data *data,
+		const struct http_parser *hp, int parsed, struct arena *arena)
+{
+	struct request *rq;
+
+	rq = request_alloc(connfd, data, 1, arena);
+	request_parse(rq, hp, parsed);
 	return rq;
 }
 
@@ -135,11 +655,168 @@ request_destroy(struct request *rq)
 	assert(rq);
 	/* close the connection fd */
 	SYS(close(rq->fd));
-	free(rq);
+	request_finish(rq);
+}
+
+/* same as request_destroy, but leaves the connection open for the next
+ * request */
+void
+request_finish(struct request *rq)
+{
+	if (rq->stream)
+		stream_close(rq->stream);
+	/* frees rq and everything else allocated for it */
+	arena_reset(rq->arena);
+}
+
+/* reads the file into data->file_buf, which is BUFPOOL_ALIGN aligned, with
+ * O_DIRECT. The data then goes straight from the disk to our buffer, instead
+ * of being copied through the page cache, which would only keep a second copy
+ * of what our cache holds. O_DIRECT needs the buffer, offset and length of
+ * each read to be block aligned, so the tail of the file that does not fill a
+ * block is read through the page cache. So is the whole file, if the file
+ * system does not support O_DIRECT. */
+static void
+request_read_direct(struct file_data *data)
+{
+	long aligned = data->file_size & ~(long)(BUFPOOL_ALIGN - 1);
+	long off = 0, len;
+	ssize_t n;
+	int fd, flags;
+
+	fd = open(data->file_name, O_RDONLY | O_DIRECT, 0);
+	if (fd < 0 && errno == EINVAL) {
+		fd = open(data->file_name, O_RDONLY, 0);
+		aligned = 0;
+	}
+	SYS(fd);
+	while (off < aligned) {
+		len = aligned - off < DIRECT_CHUNK ? aligned - off :
+			DIRECT_CHUNK;
+		n = pread(fd, data->file_buf + off, len, off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) /* EINVAL if O_DIRECT is refused after all */
+			break;
+		off += n;
+	}
+	SYS(flags = fcntl(fd, F_GETFL));
+	SYS(fcntl(fd, F_SETFL, flags & ~O_DIRECT));
+	while (off < data->file_size) {
+		n = pread(fd, data->file_buf + off, data->file_size - off,
+			  off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			unix_error("pread error");
+		if (n == 0)
+			break;
+		off += n;
+	}
+	/* drop the pages of the tail */
+	SYS(posix_fadvise(fd, 0, data->file_size, POSIX_FADV_DONTNEED));
+	SYS(close(fd));
+}
+
+/* returns why the file called name may not be served, or NULL if it may */
+static char *
+request_bad_name(const char *name)
+{
+	const char *ext;
+
+	/* don't serve files that start with /, or .., or end in .c */
+	if (name[0] == '/') {
+		/* this shouldn't really happen because we add a "./" at the
+		 * beginning of the file path */
+		return "OS Web Server doesn't serve files with absolute paths";
+	}
+	if (strstr(name, "..") != NULL)
+		return "OS Web Server doesn't serve files with .. in the path";
+	if (((ext = strrchr(name, '.')) != NULL) && 
+	    ((strcmp(ext, ".c") == 0) || (strcmp(ext, ".h") == 0)))
+		return "OS Web Server doesn't serve C or header files ";
+	return NULL;
+}
+
+/* responds that the server is too busy to serve the request, e.g., when the
+ * queue it would wait in is full */
+void
+request_busy(struct request *rq)
+{
+	request_error(rq, "queue full", "503", "Service Unavailable",
+		      "OS Web Server is too busy to serve this");
+}
+
+/* checks that the requested file may be served at all. Returns 0 after
+ * responding with an error if it may not. */
+int
+request_check_name(struct request *rq)
+{
+	struct file_data *data = rq->data;
+	char *why;
+
+	if ((why = request_bad_name(data->file_name))) {
+		request_error(rq, data->file_name, "404", "Not found", why);
+		return 0;
+	}
+	return 1;
+}
+
+/* err is the errno of the stat of the file, or 0 */
+static int
+request_check_stat(struct request *rq, int err, struct stat *sbuf)
+{
+	struct file_data *data = rq->data;
+
+	if (err) {
+		request_error(rq, data->file_name, "404", "Not found",
+			      "OS Web Server could not find this file");
+		return 0;
+	}
+	if (!(S_ISREG(sbuf->st_mode)) || !(S_IRUSR & sbuf->st_mode)) {
+		request_error(rq, data->file_name, "403", "Forbidden",
+			      "OS Web Server could not read this file");
+		return 0;
+	}
+	data->file_size = sbuf->st_size;
+	data->file_mtime = sbuf->st_mtim;
+	return 1;
+}
+
+/* reads the file of data, of data->file_size bytes, into memory */
+static void
+request_load(struct file_data *data)
+{
+	int srcfd;
+
+	if (direct_io) {
+		data->file_buf = bufpool_alloc_aligned(data->file_size);
+		request_read_direct(data);
+		data->file_csum = request_csum_buf(data->file_buf,
+						   data->file_size);
+		storage_read(data->file_size);
+		return;
+	}
+	SYS(srcfd = open(data->file_name, O_RDONLY, 0));
+	data->file_buf = bufpool_alloc(data->file_size);
+	Rio_read(srcfd, data->file_buf, data->file_size);
+	/* generate a very trivial checksum, kept with the file so that
+	 * cache hits need not compute it again */
+	data->file_csum = request_csum_buf(data->file_buf, data->file_size);
+	/* ask the kernel to stop caching the file */
+	SYS(posix_fadvise(srcfd, 0, data->file_size, POSIX_FADV_DONTNEED));
+	SYS(close(srcfd));
+	/* we do this to simulate a slow disk. otherwise, file caching
+	 * doesn't have much benefit because a lot of the time is spent
+	 * in processing (see request_processfile below) and so
+	 * request_readfile does not have much impact. The delay
+	 * depends on the storage model, see storage.h. */
+	storage_read(data->file_size);
 }
 
 /* read in filename corresponding to request. 
- * Returns 1 on success, and fills rq->file_buf, and rq->file_size.
+ * Returns 1 on success, and fills the file_buf and file_size of rq->data,
+ * or opens the file to stream if it is larger than stream_size.
  * Returns 0 on failure, sends error to client. */
 int
 request_readfile(struct request *rq)
@@ -147,68 +824,206 @@ request_readfile(struct request *rq)
 	int srcfd;
 	struct stat sbuf;
 	struct file_data *data;
-	char *ext;
 
 	data = rq->data;
 	assert(data);
 
-	/* don't serve files that start with /, or .., or end in .c */
-	if (data->file_name[0] == '/') {
-		/* this shouldn't really happen because we add a "./" at the
-		 * beginning of the file path */
-		request_error(rq->fd, data->file_name, "404", "Not found",
-			      "OS Web Server doesn't serve files "
-			      "with absolute paths");
+	if (!request_check_name(rq))
 		return 0;
+	if (!request_check_stat(rq, stat(data->file_name, &sbuf) < 0 ?
+				errno : 0, &sbuf))
+		return 0;
+
+	if (stream_size && data->file_size > stream_size) {
+		/* too large to keep in memory, request_sendfile reads it in
+		 * chunks */
+		SYS(srcfd = open(data->file_name, O_RDONLY, 0));
+		rq->stream = stream_open(srcfd, &sbuf, rq->arena);
+		data->file_csum = stream_csum(rq->stream);
+		/* only the first read of a streamed file is charged for,
+		 * the others overlap with sending */
+		storage_read(STREAM_CHUNK);
+	} else if (data->file_size) {
+		request_load(data);
 	}
-	if (strstr(data->file_name, "..") != NULL) {
-		request_error(rq->fd, data->file_name, "404", "Not found",
-			      "OS Web Server doesn't serve files "
-			      "with .. in the path");
+	return 1;
+}
+
+int
+file_data_read(struct file_data *data, int limit)
+{
+	struct stat sbuf;
+
+	if (request_bad_name(data->file_name) ||
+	    stat(data->file_name, &sbuf) < 0 || !S_ISREG(sbuf.st_mode) ||
+	    !(S_IRUSR & sbuf.st_mode) || sbuf.st_size > limit ||
+	    (stream_size && sbuf.st_size > stream_size))
 		return 0;
+	data->file_size = sbuf.st_size;
+	data->file_mtime = sbuf.st_mtim;
+	if (data->file_size)
+		request_load(data);
+	file_data_compress(data, limit);
+	return 1;
+}
+
+/* finishes a read of the file done elsewhere, e.g., by uring.c, after
+ * request_check_name. err is the errno of the open or stat of the file, and
+ * buf, from bufpool, holds len bytes of it, or is NULL if it was not read.
+ * Returns 1 if the file is ready to send, and takes buf, 0 after responding
+ * with an error, or -1 if the file still needs to be read with
+ * request_readfile. */
+int
+request_readfile_done(struct request *rq, int err, struct stat *sbuf,
+		      char *buf, long len)
+{
+	struct file_data *data = rq->data;
+
+	if (err && err != ENOENT && err != ENOTDIR) {
+		request_error(rq, data->file_name, "403", "Forbidden",
+			      "OS Web Server could not read this file");
+		err = -1;
+	} else if (!request_check_stat(rq, err, sbuf)) {
+		err = -1;
 	}
-	if (((ext = strrchr(data->file_name, '.')) != NULL) && 
-	    ((strcmp(ext, ".c") == 0) || (strcmp(ext, ".h") == 0))) {
-		request_error(rq->fd, data->file_name, "404", "Not found",
-			      "OS Web Server doesn't serve C or header files ");
+	if (err) {
+		bufpool_free(buf);
 		return 0;
 	}
+	if (data->file_size && (!buf || len != data->file_size)) {
+		bufpool_free(buf);
+		return -1;
+	}
+	data->file_buf = buf;
+	if (data->file_size)
+		data->file_csum = request_csum_buf(buf, len);
+	return 1;
+}
 
-	if (stat(data->file_name, &sbuf) < 0) {
-		request_error(rq->fd, data->file_name, "404", "Not found",
-			      "OS Web Server could not find this file");
+/* if you have previous file data, you can reuse it */
+void
+request_set_data(struct request *rq, struct file_data *data)
+{
+	rq->data = data;
+}
+
+void
+request_set_pace(struct request *rq, double (*pace)(void *arg, long bytes),
+		 void *arg)
+{
+	rq->pace = pace;
+	rq->pace_arg = arg;
+}
+
+/* reads the gzip variant of the file from filename.gz, if that file is
+ * up to date. Returns 1 on success. */
+static int
+request_read_gzip(struct file_data *data)
+{
+	char name[MAXLINE];
+	struct stat sbuf;
+	int fd, n;
+
+	snprintf(name, sizeof(name), "%s.gz", data->file_name);
+	if (stat(name, &sbuf) < 0 || !S_ISREG(sbuf.st_mode) ||
+	    sbuf.st_mtime < data->file_mtime.tv_sec ||
+	    sbuf.st_size > GZIP_MAX(data->file_size))
 		return 0;
-	}
-	if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-		request_error(rq->fd, data->file_name, "403", "Forbidden",
-			      "OS Web Server could not read this file");
+	if ((fd = open(name, O_RDONLY, 0)) < 0)
+		return 0;
+	data->gz_buf = bufpool_alloc(sbuf.st_size);
+	n = Rio_read(fd, data->gz_buf, sbuf.st_size);
+	SYS(close(fd));
+	/* must at least look like gzip */
+	if (n != sbuf.st_size || n < 2 || (unsigned char)data->gz_buf[0] != 0x1f ||
+	    (unsigned char)data->gz_buf[1] != 0x8b) {
+		bufpool_free(data->gz_buf);
+		data->gz_buf = NULL;
 		return 0;
 	}
+	data->gz_size = n;
+	return 1;
+}
 
-	data->file_size = sbuf.st_size;
+/* zlib allocates its state, a few hundred KB, for each file compressed. It
+ * comes from bufpool like the file buffers, to keep cache inserts from going
+ * to malloc. */
+static voidpf
+request_zalloc(voidpf opaque, uInt items, uInt size)
+{
+	return bufpool_alloc((size_t)items * size);
+}
 
-	if (data->file_size) {
-		SYS(srcfd = open(data->file_name, O_RDONLY, 0));
-		data->file_buf = Malloc(data->file_size);
-		Rio_read(srcfd, data->file_buf, data->file_size);
-		/* ask the kernel to stop caching the file */
-		SYS(posix_fadvise(srcfd, 0, data->file_size, 
-				  POSIX_FADV_DONTNEED));
-		SYS(close(srcfd));
-		/* we do this to simulate a slow disk. otherwise, file caching
-		 * doesn't have much benefit because a lot of the time is spent
-		 * in processing (see request_processfile below) and so
-		 * request_readfile does not have much impact. */
-		usleep(10000);
+static void
+request_zfree(voidpf opaque, voidpf p)
+{
+	bufpool_free(p);
+}
+
+/* compresses the file with gzip. Returns 1 if that saved enough space to be
+ * worth keeping. */
+static int
+request_deflate(struct file_data *data)
+{
+	z_stream zs;
+	int ret;
+
+	memset(&zs, 0, sizeof(zs));
+	zs.zalloc = request_zalloc;
+	zs.zfree = request_zfree;
+	/* 16 + MAX_WBITS asks for a gzip header and trailer */
+	if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS,
+			 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return 0;
+	data->gz_buf = bufpool_alloc(deflateBound(&zs, data->file_size));
+	zs.next_in = (Bytef *)data->file_buf;
+	zs.avail_in = data->file_size;
+	zs.next_out = (Bytef *)data->gz_buf;
+	zs.avail_out = deflateBound(&zs, data->file_size);
+	ret = deflate(&zs, Z_FINISH);
+	deflateEnd(&zs);
+	if (ret != Z_STREAM_END ||
+	    zs.total_out > GZIP_MAX(data->file_size)) {
+		bufpool_free(data->gz_buf);
+		data->gz_buf = NULL;
+		return 0;
 	}
+	data->gz_size = zs.total_out;
 	return 1;
 }
 
-/* if you have previous file data, you can reuse it */
+/* builds the gzip encoded variant of a text file that has been read into
+ * memory, so that it can be cached along with the file. It is read from a
+ * filename.gz next to the file when there is an up to date one, and is made
+ * with zlib otherwise. The variant is dropped if the file and the variant
+ * together would take more than limit bytes. The variant is sent to clients
+ * whose Accept-Encoding allows gzip. */
 void
-request_set_data(struct request *rq, struct file_data *data)
+file_data_compress(struct file_data *data, int limit)
 {
-	rq->data = data;
+	char filetype[32];
+
+	if (!data->file_buf || data->gz_buf ||
+	    data->file_size < GZIP_MIN_SIZE)
+		return;
+	request_get_file_type(data->file_name, filetype);
+	if (strncmp(filetype, "text/", 5) != 0)
+		return;
+	if (!request_read_gzip(data) && !request_deflate(data))
+		return;
+	if (file_data_size(data) > limit) {
+		bufpool_free(data->gz_buf);
+		data->gz_buf = NULL;
+		data->gz_size = 0;
+		return;
+	}
+	data->gz_csum = request_csum_buf(data->gz_buf, data->gz_size);
+}
+
+void
+request_compress(struct request *rq, int limit)
+{
+	file_data_compress(rq->data, limit);
 }
 
 /* process file, the main reason for this function is that if we don't do enough
@@ -217,51 +1032,486 @@ request_set_data(struct request *rq, struct file_data *data)
  * problem because we have 100 Mb/s network. With faster networks, we wouldn't
  * have to do this artificial work. */
 static void
+request_process_chunk(void *arg, long start, long end)
+{
+	char *buf = (char *)arg + start;
+	int i;
+	unsigned int dummy = 0;
+
+	for (i = 0; i < 128; i++) {
+		dummy += csum_bytes(buf, end - start);
+	}
+}
+
+static void
+request_process(char *buf, long len)
+{
+	forkjoin_for(len, PAR_CHUNK, request_process_chunk, buf);
+}
+
+/* processes the ranges of the file being sent */
+static void
 request_processfile(struct request *rq)
 {
 	struct file_data *data;
-	int i, j, dummy;
+	struct byte_range *r;
+	int i;
+
 	data = rq->data;
 	assert(data);
 
-	for (i = 0; i < 128; i++) {
-		for (j = 0; j < data->file_size; j++) {
-			dummy += (unsigned char)(data->file_buf[j]);
+	for (i = 0; i < rq->nr_ranges; i++) {
+		r = &rq->ranges[i];
+		request_process(rq->src + r->start, r->end - r->start + 1);
+	}
+}
+
+/* checksum of the ranges of the file being sent */
+static unsigned int
+request_csum(struct request *rq)
+{
+	struct byte_range *r;
+	unsigned int csum = 0;
+	int i;
+
+	for (i = 0; i < rq->nr_ranges; i++) {
+		r = &rq->ranges[i];
+		if (rq->stream)
+			csum += stream_sum(rq->stream, r->start, r->end + 1);
+		else
+			csum += request_csum_buf(rq->src + r->start,
+						 r->end - r->start + 1);
+	}
+	return csum;
+}
+
+/* formats the header that starts a part of a multipart/byteranges body into
+ * buf, and returns its length */
+static int
+request_part_header(struct request *rq, const struct byte_range *r, char *buf)
+{
+	char filetype[32];
+
+	request_get_file_type(rq->data->file_name, filetype);
+	return sprintf(buf, "\r\n--" BOUNDARY "\r\n"
+		       "Content-Type: %s\r\n"
+		       "Content-Range: bytes %ld-%ld/%d\r\n\r\n",
+		       filetype, r->start, r->end, rq->data->file_size);
+}
+
+#define PART_TRAILER "\r\n--" BOUNDARY "--\r\n"
+
+/* length of the body of a multipart/byteranges response */
+static long
+request_multipart_length(struct request *rq)
+{
+	char buf[MAXLINE];
+	struct byte_range *r;
+	long len = strlen(PART_TRAILER);
+	int i;
+
+	for (i = 0; i < rq->nr_ranges; i++) {
+		r = &rq->ranges[i];
+		len += request_part_header(rq, r, buf) + r->end - r->start + 1;
+	}
+	return len;
+}
+
+/* makes the next chunk of a streamed file the body to send.
+ * Returns 0 when the whole file has been sent. */
+static int
+request_stream_chunk(struct request *rq)
+{
+	char *buf;
+	long n;
+
+	n = stream_next(rq->stream, &buf);
+	if (n == 0)
+		return 0;
+	request_process(buf, n);
+	rq->body = buf;
+	rq->body_len = n;
+	rq->body_sent = 0;
+	return 1;
+}
+
+/* moves on to the next piece of the body once everything before it has been
+ * sent: the next chunk of a streamed range, or else the next range, preceded
+ * by its part header for a multipart response. Bodies that are not streamed
+ * point into data->file_buf, which the caller keeps alive until the response
+ * has been sent. Returns 0 when the whole body has been sent, and, for a
+ * nonblocking request, 2 instead of waiting for the next chunk of a streamed
+ * file, which request_read_chunk then reads. */
+static int
+request_next_body(struct request *rq)
+{
+	char buf[MAXLINE];
+	struct byte_range *r;
+
+	if (rq->stream && rq->stream->pending) {
+		if (rq->nonblock)
+			return 2;
+		if (request_stream_chunk(rq))
+			return 1;
+	}
+	if (rq->range == rq->nr_ranges + rq->multipart)
+		return 0;
+	/* reuse the space of the staged bytes once they are sent */
+	if (rq->out_sent == rq->out_len)
+		rq->out_len = rq->out_sent = 0;
+	rq->body_len = rq->body_sent = 0;
+	if (rq->range == rq->nr_ranges) {
+		request_write(rq, PART_TRAILER, strlen(PART_TRAILER));
+		rq->range++;
+		return 1;
+	}
+	r = &rq->ranges[rq->range++];
+	if (rq->multipart)
+		request_write(rq, buf, request_part_header(rq, r, buf));
+	if (rq->stream) {
+		stream_seek(rq->stream, r->start, r->end + 1);
+		stream_start_read(rq->stream);
+		/* a part header is sent before waiting for the first chunk */
+		return rq->multipart ? 1 : request_next_body(rq);
+	}
+	rq->body = rq->src + r->start;
+	rq->body_len = r->end - r->start + 1;
+	return 1;
+}
+
+/* writes the staged body of a blocking request to the client, paced if
+ * request_set_pace asked for it */
+static void
+request_write_body(struct request *rq)
+{
+	struct timespec ts;
+	double wait;
+	long off, n;
+
+	if (!rq->pace) {
+		Rio_write(rq->fd, rq->body, rq->body_len);
+		return;
+	}
+	for (off = 0; off < rq->body_len; off += n) {
+		n = rq->body_len - off < PACE_CHUNK ? rq->body_len - off :
+			PACE_CHUNK;
+		Rio_write(rq->fd, rq->body + off, n);
+		if ((wait = rq->pace(rq->pace_arg, n)) > 0) {
+			ts.tv_sec = (time_t)wait;
+			ts.tv_nsec = (wait - ts.tv_sec) * 1e9;
+			nanosleep(&ts, NULL);
+		}
+	}
+}
+
+/* sends a 416 response for a request whose ranges all lie past the end of the
+ * file */
+static void
+request_range_error(struct request *rq)
+{
+	char buf[MAXLINE];
+	int size = 0;
+
+	size += sprintf(buf + size, "HTTP/1.0 416 Range Not Satisfiable\r\n");
+	size += sprintf(buf + size, "Server: OS Web Server\r\n");
+	size += request_connection(rq, buf + size);
+	size += sprintf(buf + size, "Content-Range: bytes */%d\r\n",
+			rq->data->file_size);
+	size += sprintf(buf + size, "Content-Length: 0\r\n");
+	size += sprintf(buf + size, "Content-Csum: 0\r\n\r\n");
+	request_write(rq, buf, size);
+	log_access(416, 0, rq->data->file_name);
+	rq->responded = 1;
+}
+
+/* formats the entity tag of the file into etag. It changes whenever the
+ * contents of the file may have, since it is made of the size, modification
+ * time and checksum of the file. The gzip variant gets a tag of its own. */
+static void
+request_etag(struct file_data *data, int gzip, char *etag, int len)
+{
+	snprintf(etag, len, "\"%x-%lx.%lx-%x%s\"", data->file_size,
+		 (long)data->file_mtime.tv_sec, data->file_mtime.tv_nsec,
+		 data->file_csum, gzip ? "-gz" : "");
+}
+
+/* returns 1 if the gzip variant of the file can be sent: the client accepts
+ * gzip, going by the q values of Accept-Encoding, and has not asked for
+ * ranges, which are always served from the file itself */
+static int
+request_accepts_gzip(struct request *rq)
+{
+	const struct http_slice *h;
+	const char *p, *end, *item;
+	char coding[64];
+	int gzip = -1, star = -1, q, len;
+	double qval;
+
+	if (!rq->hp || http_header(rq->hp, "Range") ||
+	    !(h = http_header(rq->hp, "Accept-Encoding")))
+		return 0;
+	p = h->p;
+	end = h->p + h->len;
+	while (p < end) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+			p++;
+		item = p;
+		while (p < end && *p != ',')
+			p++;
+		len = p - item < (int)sizeof(coding) ? p - item :
+			(int)sizeof(coding) - 1;
+		snprintf(coding, sizeof(coding), "%.*s", len, item);
+		/* coding[;q=value] */
+		q = 1000;
+		if ((item = strchr(coding, ';'))) {
+			if (sscanf(item, " ; q = %lf", &qval) == 1)
+				q = qval * 1000;
+			coding[item - coding] = '\0';
 		}
+		coding[strcspn(coding, " \t")] = '\0';
+		if (strcasecmp(coding, "gzip") == 0 ||
+		    strcasecmp(coding, "x-gzip") == 0)
+			gzip = q;
+		else if (strcmp(coding, "*") == 0)
+			star = q;
 	}
+	return gzip >= 0 ? gzip > 0 : star > 0;
 }
 
-/* send filename to the fd connection */
+/* returns 1 if the comma separated list of entity tags in h matches etag.
+ * As If-None-Match asks for, weak tags compare equal to strong ones. */
+static int
+etag_match(const struct http_slice *h, const char *etag)
+{
+	const char *p = h->p, *end = h->p + h->len, *tag;
+	int len = strlen(etag);
+
+	while (p < end) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+			p++;
+		tag = p;
+		while (p < end && *p != ',' && *p != ' ' && *p != '\t')
+			p++;
+		if (p - tag == 1 && *tag == '*')
+			return 1;
+		if (p - tag > 2 && strncmp(tag, "W/", 2) == 0)
+			tag += 2;
+		if (p - tag == len && strncmp(tag, etag, len) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/* returns 1 if the client's copy of the file is current, going by the
+ * If-None-Match header, or by If-Modified-Since when there is none */
+static int
+request_not_modified(struct request *rq, const char *etag)
+{
+	const struct http_slice *h;
+	char date[64];
+	struct tm tm;
+
+	if (!rq->hp)
+		return 0;
+	if ((h = http_header(rq->hp, "If-None-Match")))
+		return etag_match(h, etag);
+	if (!(h = http_header(rq->hp, "If-Modified-Since")) ||
+	    h->len >= (int)sizeof(date))
+		return 0;
+	snprintf(date, sizeof(date), "%.*s", h->len, h->p);
+	memset(&tm, 0, sizeof(tm));
+	if (!strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm))
+		return 0;
+	return rq->data->file_mtime.tv_sec <= timegm(&tm);
+}
+
+/* sends a 304 response, with no body */
+static void
+request_send_not_modified(struct request *rq, const char *etag,
+			  const char *modified)
+{
+	char buf[MAXLINE];
+	int size = 0;
+
+	size += sprintf(buf + size, "HTTP/1.0 304 Not Modified\r\n");
+	size += sprintf(buf + size, "Server: OS Web Server\r\n");
+	size += request_connection(rq, buf + size);
+	size += sprintf(buf + size, "ETag: %s\r\n", etag);
+	size += sprintf(buf + size, "Last-Modified: %s\r\n\r\n", modified);
+	request_write(rq, buf, size);
+	log_access(304, 0, rq->data->file_name);
+	rq->responded = 1;
+}
+
+/* send filename to the fd connection. If the request has a Range header, only
+ * the ranges asked for are processed and sent, in a 206 response. If the
+ * client already has the current version of the file, a 304 is sent instead,
+ * without processing the file. */
 void
 request_sendfile(struct request *rq)
 {
-	char filetype[MAXLINE], buf[MAXBUF];
-	int i;
-	unsigned int csum = 0;
+	char filetype[32], buf[MAXBUF], etag[64], modified[64];
+	unsigned int csum;
 	struct file_data *data;
-	long size = 0;
+	struct byte_range *r;
+	struct tm tm;
+	long size = 0, length, content_length;
+	int partial, gzip;
 
 	data = rq->data;
 	assert(data);
 
+	gzip = data->gz_buf && request_accepts_gzip(rq);
+	rq->src = gzip ? data->gz_buf : data->file_buf;
+	length = gzip ? data->gz_size : data->file_size;
+
+	request_etag(data, gzip, etag, sizeof(etag));
+	gmtime_r(&data->file_mtime.tv_sec, &tm);
+	strftime(modified, sizeof(modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	if (request_not_modified(rq, etag)) {
+		request_send_not_modified(rq, etag, modified);
+		return;
+	}
+
+	partial = request_parse_ranges(rq, data->file_size);
+	if (partial < 0) {
+		request_range_error(rq);
+		return;
+	}
+	if (!partial && length > 0) {
+		/* the whole file is a single range */
+		r = arena_alloc(rq->arena, sizeof(struct byte_range));
+		r->start = 0;
+		r->end = length - 1;
+		rq->ranges = r;
+		rq->nr_ranges = 1;
+	}
+
 	request_get_file_type(data->file_name, filetype);
-	/* generate a very trivial checksum */
-	for (i = 0; i < data->file_size; i++) {
-		csum += (unsigned char)(data->file_buf[i]);
+	if (partial)
+		csum = request_csum(rq);
+	else
+		csum = gzip ? data->gz_csum : data->file_csum;
+	if (!rq->stream) {
+		/* do some processing. the chunks of a streamed file are
+		 * processed as they are sent */
+		request_processfile(rq);
 	}
-	/* do some processing */
-	request_processfile(rq);
 	/* put together response */
-	size += sprintf(buf + size, "HTTP/1.0 200 OK\r\n");
+	if (!partial) {
+		size += sprintf(buf + size, "HTTP/1.0 200 OK\r\n");
+	} else {
+		size += sprintf(buf + size, "HTTP/1.0 206 Partial Content\r\n");
+	}
 	size += sprintf(buf + size, "Server: OS Web Server\r\n");
-	size += sprintf(buf + size, "Content-Type: %s\r\n", filetype);
-	size += sprintf(buf + size, "Content-Length: %d\r\n", data->file_size);
+	size += sprintf(buf + size, "Accept-Ranges: bytes\r\n");
+	size += request_connection(rq, buf + size);
+	size += sprintf(buf + size, "ETag: %s\r\n", etag);
+	size += sprintf(buf + size, "Last-Modified: %s\r\n", modified);
+	if (data->gz_buf) {
+		size += sprintf(buf + size, "Vary: Accept-Encoding\r\n");
+	}
+	if (gzip) {
+		size += sprintf(buf + size, "Content-Encoding: gzip\r\n");
+	}
+	if (rq->multipart) {
+		content_length = request_multipart_length(rq);
+		size += sprintf(buf + size, "Content-Type: multipart/byteranges; "
+				"boundary=" BOUNDARY "\r\n");
+	} else {
+		content_length = length;
+		size += sprintf(buf + size, "Content-Type: %s\r\n", filetype);
+		if (partial) {
+			r = &rq->ranges[0];
+			content_length = r->end - r->start + 1;
+			size += sprintf(buf + size, "Content-Range: bytes "
+					"%ld-%ld/%d\r\n", r->start, r->end,
+					data->file_size);
+		}
+	}
+	size += sprintf(buf + size, "Content-Length: %ld\r\n", content_length);
 	size += sprintf(buf + size, "Content-Csum: %u\r\n\r\n", csum);
 
-	Rio_write(rq->fd, buf, strlen(buf));
+	request_write(rq, buf, strlen(buf));
+	rq->length = content_length;
+	log_access(partial ? 206 : 200, content_length, data->file_name);
+	rq->responded = 1;
 
-	/* writes data->file_buf to the client socket */
-	if (data->file_size > 0) {
-		Rio_write(rq->fd, data->file_buf, data->file_size);
+	if (rq->nonblock) {
+		/* stage the first piece of the body to go out with the head,
+		 * request_flush pulls in the rest */
+		if (request_next_body(rq) == 2)
+			request_read_chunk(rq);
+	} else {
+		/* writes the body to the client socket */
+		while (request_next_body(rq)) {
+			if (rq->body_len)
+				request_write_body(rq);
+		}
 	}
 }
+
+void
+request_read_chunk(struct request *rq)
+{
+	/* if the file shrank, request_flush moves on to the next range */
+	request_stream_chunk(rq);
+}
+
+/* sends the response staged by a nonblocking request.
+ * Returns 1 once the whole response has been sent, 0 if the socket buffer is
+ * full and the caller should wait for the socket to become writable, 2 if
+ * the next chunk of a streamed file has to be read first, with
+ * request_read_chunk, and -1 if the client has gone away. */
+int
+request_flush(struct request *rq)
+{
+	struct iovec iov[2];
+	struct msghdr msg;
+	ssize_t n;
+	int head, next;
+
+	assert(rq->nonblock);
+	while (1) {
+		if (rq->out_sent == rq->out_len &&
+		    rq->body_sent == rq->body_len) {
+			/* move on to the next range, or the next chunk of a
+			 * streamed file, which is left to the caller */
+			if (!(next = request_next_body(rq)))
+				break;
+			if (next == 2)
+				return 2;
+			continue;
+		}
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		if (rq->out_sent < rq->out_len) {
+			iov[msg.msg_iovlen].iov_base = rq->out + rq->out_sent;
+			iov[msg.msg_iovlen].iov_len = rq->out_len - rq->out_sent;
+			msg.msg_iovlen++;
+		}
+		if (rq->body_sent < rq->body_len) {
+			iov[msg.msg_iovlen].iov_base = rq->body + rq->body_sent;
+			iov[msg.msg_iovlen].iov_len = rq->body_len -
+				rq->body_sent;
+			msg.msg_iovlen++;
+		}
+		/* MSG_NOSIGNAL: a client hanging up must not kill the server */
+		n = sendmsg(rq->fd, &msg, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+		head = rq->out_len - rq->out_sent;
+		if (n < head) {
+			rq->out_sent += n;
+		} else {
+			rq->out_sent = rq->out_len;
+			rq->body_sent += n - head;
+		}
+	}
+	return 1;
+}
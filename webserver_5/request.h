@@ -1,21 +1,96 @@
 #ifndef __REQUEST_H__
 #define __REQUEST_H__
 
+#include <time.h>
+#include <sys/stat.h>
+#include "http_parse.h"
+#include "arena.h"
+
 struct file_data {
 	char *file_name; /* name of file being requested */
 	char *file_buf;	 /* file is read into this buffer in memory */
 	int file_size;	 /* file size */
+	struct timespec file_mtime; /* modification time, when it was read */
+	unsigned int file_csum; /* checksum of the whole file */
+	char *gz_buf;	 /* gzip encoded file, or NULL */
+	int gz_size;
+	unsigned int gz_csum;
+	int prefetched;	 /* read by the prefetcher, and not yet requested */
+	int refs;	 /* references held by requests and the cache */
+};
+
+struct stream;
+
+/* a range of bytes of the file, both ends included */
+struct byte_range {
+	long start;
+	long end;
 };
 
 struct request {
 	int fd;		 /* descriptor for client connection */
 	struct file_data *data;
+	int nonblock;	 /* stage the response instead of writing it */
+	int responded;	 /* a response (possibly an error) has been produced */
+	struct arena *arena; /* holds the request, reset when it is destroyed */
+	char *out;	 /* staged response head, or a whole error response */
+	int out_len;
+	int out_cap;
+	int out_sent;
+	char *src;	 /* data->file_buf, or data->gz_buf when the gzip
+			  * encoded file is sent */
+	char *body;	 /* staged body, points into src */
+	int body_len;
+	int body_sent;
+	struct stream *stream; /* set when the file is sent in chunks */
+	struct byte_range *ranges; /* parts of the file to send, in order */
+	int nr_ranges;
+	int range;	 /* next range to send */
+	int multipart;	 /* ranges are sent as multipart/byteranges */
+	const struct http_parser *hp; /* request headers, valid until the
+				       * response has been produced */
+	long length;	 /* of the response body, once it is produced */
+	int keep_alive;	 /* the connection stays open for another request */
+	double (*pace)(void *arg, long bytes); /* see request_set_pace */
+	void *pace_arg;
 };
 
-struct request *request_init(int connfd, struct file_data *data);
+struct file_data *file_data_init(void);
+void file_data_ref(struct file_data *data);
+void file_data_free(struct file_data *data);
+int file_data_size(struct file_data *data);
+int file_data_charge(struct file_data *data);
+/* reads the file named in data into it, without a request, e.g., to prefetch
+ * it, along with its gzip variant. Returns 0 if the file may not be served,
+ * can't be read, or would be streamed or take more than limit bytes. */
+int file_data_read(struct file_data *data, int limit);
+void file_data_compress(struct file_data *data, int limit);
+
+void request_set_stream_size(int size);
+void request_set_direct_io(int on);
+struct request *request_init(int connfd, struct file_data *data,
+			     struct arena *arena);
+struct request *request_init_nb(int connfd, struct file_data *data,
+				const struct http_parser *hp, int parsed,
+				struct arena *arena);
+int request_check_name(struct request *rq);
+void request_busy(struct request *rq);
 int request_readfile(struct request *rq);
+int request_readfile_done(struct request *rq, int err, struct stat *sbuf,
+			  char *buf, long len);
 void request_set_data(struct request *rq, struct file_data *data);
+/* has a blocking request call pace with the bytes of the body as it writes
+ * them, and wait the seconds it returns before writing more */
+void request_set_pace(struct request *rq,
+		      double (*pace)(void *arg, long bytes), void *arg);
+void request_compress(struct request *rq, int limit);
 void request_sendfile(struct request *rq);
+int request_flush(struct request *rq);
+/* waits for the next chunk of the streamed file of a nonblocking request, and
+ * processes it, once request_flush has returned 2. Being CPU and disk bound,
+ * this is meant for a worker rather than an event loop. */
+void request_read_chunk(struct request *rq);
 void request_destroy(struct request *rq);
+void request_finish(struct request *rq);
 
 #endif
@@ -0,0 +1,289 @@
+/*
+ * restart.c: hot restart (see restart.h).
+ */
+
+#define _GNU_SOURCE	/* for memfd_create */
+#include <sys/un.h>
+#include "common.h"
+#include "restart.h"
+#include "server_thread.h"
+#include "bufpool.h"
+#include "log.h"
+
+#define RESTART_MAGIC 0x52535446	/* "RSTF" */
+
+/* a handoff to a new server, in a thread of its own */
+struct restart_handoff {
+	int fd;			/* the connection to the new server */
+	int listenfd;
+	struct server *sv;
+	int donefd[2];		/* a pipe, readable once done */
+	int ok;			/* the new server took over */
+	pthread_t thread;
+};
+
+/* a file in the snapshot, followed by its name, contents and gzip encoded
+ * contents */
+struct restart_file {
+	uint32_t magic;
+	uint32_t name_len;	/* including the NUL */
+	int32_t file_size;
+	int32_t gz_size;
+	uint32_t file_csum;
+	uint32_t gz_csum;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+};
+
+static void
+restart_addr(struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, RESTART_SOCKET);
+}
+
+int
+restart_listen(void)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	restart_addr(&addr);
+	unlink(RESTART_SOCKET);
+	SYS(fd = socket(AF_UNIX, SOCK_STREAM, 0));
+	SYS(bind(fd, (struct sockaddr *)&addr, sizeof(addr)));
+	SYS(listen(fd, 1));
+	return fd;
+}
+
+void
+restart_close(int restartfd, int owned)
+{
+	SYS(close(restartfd));
+	if (owned)
+		unlink(RESTART_SOCKET);
+}
+
+void
+restart_save(int fd, struct file_data *data)
+{
+	struct restart_file f;
+
+	f.magic = RESTART_MAGIC;
+	f.name_len = strlen(data->file_name) + 1;
+	f.file_size = data->file_size;
+	f.gz_size = data->gz_size;
+	f.file_csum = data->file_csum;
+	f.gz_csum = data->gz_csum;
+	f.mtime_sec = data->file_mtime.tv_sec;
+	f.mtime_nsec = data->file_mtime.tv_nsec;
+	Rio_write(fd, &f, sizeof(f));
+	Rio_write(fd, data->file_name, f.name_len);
+	if (data->file_size)
+		Rio_write(fd, data->file_buf, data->file_size);
+	if (data->gz_size)
+		Rio_write(fd, data->gz_buf, data->gz_size);
+}
+
+/* copies len bytes at map + *off to a buffer from bufpool, moving *off
+ * past them. Returns NULL if they run past size. */
+static char *
+restart_copy(const char *map, long size, long *off, long len)
+{
+	char *buf;
+
+	if (len < 0 || len > size - *off)
+		return NULL;
+	buf = bufpool_alloc(len);
+	memcpy(buf, map + *off, len);
+	*off += len;
+	return buf;
+}
+
+int
+restart_load(int fd, void (*add)(void *arg, struct file_data *data),
+	     void *arg)
+{
+	struct restart_file f;
+	struct file_data *data;
+	struct stat sbuf;
+	char *map;
+	long off = 0;
+	int nr = 0;
+
+	SYS(fstat(fd, &sbuf));
+	if (sbuf.st_size == 0)
+		return 0;
+	map = mmap(NULL, sbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return 0;
+	while (sbuf.st_size - off >= (long)sizeof(f)) {
+		memcpy(&f, map + off, sizeof(f));
+		off += sizeof(f);
+		if (f.magic != RESTART_MAGIC || f.name_len == 0)
+			break;
+		data = file_data_init();
+		data->file_size = f.file_size;
+		data->gz_size = f.gz_size;
+		data->file_csum = f.file_csum;
+		data->gz_csum = f.gz_csum;
+		data->file_mtime.tv_sec = f.mtime_sec;
+		data->file_mtime.tv_nsec = f.mtime_nsec;
+		if (!(data->file_name = restart_copy(map, sbuf.st_size, &off,
+						     f.name_len)) ||
+		    (f.file_size &&
+		     !(data->file_buf = restart_copy(map, sbuf.st_size, &off,
+						     f.file_size))) ||
+		    (f.gz_size &&
+		     !(data->gz_buf = restart_copy(map, sbuf.st_size, &off,
+						   f.gz_size)))) {
+			file_data_free(data);
+			break;
+		}
+		data->file_name[f.name_len - 1] = 0;
+		add(arg, data);
+		nr++;
+	}
+	munmap(map, sbuf.st_size);
+	return nr;
+}
+
+static void *
+restart_handoff_thread(void *arg)
+{
+	struct restart_handoff *h = (struct restart_handoff *)arg;
+	char cbuf[CMSG_SPACE(2 * sizeof(int))], ready, go = 1;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	struct pollfd pfd;
+	int memfd, fds[2], nr;
+
+	SYS(memfd = memfd_create("server-cache", 0));
+	nr = server_save_cache(h->sv, memfd);
+
+	/* one byte of data, to carry the descriptors */
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = "R";
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+	fds[0] = h->listenfd;
+	fds[1] = memfd;
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	if (sendmsg(h->fd, &msg, MSG_NOSIGNAL) == 1) {
+		/* the main thread goes on serving until the new server is
+		 * ready. Confirming commits us to stopping; without it, the
+		 * new server gives up. */
+		pfd.fd = h->fd;
+		pfd.events = POLLIN;
+		h->ok = poll(&pfd, 1, RESTART_TIMEOUT_MS) == 1 &&
+			read(h->fd, &ready, 1) == 1 &&
+			send(h->fd, &go, 1, MSG_NOSIGNAL) == 1;
+	}
+	SYS(close(memfd));
+	SYS(close(h->fd));
+	if (h->ok)
+		log_msg(LOG_WARN, "restart: handed over %d cached files", nr);
+	else
+		log_msg(LOG_WARN, "restart: the new server did not start");
+	SYS(write(h->donefd[1], "x", 1));
+	return NULL;
+}
+
+struct restart_handoff *
+restart_handoff(int restartfd, int listenfd, struct server *sv)
+{
+	struct restart_handoff *h;
+	int fd;
+
+	if ((fd = accept(restartfd, NULL, NULL)) < 0)
+		return NULL;
+	h = Malloc(sizeof(struct restart_handoff));
+	h->fd = fd;
+	h->listenfd = listenfd;
+	h->sv = sv;
+	h->ok = 0;
+	SYS(pipe(h->donefd));
+	pthread_create(&h->thread, NULL, restart_handoff_thread, h);
+	return h;
+}
+
+int
+restart_handoff_fd(struct restart_handoff *h)
+{
+	return h->donefd[0];
+}
+
+int
+restart_handoff_done(struct restart_handoff *h)
+{
+	int ok;
+
+	pthread_join(h->thread, NULL);
+	ok = h->ok;
+	SYS(close(h->donefd[0]));
+	SYS(close(h->donefd[1]));
+	free(h);
+	return ok;
+}
+
+int
+restart_takeover(struct server *sv, int *donefd)
+{
+	char cbuf[CMSG_SPACE(2 * sizeof(int))], byte;
+	struct sockaddr_un addr;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	int fd, fds[2], nr;
+
+	restart_addr(&addr);
+	SYS(fd = socket(AF_UNIX, SOCK_STREAM, 0));
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		SYS(close(fd));
+		return -1;
+	}
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	if (recvmsg(fd, &msg, 0) != 1 || !(cmsg = CMSG_FIRSTHDR(&msg)) ||
+	    cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int))) {
+		SYS(close(fd));
+		return -1;
+	}
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+	nr = server_load_cache(sv, fds[1]);
+	SYS(close(fds[1]));
+	log_msg(LOG_WARN, "restart: took over %d cached files", nr);
+	*donefd = fd;
+	return fds[0];
+}
+
+int
+restart_ready(int donefd)
+{
+	char ready = 1, go;
+	struct pollfd pfd;
+	int ok;
+
+	pfd.fd = donefd;
+	pfd.events = POLLIN;
+	ok = send(donefd, &ready, 1, MSG_NOSIGNAL) == 1 &&
+		poll(&pfd, 1, RESTART_TIMEOUT_MS) == 1 &&
+		read(donefd, &go, 1) == 1;
+	SYS(close(donefd));
+	return ok;
+}
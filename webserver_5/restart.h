@@ -0,0 +1,63 @@
+#ifndef __RESTART_H__
+#define __RESTART_H__
+
+#include "request.h"
+
+/* Hot restart: a new server process takes over from the one running in the
+ * same directory, without the port being closed or the cache lost. The
+ * running server listens on RESTART_SOCKET. A new one started with -R
+ * connects there, and is sent the listen socket, and a snapshot of the cache
+ * in a memfd, with SCM_RIGHTS. The old server does this in a thread of its
+ * own, and goes on accepting connections meanwhile.
+ *
+ * Once the new server has loaded the snapshot and its workers are running,
+ * it says it is ready, and the old server, if it has not given up waiting
+ * by then, confirms. Only then does the new server take over the exit fifo
+ * and RESTART_SOCKET and start accepting, while the old one stops
+ * accepting, serves the connections it has already taken, for up to
+ * RESTART_DRAIN_MS, and exits. If the new server is not ready within
+ * RESTART_TIMEOUT_MS, the old one goes on serving as before, and the new
+ * one, unconfirmed, exits without having touched either. */
+
+#define RESTART_SOCKET "./server_restart"
+#define RESTART_TIMEOUT_MS 10000 /* for the new server to be ready */
+#define RESTART_DRAIN_MS 5000
+
+struct server;
+struct restart_handoff;
+
+/* returns a socket listening on RESTART_SOCKET */
+int restart_listen(void);
+/* starts handing listenfd, and the cache of sv, to the new server
+ * connecting on restartfd, in a thread. Returns the handoff, or NULL if the
+ * new server is gone already. */
+struct restart_handoff *restart_handoff(int restartfd, int listenfd,
+					struct server *sv);
+/* returns a descriptor that becomes readable once the handoff is done */
+int restart_handoff_fd(struct restart_handoff *h);
+/* waits for the handoff to be done, and frees it. Returns 1 if the new
+ * server took over, in which case this one must stop accepting, or 0 if it
+ * failed, in which case this one should go on. */
+int restart_handoff_done(struct restart_handoff *h);
+/* takes over from the server running in this directory, loading its cache
+ * into sv. Returns its listen socket, or -1 if there is no server to take
+ * over from, with *donefd set to the connection to tell it that this server
+ * is ready on, with restart_ready. */
+int restart_takeover(struct server *sv, int *donefd);
+/* tells the old server that this one is ready, and waits for it to
+ * confirm. Returns 0 if it does not, e.g., because it gave up waiting, in
+ * which case it is still serving, and this server must exit, without
+ * touching the exit fifo or RESTART_SOCKET. */
+int restart_ready(int donefd);
+/* closes restartfd, and removes RESTART_SOCKET if this server still owns
+ * it */
+void restart_close(int restartfd, int owned);
+
+/* the cache snapshot, on fd: restart_save adds a file to it, and
+ * restart_load calls add for each file in it, with a reference to the file
+ * data. Returns the number of files. */
+void restart_save(int fd, struct file_data *data);
+int restart_load(int fd, void (*add)(void *arg, struct file_data *data),
+		 void *arg);
+
+#endif /* __RESTART_H__ */
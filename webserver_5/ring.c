@@ -0,0 +1,303 @@
+/*
+ * ring.c: a lock-free bounded queue of connections (see ring.h).
+ */
+
+#include <limits.h>
+#include <stdint.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "common.h"
+#include "ring.h"
+
+#define CACHE_LINE 64
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() do { } while (0)
+#endif
+
+/* the sequence number of a cell is 2 * pos while it is free for the producer
+ * at pos, and 2 * pos + 1 once it holds that producer's connfd. Doubling
+ * them keeps the two apart even with a single cell. */
+struct ring_cell {
+	uint64_t seq;
+	int connfd;
+} __attribute__((aligned(CACHE_LINE)));
+
+/* where callers wait for the ring to change */
+struct ring_wait {
+	uint32_t seq;		/* bumped by every change, the futex word */
+	int sleepers;
+	int kicks;		/* sleepers to send away, see ring_kick */
+} __attribute__((aligned(CACHE_LINE)));
+
+struct ring {
+	struct ring_cell *cells;
+	uint64_t size;
+	int spin;		/* times to try again before sleeping */
+	int stopped;
+	uint64_t head __attribute__((aligned(CACHE_LINE))); /* next to pop */
+	uint64_t tail __attribute__((aligned(CACHE_LINE))); /* next to push */
+	struct ring_wait nonempty;
+	struct ring_wait nonfull;
+};
+
+static void
+futex_wait(uint32_t *addr, uint32_t val)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void
+futex_wake(uint32_t *addr, int nr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, nr, NULL, NULL, 0);
+}
+
+static void *
+ring_alloc(size_t size)
+{
+	void *p = NULL;
+
+	if (posix_memalign(&p, CACHE_LINE, size) != 0)
+		unix_error("posix_memalign error");
+	memset(p, 0, size);
+	return p;
+}
+
+struct ring *
+ring_init(int size)
+{
+	struct ring *r;
+	int i;
+
+	if (size < 1)
+		size = 1;
+	r = ring_alloc(sizeof(struct ring));
+	r->cells = ring_alloc(size * sizeof(struct ring_cell));
+	for (i = 0; i < size; i++)
+		r->cells[i].seq = 2 * (uint64_t)i;
+	r->size = size;
+	/* with one CPU, the thread that would change the ring can't run
+	 * while we spin */
+	r->spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? RING_SPIN : 0;
+	return r;
+}
+
+/* tries to queue connfd, without waking anyone. Returns 0 if the ring is
+ * full. */
+static int
+ring_put(struct ring *r, int connfd)
+{
+	struct ring_cell *c;
+	uint64_t pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	int64_t diff;
+
+	while (1) {
+		c = &r->cells[pos % r->size];
+		diff = (int64_t)(__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) -
+				 2 * pos);
+		if (diff == 0) {
+			/* the cell is free, if no other producer takes pos */
+			if (__atomic_compare_exchange_n(&r->tail, &pos, pos + 1,
+							1, __ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return 0; /* the consumer a lap behind is not done */
+		} else {
+			pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+		}
+	}
+	c->connfd = connfd;
+	__atomic_store_n(&c->seq, 2 * pos + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* tries to take a connection into *connfd, without waking anyone. Returns
+ * 0 if the ring is empty. */
+static int
+ring_take(struct ring *r, int *connfd)
+{
+	struct ring_cell *c;
+	uint64_t pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	int64_t diff;
+
+	while (1) {
+		c = &r->cells[pos % r->size];
+		diff = (int64_t)(__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) -
+				 (2 * pos + 1));
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1,
+							1, __ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return 0; /* the producer at pos is not done */
+		} else {
+			pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+		}
+	}
+	*connfd = c->connfd;
+	/* free for the producer a lap later */
+	__atomic_store_n(&c->seq, 2 * (pos + r->size), __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* wakes up a caller asleep on w, if any, after the ring was changed */
+static void
+ring_wake(struct ring_wait *w)
+{
+	/* orders the change before reading sleepers. A sleeper orders counting
+	 * itself before looking at the ring again, so either it sees the
+	 * change, or we count it. Bumping seq makes a sleeper that has not yet
+	 * got to futex_wait return from it at once. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&w->sleepers, __ATOMIC_SEQ_CST) == 0)
+		return;
+	stress_yield();
+	__atomic_add_fetch(&w->seq, 1, __ATOMIC_SEQ_CST);
+	futex_wake(&w->seq, 1);
+}
+
+/* takes one of the kicks of w. Returns 0 if there are none. */
+static int
+ring_kicked(struct ring_wait *w)
+{
+	int kicks = __atomic_load_n(&w->kicks, __ATOMIC_SEQ_CST);
+
+	while (kicks > 0) {
+		if (__atomic_compare_exchange_n(&w->kicks, &kicks, kicks - 1, 0,
+						__ATOMIC_SEQ_CST,
+						__ATOMIC_SEQ_CST))
+			return 1;
+	}
+	return 0;
+}
+
+/* runs try, on r and connfd, until it succeeds, spinning, and then sleeping
+ * on w. Returns 0 if r is stopped first, and -1 if it would sleep, but w
+ * was kicked. */
+static int
+ring_wait(struct ring *r, struct ring_wait *w,
+	  int (*try)(struct ring *r, int *connfd), int *connfd)
+{
+	uint32_t seq;
+	int i, ok;
+
+	for (i = 0; i < r->spin; i++) {
+		if (__atomic_load_n(&r->stopped, __ATOMIC_ACQUIRE))
+			return 0;
+		if (try(r, connfd))
+			return 1;
+		cpu_relax();
+	}
+	while (1) {
+		/* a change after this is seen by futex_wait */
+		seq = __atomic_load_n(&w->seq, __ATOMIC_SEQ_CST);
+		stress_yield();
+		__atomic_add_fetch(&w->sleepers, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		ok = !__atomic_load_n(&r->stopped, __ATOMIC_SEQ_CST) &&
+			try(r, connfd);
+		stress_yield();
+		if (!ok && ring_kicked(w)) {
+			__atomic_sub_fetch(&w->sleepers, 1, __ATOMIC_SEQ_CST);
+			return -1;
+		}
+		if (!ok && !__atomic_load_n(&r->stopped, __ATOMIC_SEQ_CST))
+			futex_wait(&w->seq, seq);
+		__atomic_sub_fetch(&w->sleepers, 1, __ATOMIC_SEQ_CST);
+		if (ok)
+			return 1;
+		if (__atomic_load_n(&r->stopped, __ATOMIC_ACQUIRE))
+			return 0;
+	}
+}
+
+/* ring_put, in the form ring_wait takes */
+static int
+ring_put_ptr(struct ring *r, int *connfd)
+{
+	return ring_put(r, *connfd);
+}
+
+int
+ring_push(struct ring *r, int connfd)
+{
+	if (__atomic_load_n(&r->stopped, __ATOMIC_ACQUIRE))
+		return 0;
+	if (!ring_put(r, connfd) &&
+	    !ring_wait(r, &r->nonfull, ring_put_ptr, &connfd))
+		return 0;
+	ring_wake(&r->nonempty);
+	return 1;
+}
+
+int
+ring_pop(struct ring *r, int *connfd)
+{
+	int ok;
+
+	if (__atomic_load_n(&r->stopped, __ATOMIC_ACQUIRE))
+		return 0;
+	if (!ring_take(r, connfd) &&
+	    (ok = ring_wait(r, &r->nonempty, ring_take, connfd)) <= 0)
+		return ok;
+	ring_wake(&r->nonfull);
+	return 1;
+}
+
+void
+ring_kick(struct ring *r)
+{
+	__atomic_add_fetch(&r->nonempty.kicks, 1, __ATOMIC_SEQ_CST);
+	ring_wake(&r->nonempty);
+}
+
+int
+ring_try_push(struct ring *r, int connfd)
+{
+	if (__atomic_load_n(&r->stopped, __ATOMIC_ACQUIRE) ||
+	    !ring_put(r, connfd))
+		return 0;
+	ring_wake(&r->nonempty);
+	return 1;
+}
+
+int
+ring_try_pop(struct ring *r, int *connfd)
+{
+	if (__atomic_load_n(&r->stopped, __ATOMIC_ACQUIRE) ||
+	    !ring_take(r, connfd))
+		return 0;
+	ring_wake(&r->nonfull);
+	return 1;
+}
+
+int
+ring_len(struct ring *r)
+{
+	uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+	return tail > head ? tail - head : 0;
+}
+
+void
+ring_stop(struct ring *r)
+{
+	__atomic_store_n(&r->stopped, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&r->nonempty.seq, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&r->nonfull.seq, 1, __ATOMIC_SEQ_CST);
+	futex_wake(&r->nonempty.seq, INT_MAX);
+	futex_wake(&r->nonfull.seq, INT_MAX);
+}
+
+void
+ring_destroy(struct ring *r)
+{
+	free(r->cells);
+	free(r);
+}
@@ -0,0 +1,48 @@
+#ifndef __RING_H__
+#define __RING_H__
+
+/* A bounded queue of client connections for any number of producers and
+ * consumers, in place of request_queue and its lock and condition
+ * variables. It is a ring of cells, each with a sequence number that says
+ * whether it holds a connection for the consumer at the same position or
+ * is free for the producer a lap later (D. Vyukov's bounded MPMC queue).
+ * A producer or consumer takes its position with a compare-and-swap on the
+ * tail or head, which are kept on cache lines of their own, as are the
+ * cells, and never allocates.
+ *
+ * A consumer that finds the ring empty tries again RING_SPIN times, if
+ * there is more than one CPU, then sleeps on a futex, a sequence number
+ * that every push bumps while anyone sleeps. The push then wakes up one
+ * sleeper, and makes no system call when there are none. A sleeper waits
+ * on the value it read before looking at the ring, so a push in between
+ * keeps it awake. The same goes for a producer that finds the ring full. */
+
+#define RING_SPIN 100
+
+struct ring;
+
+/* a ring of size cells */
+struct ring *ring_init(int size);
+/* queues connfd, waiting while the ring is full. Returns 0, without
+ * queueing it, once the ring is stopped. */
+int ring_push(struct ring *r, int connfd);
+/* takes the oldest connection into *connfd, waiting while the ring is
+ * empty. Returns 0 once the ring is stopped, and -1 if it is kicked while
+ * empty. */
+int ring_pop(struct ring *r, int *connfd);
+/* makes a caller of ring_pop that finds the ring empty return -1, one that
+ * is asleep now if there is one, or else the next one, e.g., to tell an
+ * idle worker to leave the pool without putting anything into the ring */
+void ring_kick(struct ring *r);
+/* ring_push and ring_pop, returning 0 instead of waiting while the ring is
+ * full or empty */
+int ring_try_push(struct ring *r, int connfd);
+int ring_try_pop(struct ring *r, int *connfd);
+/* returns the number of connections queued */
+int ring_len(struct ring *r);
+/* wakes up, and fails, all callers of ring_push and ring_pop */
+void ring_stop(struct ring *r);
+/* connections still queued are left open */
+void ring_destroy(struct ring *r);
+
+#endif /* __RING_H__ */
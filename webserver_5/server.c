@@ -1,24 +1,146 @@
 #include <malloc.h>
 #include <stdio.h>
+#include <popt.h>
 #include "common.h"
 #include "request.h"
 #include "server_thread.h"
+#include "storage.h"
+#include "log.h"
+#include "restart.h"
+#include "acceptor.h"
 
 /* 
  * server.c: A very, very simple web server
  *
  * To run:
- *  server portnum nr_threads max_requests max_cache_size
+ *  server [options] portnum nr_threads max_requests max_cache_size
+ *
+ * Options:
+ *  -e nr_loops	serve connections from nr_loops epoll event loops. The loops
+ *		read requests and send responses without blocking, and the
+ *		nr_threads workers only read and process files.
+ *  -t header_ms,write_ms	close connections whose request headers have not
+ *		all arrived header_ms after they were accepted, or whose
+ *		response has not made progress for write_ms. Connections
+ *		wait for their headers, and for room to send, in the event
+ *		loops rather than holding up a worker, so -t starts one loop
+ *		if -e is not given, but for a proxy, see -P. The number of
+ *		connections closed is printed when the server exits.
+ *  -f limits	queue connections for the workers per client, by address,
+ *		and serve the clients in deficit round-robin by bytes sent,
+ *		instead of in one FIFO. limits is a list such as
+ *		quantum=65536,conc=2,rate=1024, with the bytes a client may
+ *		be sent per turn, the requests of a client served at once
+ *		and the KB/s it may be sent; see fairq.h. When the queue is
+ *		full, the client with the most queued loses its oldest
+ *		connection. Statistics are printed when the server exits.
+ *		Needs workers, and cannot be combined with -S.
+ *  -W		give each worker a deque of its own, into which connections
+ *		are put round-robin, instead of one queue for all of them.
+ *		Workers take from their own deque, and steal from the
+ *		others' when it is empty; see wsq.h. The connections stolen
+ *		are printed when the server exits. Ignored with -f.
+ *  -T min,max	grow and shrink the workers, starting from nr_threads,
+ *		between min and max threads, by how many connections are
+ *		queued, how busy the workers are, and how much of that
+ *		time they are blocked, e.g., reading files, rather than
+ *		running; see pool.h. The size of the pool is printed when
+ *		the server exits, and each change is logged at level info.
+ *		Needs workers, and cannot be combined with -f, -W or -S.
+ *  -P backends	run as a reverse proxy in front of other servers, given as
+ *		a list of ports, or host:port, such as 8001,8002. The
+ *		nr_threads workers forward each request to a backend, and
+ *		relay its response, over connections to the backend that
+ *		are kept open between requests when it runs with -e.
+ *		Backends are checked every 500ms, and skipped while down.
+ *		With -t, the workers answer 408 to clients whose request
+ *		has not arrived header_ms after a worker took them, and
+ *		drop those whose response stalls for write_ms. Statistics
+ *		for each backend are printed when the server exits. Cannot
+ *		be combined with -e or -S.
+ *  -b policy	pick the backend of a request by hash (the default), a
+ *		consistent hash of the URI so that each backend caches its
+ *		own part of the files, or by least, the backend with the
+ *		fewest requests outstanding.
+ *  -C peers	share the cache with other servers on this host, given as
+ *		a list of the ports of all of them, this one included, such
+ *		as 8001,8002,8003. Each file is cached by only one of the
+ *		servers, picked by a consistent hash of its name, and the
+ *		others fetch it from that server on a cache miss rather than
+ *		reading it from storage. Fetch statistics are printed when
+ *		the server exits. Needs a cache.
+ *  -F nr_prefetch	start nr_prefetch threads that learn which files clients
+ *		ask for after which, and read the files a client is likely
+ *		to ask for next into the cache while storage is idle; see
+ *		prefetch.h. The accuracy of the prefetches, and the bytes
+ *		they wasted, are printed when the server exits. Needs a
+ *		cache, and no -P.
+ *  -s stream_size	send files larger than stream_size bytes in fixed-size
+ *		chunks, reading the next chunk while the current one is sent,
+ *		instead of reading the whole file into memory first. Such
+ *		files are not cached.
+ *  -S parse,disk,send	run a staged server instead of nr_threads workers,
+ *		with a pool of threads of the given size for each stage:
+ *		parse reads requests and looks files up in the cache, disk
+ *		reads files that are not cached, and send processes and sends
+ *		files. Each stage has a queue of up to max_requests requests.
+ *		Stage statistics are printed when the server exits.
+ *  -u		with -S, read files with io_uring instead of the disk
+ *		threads: one thread opens, stats and reads the files of all
+ *		requests missing from the cache, with many reads in flight.
+ *		Files larger than stream_size are still read by the disk
+ *		threads. Falls back to the disk threads if io_uring is not
+ *		available.
+ *  -p nr_helpers	start nr_helpers threads that help checksum and process
+ *		files larger than 256KB, splitting them into chunks that are
+ *		worked on in parallel.
+ *  -D		read files with O_DIRECT into aligned buffers, so that they
+ *		are not copied through, and kept in, the kernel's page cache
+ *		as well as our own cache.
+ *  -a archive	serve the files packed into archive by pack from a mapping
+ *		of it, without reading them or looking them up in the cache.
+ *		Other files are served as usual.
+ *  -m model	model the latency of reading files from storage. model is
+ *		hdd, ssd, nvme, none or fixed (the default, 10ms per read), or
+ *		a list such as lat=100,bw=500,slots=32 or replay=FILE,slots=4;
+ *		see storage.h. Storage statistics are printed when the server
+ *		exits.
+ *  -A acceptors	accept connections in acceptor threads instead of the
+ *		main thread, each on its own SO_REUSEPORT listen socket.
+ *		acceptors is their number, optionally followed by options
+ *		such as 4,backlog=4096,defer=1,cloexec: the backlog of each
+ *		socket, TCP_DEFER_ACCEPT in seconds, and the accept4 flags
+ *		nonblock (needs -e) and cloexec; see acceptor.h. With
+ *		blocking workers, the workers are split into a group for
+ *		each acceptor, with its own queue of max_requests /
+ *		acceptors, unless -W or -f share them out. The
+ *		connections each acceptor took are printed when the server
+ *		exits. Cannot be combined with -R.
+ *  -R		take over from the server running in this directory, if
+ *		there is one, without closing the port or losing the cache:
+ *		the listen socket and a snapshot of the cache are handed
+ *		over, and the old server stops accepting, serves the
+ *		connections it has accepted and exits once this one is
+ *		ready. See restart.h.
+ *  -L level	log messages up to level: error (the default, one line per
+ *		error response), warn, info (adds an access log line, "time I
+ *		status bytes path", per response) or debug. Logging is
+ *		asynchronous, messages are dropped (and counted) rather than
+ *		holding up requests when the writer falls behind.
+ *  -l file	append the log to file instead of writing it to stdout.
  *
  * Repeatedly handles HTTP requests sent to this port number. Most of the work
  * is done within routines written in server_thread.c and request.c
  */
 
+poptContext context;	/* context for parsing command-line options */
+
 static void
 usage(char *program)
 {
-	fprintf(stderr, "Usage: %s port nr_threads max_requests "
+	fprintf(stderr, "Usage: %s [options] port nr_threads max_requests "
 		"max_cache_size\n", program);
+	poptPrintUsage(context, stderr, 0);
 	exit(1);
 }
 
@@ -59,40 +181,246 @@ main(int argc, char *argv[])
 	int port, nr_threads, max_requests, max_cache_size;
 	int listenfd, connfd, clientlen;
 	int exitfd;
+	int c, i;
+	const char *args[4];
 	struct sockaddr_in clientaddr;
 	struct server *sv;
-	if (argc != 5)
+	struct server_options opts;
+	char *stages = NULL;
+	char *deadlines = NULL;
+	char *fair = NULL;
+	char *pool = NULL;
+	char *proxy = NULL, *policy = NULL;
+	char *peers = NULL;
+	char *acceptor = NULL;
+	struct acceptor_options ao;
+	struct acceptors *acc = NULL;
+	int takeover = 0, restartfd, donefd = -1, handed_off = 0;
+	struct restart_handoff *handoff = NULL;
+	char *storage = NULL;
+	char *level = NULL, *log_file = NULL;
+	int log_lvl = LOG_ERROR;
+
+	memset(&opts, 0, sizeof(opts));
+	struct poptOption options_table[] = {
+		{NULL, 'e', POPT_ARG_INT, &opts.nr_loops, 'e',
+		 "number of epoll event loops",
+		 " default: 0 (workers block on clients)"},
+		{NULL, 't', POPT_ARG_STRING, &deadlines, 't',
+		 "header and write deadlines in ms", "header_ms,write_ms"},
+		{NULL, 'f', POPT_ARG_STRING, &fair, 'f',
+		 "fair queuing across clients, with per-client limits",
+		 "quantum=BYTES,conc=N,rate=KBPS"},
+		{NULL, 'W', POPT_ARG_NONE, &opts.steal, 'W',
+		 "per-worker deques, with work stealing", NULL},
+		{NULL, 'T', POPT_ARG_STRING, &pool, 'T',
+		 "adapt the number of workers within these limits",
+		 "min,max"},
+		{NULL, 'P', POPT_ARG_STRING, &proxy, 'P',
+		 "proxy requests to these backend servers", "PORT|HOST:PORT,..."},
+		{NULL, 'b', POPT_ARG_STRING, &policy, 'b',
+		 "policy for picking a backend (with -P)", "hash|least"},
+		{NULL, 'C', POPT_ARG_STRING, &peers, 'C',
+		 "share the cache with the servers on these ports",
+		 "PORT|HOST:PORT,..."},
+		{NULL, 'F', POPT_ARG_INT, &opts.prefetch_threads, 'F',
+		 "number of threads prefetching files",
+		 " default: 0 (no prefetching)"},
+		{NULL, 's', POPT_ARG_INT, &opts.stream_size, 's',
+		 "stream files larger than this many bytes",
+		 " default: 0 (never stream)"},
+		{NULL, 'S', POPT_ARG_STRING, &stages, 'S',
+		 "thread pool sizes of the parse, disk and send stages",
+		 "parse,disk,send"},
+		{NULL, 'u', POPT_ARG_NONE, &opts.uring, 'u',
+		 "read files with io_uring (with -S)", NULL},
+		{NULL, 'p', POPT_ARG_INT, &opts.nr_helpers, 'p',
+		 "number of threads helping to process large files",
+		 " default: 0 (files are processed by one thread)"},
+		{NULL, 'D', POPT_ARG_NONE, &opts.direct_io, 'D',
+		 "read files with O_DIRECT", NULL},
+		{NULL, 'a', POPT_ARG_STRING, &opts.archive, 'a',
+		 "archive built by pack to serve files from", NULL},
+		{NULL, 'm', POPT_ARG_STRING, &storage, 'm',
+		 "storage latency model",
+		 "hdd|ssd|nvme|none|fixed|lat=USEC,bw=MBPS,slots=N,replay=FILE"},
+		{NULL, 'A', POPT_ARG_STRING, &acceptor, 'A',
+		 "accept in threads on SO_REUSEPORT sockets",
+		 "N,backlog=N,defer=SECS,nonblock,cloexec"},
+		{NULL, 'R', POPT_ARG_NONE, &takeover, 'R',
+		 "take over from the server running here", NULL},
+		{NULL, 'L', POPT_ARG_STRING, &level, 'L',
+		 "log level", "error|warn|info|debug"},
+		{NULL, 'l', POPT_ARG_STRING, &log_file, 'l',
+		 "log file", " default: stdout"},
+		POPT_AUTOHELP {NULL, 0, 0, NULL, 0}
+	};
+
+	context = poptGetContext(NULL, argc, (const char **)argv,
+				 options_table, 0);
+	while ((c = poptGetNextOpt(context)) >= 0);
+	if (c < -1) {	/* an error occurred during option processing */
+		fprintf(stderr, "%s: %s\n",
+			poptBadOption(context, POPT_BADOPTION_NOALIAS),
+			poptStrerror(c));
+		usage(argv[0]);
+	}
+	for (i = 0; i < 4; i++) {
+		if ((args[i] = poptGetArg(context)) == NULL)
+			usage(argv[0]);
+	}
+	if (poptGetArg(context) != NULL)
+		usage(argv[0]);
+	if (stages && (sscanf(stages, "%d,%d,%d", &opts.parse_threads,
+			      &opts.disk_threads, &opts.send_threads) != 3 ||
+		       opts.parse_threads <= 0 || opts.disk_threads <= 0 ||
+		       opts.send_threads <= 0)) {
+		fprintf(stderr, "stages should be three pool sizes > 0\n");
+		usage(argv[0]);
+	}
+	if (deadlines && (sscanf(deadlines, "%d,%d", &opts.header_ms,
+				 &opts.write_ms) != 2 ||
+			  opts.header_ms < 0 || opts.write_ms < 0)) {
+		fprintf(stderr, "deadlines should be two times >= 0 in ms\n");
 		usage(argv[0]);
-	port = atoi(argv[1]);
-	nr_threads = atoi(argv[2]);
-	max_requests = atoi(argv[3]);
-	max_cache_size = atoi(argv[4]);
+	}
+	if (fair) {
+		if (!fairq_parse(fair, &opts.fair_limits))
+			usage(argv[0]);
+		opts.fair = 1;
+	}
+	if (proxy && (opts.nr_loops || stages)) {
+		fprintf(stderr, "-P runs the workers, not -e or -S\n");
+		usage(argv[0]);
+	}
+	if (policy && !proxy) {
+		fprintf(stderr, "-b needs a proxy, see -P\n");
+		usage(argv[0]);
+	}
+	opts.proxy = proxy;
+	opts.proxy_policy = policy;
+	/* slow clients wait in a loop, not in a worker, but for a proxy's,
+	 * which its workers time out themselves */
+	if (deadlines && opts.nr_loops == 0 && !proxy)
+		opts.nr_loops = 1;
+	if (opts.uring && !stages) {
+		fprintf(stderr, "-u needs the staged server, see -S\n");
+		usage(argv[0]);
+	}
+	port = atoi(args[0]);
+	nr_threads = atoi(args[1]);
+	max_requests = atoi(args[2]);
+	max_cache_size = atoi(args[3]);
 	if (port < 1024) {
 		fprintf(stderr, "port = %d, should be >= 1024\n", port);
 		usage(argv[0]);
 	}
-	if (nr_threads < 0 || max_requests < 0 || max_cache_size < 0) {
+	if (nr_threads < 0 || max_requests < 0 || max_cache_size < 0 ||
+	    opts.nr_loops < 0 || opts.stream_size < 0 ||
+	    opts.nr_helpers < 0 || opts.prefetch_threads < 0) {
 		fprintf(stderr, "arguments should be > 0\n");
 		usage(argv[0]);
 	}
+	if (fair && (nr_threads == 0 || stages)) {
+		fprintf(stderr, "-f needs workers, and no -S\n");
+		usage(argv[0]);
+	}
+	if (peers && (max_cache_size == 0 || proxy)) {
+		fprintf(stderr, "-C needs a cache, and no -P\n");
+		usage(argv[0]);
+	}
+	opts.peers = peers;
+	if (pool) {
+		if (!pool_parse(pool, &opts.pool_limits))
+			usage(argv[0]);
+		if (nr_threads == 0 || fair || opts.steal || stages) {
+			fprintf(stderr, "-T needs workers, and no -f, -W "
+				"or -S\n");
+			usage(argv[0]);
+		}
+		opts.pool = 1;
+	}
+	if (opts.prefetch_threads && (max_cache_size == 0 || proxy)) {
+		fprintf(stderr, "-F needs a cache, and no -P\n");
+		usage(argv[0]);
+	}
+	opts.port = port;
+	if (acceptor) {
+		if (!acceptor_parse(acceptor, &ao))
+			usage(argv[0]);
+		if (takeover) {
+			fprintf(stderr, "-R hands over one listen socket, "
+				"not those of -A\n");
+			usage(argv[0]);
+		}
+		/* blocking workers would get EAGAIN reading the request */
+		if ((ao.flags & SOCK_NONBLOCK) && opts.nr_loops == 0) {
+			fprintf(stderr, "-A nonblock needs event loops, "
+				"see -e\n");
+			usage(argv[0]);
+		}
+		opts.nr_acceptors = ao.nr;
+	}
+
+	if (level && (log_lvl = log_level(level)) < 0) {
+		fprintf(stderr, "bad log level: %s\n", level);
+		usage(argv[0]);
+	}
+	if (!storage_init(storage) || !log_init(log_lvl, log_file))
+		usage(argv[0]);
 
-	sv = server_init(nr_threads, max_requests, max_cache_size);
+	sv = server_init(nr_threads, max_requests, max_cache_size, &opts);
 
-	listenfd = open_listenfd(port);
+	if (acceptor) {
+		/* the main thread only waits for the exit request */
+		acc = acceptors_init(&ao, port, sv);
+		listenfd = restartfd = -1;
+	} else if (!takeover ||
+		   (listenfd = restart_takeover(sv, &donefd)) < 0) {
+		listenfd = open_listenfd(port);
+	}
+	/* the old server stops accepting once it confirms, and until then
+	 * the fifo and restart socket are its own */
+	if (donefd >= 0 && !restart_ready(donefd)) {
+		fprintf(stderr, "the old server gave up on the restart\n");
+		exit(1);
+	}
 	exitfd = open_fifo();
+	if (!acceptor)
+		restartfd = restart_listen();
 
 	struct pollfd fds[] = {
 		{exitfd, POLLIN},
 		{listenfd, POLLIN},
+		{restartfd, POLLIN},
+		{-1, POLLIN}, /* a handoff to a new server, once done */
 	};
 	while (1) {
 		/* wait for either a client to connect or an exit event */
-		SYS(poll(fds, 2, -1));
+		SYS(poll(fds, 4, -1));
 		
 
 		if(fds[0].revents & POLLIN) { /* exit requested */
 			break;
 		}
+		if (fds[2].revents & POLLIN) { /* a new server is taking over */
+			/* one at a time, while we go on accepting */
+			if ((handoff = restart_handoff(restartfd, listenfd,
+						       sv))) {
+				fds[2].fd = -1;
+				fds[3].fd = restart_handoff_fd(handoff);
+			}
+			continue;
+		}
+		if (fds[3].revents & POLLIN) {
+			handed_off = restart_handoff_done(handoff);
+			handoff = NULL;
+			if (handed_off)
+				break;
+			fds[2].fd = restartfd;
+			fds[3].fd = -1;
+			continue;
+		}
 
 		assert(fds[1].revents & POLLIN); /* connect request arrived */
 		clientlen = sizeof(clientaddr);
@@ -102,11 +430,32 @@ main(int argc, char *argv[])
 				    (socklen_t *) & clientlen));
 
 		/* serve the request */
-		server_request(sv, connfd);
+		server_request(sv, 0, connfd, (struct sockaddr *)&clientaddr);
 	}
 
-	close_fifo();
+	/* a handoff under way may still commit us to stopping */
+	if (handoff)
+		handed_off = restart_handoff_done(handoff);
+	/* once handed off, the fifo and restart socket are the new
+	 * server's */
+	if (acc) {
+		acceptors_print_stats(acc, stderr);
+		acceptors_exit(acc);
+	} else {
+		restart_close(restartfd, !handed_off);
+	}
+	if (handed_off) {
+		SYS(close(listenfd));
+		server_drain(sv, RESTART_DRAIN_MS);
+	} else {
+		close_fifo();
+	}
 	server_exit(sv);
+	if (storage)
+		storage_print_stats(stderr);
+	storage_exit();
+	log_exit();
+	poptFreeContext(context);
 
 	/* we don't check for memory leaks using mallinfo() because pthreads
 	 * caches thread state even after a thread exits so that it can reuse
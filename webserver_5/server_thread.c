@@ -1,7 +1,22 @@
+#include <limits.h>
 #include "request.h"
 #include "server_thread.h"
 #include "common.h"
 #include "hash_table.h"
+#include "event.h"
+#include "bufpool.h"
+#include "stage.h"
+#include "forkjoin.h"
+#include "uring.h"
+#include "archive.h"
+#include "fairq.h"
+#include "proxy.h"
+#include "peer.h"
+#include "restart.h"
+#include "prefetch.h"
+#include "ring.h"
+#include "wsq.h"
+#include "pool.h"
 
 
 
@@ -20,6 +35,42 @@ struct server {
 	int max_cache_size;
 	int exiting;
 	/* add any other parameters you need */
+	struct event *ev; /* event loops, NULL when workers block on clients */
+	long nr_shed;	/* requests the loops answered busy, the queue full */
+	/* workers are split into groups, each taking connections from its
+	 * own queue, one group for each acceptor thread */
+	int nr_groups;
+	struct arena *arenas; /* for requests served without worker threads,
+			       * one per group */
+	/* stages of the staged server, NULL when there are worker threads */
+	struct stage *parse;	/* reads the request, looks up the cache */
+	struct stage *disk;	/* reads files missing from the cache */
+	struct stage *send;	/* processes and sends the file */
+	struct uring *uring;	/* reads files in place of disk, or NULL */
+	long uring_max_size;	/* larger files are left to disk */
+	struct archive *archive; /* served ahead of the cache, or NULL */
+	struct fairq *fq;	/* replaces request_queue, or NULL */
+	struct wsq *wsq;	/* replaces request_queues, or NULL */
+	struct pool *pool;	/* sizes the workers to the load, or NULL */
+	struct proxy *proxy;	/* forwards requests to backends, or NULL */
+	struct peers *peers;	/* share the cache with these, or NULL */
+	struct prefetch *prefetch; /* reads files ahead of requests, or NULL */
+	pthread_mutex_t job_lock;
+	struct job *free_jobs;	/* jobs kept for reuse */
+};
+
+/* a request on its way through the stages */
+struct job {
+	int fd;			/* client connection, without event loops */
+	struct conn *c;		/* client connection, with event loops */
+	struct request *rq;
+	struct file_data *data;
+	struct arena arena;	/* for rq without event loops, kept for reuse */
+	struct uring_file uf;	/* the read of the file, with sv->uring */
+	int reading;		/* uf holds a read that send must finish */
+	int chunk;		/* only reads the next chunk of a streamed file */
+	struct server *sv;
+	struct job *next;	/* on the list of free jobs */
 };
 
 // Needed data structures: 
@@ -27,133 +78,624 @@ struct server {
 // 2. a linked list, maintained in descending order of file size, of file name 
 // pointer to queue (allocated when user types in queue size)
 HASH_TABLE* cache;
-REQ_QUEUE* request_queue;
+struct ring** request_queues; // lock-free, see ring.h, one per group
 pthread_t* pthreads; // dynamically allocated depending on how many threads the user wants
-pthread_mutex_t queue_mutex;
-pthread_cond_t queue_became_nonfull, queue_became_nonempty; 
+
+/* what a worker thread is started with */
+struct worker {
+	struct server *sv;
+	int id;			/* its deque in sv->wsq */
+	int group;		/* takes connections from request_queues[group] */
+};
+struct worker* workers;
 
 
 
 /* static functions */
 
-/* initialize file data */
-static struct file_data *
-file_data_init(void)
+/* looks up the file requested by rq in the archive, and then in the cache.
+ * *data is the file data attached to rq. On a hit, the archived or cached
+ * data takes its place. Returns 1 on a hit. */
+static int
+cache_lookup(struct server *sv, struct request *rq, struct file_data **data)
 {
-	struct file_data *data;
+	struct file_data* temp_data = NULL;
+	if (sv->archive)
+		temp_data = archive_lookup(sv->archive, (*data)->file_name);
+	if (!temp_data && sv->max_cache_size != 0) 
+		temp_data = find_in_hash_table(cache, (*data)->file_name);
+	/* rather than read the file again while it is being prefetched */
+	if (!temp_data && sv->prefetch &&
+	    prefetch_join(sv->prefetch, (*data)->file_name))
+		temp_data = find_in_hash_table(cache, (*data)->file_name);
 
-	data = Malloc(sizeof(struct file_data));
-	data->file_name = NULL;
-	data->file_buf = NULL;
-	data->file_size = 0;
-	return data;
+	if (temp_data)
+	{
+		// found in hash table
+		if (temp_data->prefetched && sv->prefetch &&
+		    __sync_bool_compare_and_swap(&temp_data->prefetched, 1, 0))
+			prefetch_used(sv->prefetch, file_data_charge(temp_data));
+		file_data_free(*data);
+		*data = temp_data;
+		request_set_data(rq, temp_data);
+		return 1;
+	}
+	return 0;
 }
 
-/* free all file data */
+/* caches the file that was just read for rq */
 static void
-file_data_free(struct file_data *data)
+cache_add(struct server *sv, struct request *rq, struct file_data *data)
+{
+	// only cache if the file size is smaller than cache size, and
+	// the file was read into memory rather than streamed. the
+	// gzip variant is built once here and cached with the file
+	if (sv->max_cache_size != 0 && !rq->stream &&
+	    data->file_size <= sv->max_cache_size) {
+		request_compress(rq, sv->max_cache_size);
+		add_to_hash_table(cache, data->file_name, data);
+	}
+}
+
+/* returns 1 if the file requested by rq is cached by another peer, so it
+ * should be fetched from there. Requests of peers are always served here. */
+static int
+cache_remote(struct server *sv, struct request *rq)
+{
+	return sv->peers && !http_header(rq->hp, PEER_HEADER) &&
+		!peers_owns(sv->peers, rq->data->file_name);
+}
+
+/* reads the file requested by rq from the peer that caches it, or else from
+ * disk, and caches it. Returns 0, after producing an error response, if the
+ * file can't be read. */
+static int
+cache_fill(struct server *sv, struct request *rq, struct file_data *data)
 {
-	free(data->file_name);
-	free(data->file_buf);
-	free(data);
+	int remote = cache_remote(sv, rq);
+
+	if (remote) {
+		if (!request_check_name(rq))
+			return 0;
+		/* only the owner caches it */
+		if (peers_fetch(sv->peers, data, sv->max_cache_size))
+			return 1;
+		/* if the owner is down, the file may be this server's now */
+		remote = cache_remote(sv, rq);
+	}
+	/* read file, 
+	* fills data->file_buf with the file contents,
+	* data->file_size with file size. */
+	if (request_readfile(rq) == 0) { /* couldn't read file */
+		return 0;
+	}
+	if (!remote)
+		cache_add(sv, rq, data);
+	return 1;
 }
 
+/* reads the file called name into the cache for the prefetcher. Returns its
+ * size, or 0 if it was not read. */
+static long
+cache_prefetch(void *arg, const char *name)
+{
+	struct server *sv = (struct server *)arg;
+	struct file_data *data;
+	long size = 0;
+
+	/* archived files, and those of other peers, are not cached here */
+	if (sv->archive && (data = archive_lookup(sv->archive, name))) {
+		file_data_free(data);
+		return 0;
+	}
+	if (sv->peers && !peers_owns(sv->peers, name))
+		return 0;
+	if ((data = find_in_hash_table(cache, (char *)name))) {
+		file_data_free(data);
+		return 0;
+	}
+	data = file_data_init();
+	data->file_name = bufpool_alloc(strlen(name) + 1);
+	strcpy(data->file_name, name);
+	if (file_data_read(data, sv->max_cache_size)) {
+		data->prefetched = 1;
+		if (add_to_hash_table(cache, data->file_name, data))
+			size = file_data_charge(data);
+	}
+	file_data_free(data);
+	return size;
+}
+
+/* tells the prefetcher that rq asks for its file, as soon as it does, so
+ * that the next files may be read while it is served */
 static void
-do_server_request(struct server *sv, int connfd)
+cache_hint(struct server *sv, struct request *rq)
 {
-	int ret;
+	if (sv->prefetch)
+		prefetch_request(sv->prefetch, rq->fd, rq->data->file_name);
+}
+
+/* looks up the file requested by rq in the cache, reading it from disk on a
+ * miss, and produces the response. data is the file data attached to rq.
+ * Returns the file data attached to rq afterwards, which the caller must free
+ * once the response has been sent. */
+static struct file_data *
+do_serve_file(struct server *sv, struct request *rq, struct file_data *data)
+{
+	cache_hint(sv, rq);
+	if (!cache_lookup(sv, rq, &data) && !cache_fill(sv, rq, data))
+		return data;
+
+	/* send file to client */
+	request_sendfile(rq);
+	return data;
+}
+
+/* a client of the fair queue, whose responses are paced to its rate */
+struct fair_client {
+	struct fairq *fq;
+	struct fairq_flow *flow;
+};
+
+static double
+fair_pace(void *arg, long bytes)
+{
+	struct fair_client *fc = (struct fair_client *)arg;
+
+	return fairq_sent(fc->fq, fc->flow, bytes);
+}
+
+/* serves the client on connfd, which is flow of the fair queue, or NULL.
+ * Returns the length of the response body. */
+static long
+do_server_request(struct server *sv, int connfd, struct arena *arena,
+		  struct fairq_flow *flow)
+{
+	struct fair_client fc = { sv->fq, flow };
 	struct request *rq;
 	struct file_data *data;
+	long length;
+
+	if (sv->proxy)
+		return proxy_serve(sv->proxy, connfd);
 
 	data = file_data_init();
 
 	/* fill data->file_name with name of the file being requested */
-	rq = request_init(connfd, data);
+	rq = request_init(connfd, data, arena);
 	if (!rq) {
 		file_data_free(data);
-		return;
+		return 0;
 	}
+	if (flow)
+		request_set_pace(rq, fair_pace, &fc);
 
-	struct file_data* temp_data = NULL;
-	if (sv->max_cache_size != 0) 
-		temp_data = find_in_hash_table(cache, data->file_name);
+	data = do_serve_file(sv, rq, data);
+	length = rq->length;
+	request_destroy(rq);
 
-	if (temp_data)
-	{
-		// found in hash table
-		file_data_free(data);
-		data = temp_data;
-		rq->data = temp_data;
-	}
-	else
-	{
-		/* read file, 
-		* fills data->file_buf with the file contents,
-		* data->file_size with file size. */
-		ret = request_readfile(rq);
+	file_data_free(data);
+	return length;
+}
 
-		if (ret == 0) { /* couldn't read file */
-			goto out;
-		}
-	}
+/* serves a connection whose headers an event loop has already read. The
+ * response is staged in the request and handed back to the loop, which
+ * frees the request and data once the client has it. Returns the length of
+ * the response body. A connection whose response is already staged is back
+ * for the next chunk of a streamed file, which event_reply reads. */
+static long
+do_event_request(struct server *sv, struct conn *c)
+{
+	struct request *rq;
+	struct file_data *data;
+	long length;
 
-	// only cache if the file size is smaller than cache size
-	if (rq->data->file_size <= sv->max_cache_size) {
-		add_to_hash_table(cache, rq->data->file_name, rq->data);
+	if (c->rq) {
+		event_reply(sv->ev, c);
+		return 0;
 	}
+	data = file_data_init();
+	rq = request_init_nb(c->fd, data, &c->hp, c->parsed, &c->arena);
+	if (!rq->responded) {
+		data = do_serve_file(sv, rq, data);
+	}
+	length = rq->length;
+	c->rq = rq;
+	c->data = data;
+	event_reply(sv->ev, c);
+	return length;
+}
 
+/* responds to the request on c, read by an event loop, that the server is
+ * too busy to serve it */
+static void
+do_event_busy(struct server *sv, struct conn *c)
+{
+	struct request *rq;
+	struct file_data *data;
 
-	/* send file to client */
-	request_sendfile(rq);
-out:
-	request_destroy(rq);
-
-	file_data_free(data);
+	data = file_data_init();
+	rq = request_init_nb(c->fd, data, &c->hp, c->parsed, &c->arena);
+	if (!rq->responded)
+		request_busy(rq);
+	__atomic_add_fetch(&sv->nr_shed, 1, __ATOMIC_RELAXED);
+	c->rq = rq;
+	c->data = data;
+	event_reply(sv->ev, c);
 }
 
-
 /* Functions for hash table implementation */
 
 
 
 
 // waits on the queue to be non-empty
-static void* helper_thread_do_server_request(void* sv)
+static void* helper_thread_do_server_request(void* arg)
 {
+	struct worker* w = (struct worker*) arg;
+	struct server* sv = w->sv;
 	const struct server* server = (const struct server*) sv;
+	struct arena arena; // per-worker memory for the request being served
+
+	arena_init(&arena);
 	// probably don't need a lock on sv because helper threads read sv only
-	while (!server->exiting)
-	{
-		pthread_mutex_lock(&queue_mutex);
-		while (request_queue->curr_size == 0 && !server->exiting)
-		{
-			pthread_cond_wait(&queue_became_nonempty, &queue_mutex);
-		}
+	while (server->fq && !server->exiting) {
+		struct fairq_flow *flow;
+		int connfd;
+		long length;
 
-		if (server->exiting) {
-			pthread_mutex_unlock(&queue_mutex);
+		if (!fairq_pop(server->fq, &connfd, &flow))
 			break;
+		if (server->ev) {
+			/* the loop sends it, so it is charged all at once */
+			length = do_event_request(sv, event_conn(server->ev,
+								 connfd));
+			fairq_sent(server->fq, flow, length);
+		} else {
+			length = do_server_request(sv, connfd, &arena, flow);
 		}
+		fairq_done(server->fq, flow, length);
+	}
+	while (!server->fq && !server->exiting)
+	{
+		struct pool_clock clock;
+		int connfd, ok;
 
-		// now we have the lock, and the queue is nonempty. 
-		int connfd;
-		assert(pop_front(request_queue, &connfd));  // should succeed because the queue is nonempty
-		
-		// issue nonfull signal if applicable
-		if (request_queue->curr_size == request_queue->max_size - 1){
-			pthread_cond_broadcast(&queue_became_nonfull);
+		// waits while the queue is empty, fails once we are exiting
+		ok = server->wsq ? wsq_pop(server->wsq, w->id, &connfd) :
+			ring_pop(request_queues[w->group], &connfd);
+		if (ok == 0)
+			break;
+		if (ok < 0) { // kicked to leave the pool, see pool_wake
+			if (pool_leave(server->pool))
+				break;
+			continue;
 		}
-		pthread_mutex_unlock(&queue_mutex);
 
-		do_server_request(sv, connfd);
+		if (server->pool)
+			pool_begin(&clock);
+		if (server->ev) {
+			do_event_request(sv, event_conn(server->ev, connfd));
+		} else {
+			do_server_request(sv, connfd, &arena, NULL);
+		}
+		if (server->pool) {
+			pool_end(server->pool, &clock);
+			if (pool_leave(server->pool))
+				break;
+		}
 	}
+	arena_destroy(&arena);
 	return NULL;
 }
 
+/* returns the connections waiting for the pool's workers */
+static int
+pool_queued(void *arg)
+{
+	return ring_len(request_queues[0]);
+}
+
+/* wakes up an idle worker of the pool, so that it may leave it. The kick
+ * goes around the queue, so it is not counted as a connection queued. */
+static void
+pool_wake(void *arg)
+{
+	ring_kick(request_queues[0]);
+}
+
+/* adds connfd to the request queue of group, waiting while the queue is
+ * full. Returns 0 if the server started exiting while we waited. */
+static int
+enqueue_request(struct server *sv, int group, int connfd)
+{
+	int dropped;
+
+	if (sv->fq) {
+		/* never blocks, a full queue drops a connection instead */
+		if ((dropped = fairq_push(sv->fq, connfd)) < 0)
+			return 1;
+		if (sv->ev) {
+			event_close(sv->ev, event_conn(sv->ev, dropped));
+		} else {
+			SYS(close(dropped));
+		}
+		return 1;
+	}
+	// waits while the queue is full, fails once we are exiting
+	if (sv->wsq)
+		return wsq_push(sv->wsq, connfd);
+	return ring_push(request_queues[group], connfd);
+}
+
+/* enqueue_request, for the event loops, which must not wait. Returns 0 if
+ * the queue is full, or the server is exiting. */
+static int
+try_enqueue_request(struct server *sv, int group, int connfd)
+{
+	if (sv->fq)
+		return enqueue_request(sv, group, connfd);
+	if (sv->wsq)
+		return wsq_try_push(sv->wsq, connfd);
+	return ring_try_push(request_queues[group], connfd);
+}
+
+/* Staged server. Instead of one pool of workers that each serve a request
+ * from start to end, a request goes through three stages, each with its own
+ * pool of threads: the parse stage reads the request (unless an event loop
+ * has) and looks the file up in the cache, the disk stage reads files that
+ * are not cached, and the send stage processes and sends them. Threads
+ * waiting for the (slow) disk then no longer keep the CPU bound processing of
+ * cached files from running. */
+
+static struct job *
+job_alloc(struct server *sv)
+{
+	struct job *j;
+
+	pthread_mutex_lock(&sv->job_lock);
+	j = sv->free_jobs;
+	if (j)
+		sv->free_jobs = j->next;
+	pthread_mutex_unlock(&sv->job_lock);
+	if (!j) {
+		j = Malloc(sizeof(struct job));
+		arena_init(&j->arena);
+	}
+	j->fd = -1;
+	j->c = NULL;
+	j->rq = NULL;
+	j->data = NULL;
+	j->reading = 0;
+	j->chunk = 0;
+	j->sv = sv;
+	return j;
+}
+
+static void
+job_free(struct server *sv, struct job *j)
+{
+	pthread_mutex_lock(&sv->job_lock);
+	j->next = sv->free_jobs;
+	sv->free_jobs = j;
+	pthread_mutex_unlock(&sv->job_lock);
+}
+
+/* hands the response of j to the event loop, or frees the request once it
+ * has been sent */
+static void
+job_done(struct server *sv, struct job *j)
+{
+	if (j->c) {
+		j->c->rq = j->rq;
+		j->c->data = j->data;
+		event_reply(sv->ev, j->c);
+	} else {
+		request_destroy(j->rq);
+		file_data_free(j->data);
+	}
+	job_free(sv, j);
+}
+
+/* passes j on to stage st. Stages are stopped in order, so the next one is
+ * still running and this does not fail in practice, but if it does the
+ * client just gets no response. */
+static void
+job_next(struct server *sv, struct stage *st, struct job *j)
+{
+	if (!stage_enqueue(st, j))
+		job_done(sv, j);
+}
+
+/* called from the ring's thread once the file of j has been read. Files
+ * that were not read because they are too large go to disk, which streams
+ * them. */
+static void
+uring_done(void *arg)
+{
+	struct job *j = (struct job *)arg;
+	struct uring_file *uf = &j->uf;
+
+	if (!uf->buf && !uf->err && S_ISREG(uf->sbuf.st_mode) &&
+	    uf->sbuf.st_size > 0) {
+		job_next(j->sv, j->sv->disk, j);
+	} else {
+		j->reading = 1;
+		job_next(j->sv, j->sv->send, j);
+	}
+}
+
+static void
+stage_parse(void *arg, void *item)
+{
+	struct server *sv = (struct server *)arg;
+	struct job *j = (struct job *)item;
+
+	j->data = file_data_init();
+	if (j->c) {
+		j->rq = request_init_nb(j->c->fd, j->data, &j->c->hp,
+					j->c->parsed, &j->c->arena);
+		if (j->rq->responded) {
+			job_done(sv, j);
+			return;
+		}
+	} else {
+		j->rq = request_init(j->fd, j->data, &j->arena);
+		if (!j->rq) {
+			file_data_free(j->data);
+			job_free(sv, j);
+			return;
+		}
+	}
+	cache_hint(sv, j->rq);
+	if (cache_lookup(sv, j->rq, &j->data)) {
+		job_next(sv, sv->send, j);
+	} else if (sv->uring && !cache_remote(sv, j->rq)) {
+		if (!request_check_name(j->rq)) {
+			job_done(sv, j);
+			return;
+		}
+		j->uf.name = j->data->file_name;
+		j->uf.max_size = sv->uring_max_size;
+		j->uf.done = uring_done;
+		j->uf.arg = j;
+		uring_read(sv->uring, &j->uf);
+	} else {
+		job_next(sv, sv->disk, j);
+	}
+}
+
+static void
+stage_disk(void *arg, void *item)
+{
+	struct server *sv = (struct server *)arg;
+	struct job *j = (struct job *)item;
+
+	if (!cache_fill(sv, j->rq, j->data)) {
+		job_done(sv, j);
+		return;
+	}
+	job_next(sv, sv->send, j);
+}
+
+static void
+stage_send(void *arg, void *item)
+{
+	struct server *sv = (struct server *)arg;
+	struct job *j = (struct job *)item;
+
+	if (j->chunk) { /* event_reply reads it */
+		job_done(sv, j);
+		return;
+	}
+	if (j->reading) {
+		struct uring_file *uf = &j->uf;
+
+		j->reading = 0;
+		if (request_readfile_done(j->rq, -uf->err, &uf->sbuf, uf->buf,
+					  uf->len) == 0) {
+			job_done(sv, j);
+			return;
+		}
+		cache_add(sv, j->rq, j->data);
+	}
+	request_sendfile(j->rq);
+	job_done(sv, j);
+}
+
+/* starts serving the client on connfd, or on c, in the stages.
+ * Returns 0 if the server started exiting. */
+static int
+stage_request(struct server *sv, int connfd, struct conn *c)
+{
+	struct job *j;
+
+	j = job_alloc(sv);
+	j->fd = connfd;
+	j->c = c;
+	if (!stage_enqueue(sv->parse, j)) {
+		job_free(sv, j);
+		return 0;
+	}
+	return 1;
+}
+
+/* has the send stage read the next chunk of the streamed file c is sending */
+static void
+stage_chunk(struct server *sv, struct conn *c)
+{
+	struct job *j;
+
+	j = job_alloc(sv);
+	j->c = c;
+	j->rq = c->rq;
+	j->data = c->data;
+	j->chunk = 1;
+	if (!stage_enqueue(sv->send, j))
+		job_free(sv, j);
+}
+
+static void
+stage_exit(struct server *sv)
+{
+	struct job *j;
+
+	/* in order, so that each stage can pass its last jobs on */
+	stage_stop(sv->parse);
+	if (sv->uring)
+		uring_stop(sv->uring);
+	stage_stop(sv->disk);
+	stage_stop(sv->send);
+	stage_print_stats(sv->parse, stderr);
+	stage_print_stats(sv->disk, stderr);
+	stage_print_stats(sv->send, stderr);
+	if (sv->uring) {
+		uring_print_stats(sv->uring, stderr);
+		uring_destroy(sv->uring);
+	}
+	stage_destroy(sv->parse);
+	stage_destroy(sv->disk);
+	stage_destroy(sv->send);
+	while ((j = sv->free_jobs)) {
+		sv->free_jobs = j->next;
+		arena_destroy(&j->arena);
+		free(j);
+	}
+	pthread_mutex_destroy(&sv->job_lock);
+}
+
+/* called by an event loop once the headers of c have arrived, or its
+ * response needs the next chunk of a streamed file */
+static void
+event_dispatch(void *arg, struct conn *c)
+{
+	struct server *sv = (struct server *)arg;
+
+	if (sv->parse) {
+		/* if we are exiting, event_exit closes the connection */
+		if (c->rq)
+			stage_chunk(sv, c);
+		else
+			stage_request(sv, c->fd, c);
+	} else if (sv->nr_threads == 0) { /* no worker threads, serve in the loop */
+		do_event_request(sv, c);
+	} else if (!try_enqueue_request(sv, 0, c->fd) && !sv->exiting) {
+		/* rather than keep the loop's other clients waiting for room in
+		 * the queue, answer this one that we are busy, or, halfway
+		 * through its response, read its next chunk here after all. If
+		 * we are exiting, event_exit closes the connection. */
+		if (c->rq)
+			do_event_request(sv, c);
+		else
+			do_event_busy(sv, c);
+	}
+}
+
 /* entry point functions */
 
 struct server *
-server_init(int nr_threads, int max_requests, int max_cache_size)
+server_init(int nr_threads, int max_requests, int max_cache_size,
+	    const struct server_options *opts)
 {
 	struct server *sv;
 
@@ -162,49 +704,201 @@ server_init(int nr_threads, int max_requests, int max_cache_size)
 	sv->max_requests = max_requests;
 	sv->max_cache_size = max_cache_size;
 	sv->exiting = 0;
+	sv->ev = NULL;
+	sv->nr_shed = 0;
+	sv->parse = sv->disk = sv->send = NULL;
+	sv->uring = NULL;
+	sv->archive = NULL;
+	sv->fq = NULL;
+	sv->wsq = NULL;
+	sv->pool = NULL;
+	sv->proxy = NULL;
+	sv->peers = NULL;
+	sv->prefetch = NULL;
 	
-
-	/* Lab 4: create queue of max_request size when max_requests > 0 */
-	request_queue = create_request_queue(max_requests);
+	if (opts->archive && !(sv->archive = archive_open(opts->archive)))
+		exit(1);
+	if (opts->proxy &&
+	    !(sv->proxy = proxy_init(opts->proxy, opts->proxy_policy,
+				     opts->header_ms, opts->write_ms)))
+		exit(1);
+	request_set_stream_size(opts->stream_size);
+	request_set_direct_io(opts->direct_io);
+	forkjoin_init(opts->nr_helpers);
+
+	/* each acceptor has its own queue and workers, or serves its
+	 * connections itself, unless they go to the loops, stages or fair
+	 * queue, which are shared */
+	sv->nr_groups = 1;
+	if (opts->nr_acceptors > 1 && opts->nr_loops == 0 &&
+	    opts->parse_threads == 0 && !opts->fair && !opts->steal &&
+	    !opts->pool) {
+		sv->nr_groups = opts->nr_acceptors;
+		if (nr_threads > 0 && nr_threads < sv->nr_groups)
+			sv->nr_groups = nr_threads;
+	}
+	sv->arenas = Malloc(sv->nr_groups * sizeof(struct arena));
+	request_queues = Malloc(sv->nr_groups * sizeof(struct ring *));
+	for (int i = 0; i < sv->nr_groups; i++) {
+		arena_init(&sv->arenas[i]);
+		/* Lab 4: create queue of max_request size when
+		 * max_requests > 0, shared out among the groups */
+		request_queues[i] = ring_init(max_requests / sv->nr_groups);
+	}
 
 	/* Lab 5: init server cache and limit its size to max_cache_size */
 	if (max_cache_size != 0) 
 		cache = hash_table_init(max_cache_size);
 
+	/* the staged server replaces the worker threads */
+	if (opts->parse_threads > 0) {
+		int max_items = max_requests > 0 ? max_requests : 1;
+
+		pthread_mutex_init(&sv->job_lock, NULL);
+		sv->free_jobs = NULL;
+		sv->parse = stage_init("parse", opts->parse_threads, max_items,
+				       stage_parse, sv);
+		sv->disk = stage_init("disk", opts->disk_threads, max_items,
+				      stage_disk, sv);
+		sv->send = stage_init("send", opts->send_threads, max_items,
+				      stage_send, sv);
+		sv->nr_threads = nr_threads = 0;
+		if (opts->uring && !(sv->uring = uring_init()))
+			fprintf(stderr, "io_uring is not available, "
+				"reading files with the disk threads\n");
+		sv->uring_max_size = opts->stream_size ? opts->stream_size :
+			LONG_MAX;
+	}
+
+	/* the threads reading files from disk are the ones that fetch them
+	 * from peers. A pool may shrink to its minimum, so fetches must
+	 * leave a thread free even then. */
+	if (opts->peers &&
+	    !(sv->peers = peers_init(opts->peers, opts->port,
+				     opts->parse_threads > 0 ?
+				     opts->disk_threads : opts->pool ?
+				     opts->pool_limits.min : nr_threads)))
+		exit(1);
+
+	if (opts->prefetch_threads > 0)
+		sv->prefetch = prefetch_init(opts->prefetch_threads,
+					     cache_prefetch, sv);
+
+	/* the fair queue takes the place of request_queue for the workers */
+	if (opts->fair && nr_threads > 0)
+		sv->fq = fairq_init(&opts->fair_limits, max_requests);
+	/* as do the deques, with workers stealing from each other */
+	else if (opts->steal && nr_threads > 0)
+		sv->wsq = wsq_init(nr_threads, max_requests);
+
 	/* Lab 4: create worker threads when nr_threads > 0 */
 	pthreads = Malloc(nr_threads * sizeof(pthread_t));
-	pthread_mutex_init(&queue_mutex, NULL);
-	pthread_cond_init(&queue_became_nonempty, NULL);
-	pthread_cond_init(&queue_became_nonfull, NULL);
+	workers = Malloc(nr_threads * sizeof(struct worker));
 	for (int i = 0; i < nr_threads; i++){
-		pthread_create(&pthreads[i], NULL, helper_thread_do_server_request, sv);
+		workers[i].sv = sv;
+		workers[i].id = i;
+		workers[i].group = i % sv->nr_groups;
+		if (!opts->pool)
+			pthread_create(&pthreads[i], NULL, helper_thread_do_server_request, &workers[i]);
 	}
+	/* the pool starts and stops the workers, which all take from
+	 * request_queues[0] */
+	if (opts->pool && nr_threads > 0)
+		sv->pool = pool_init(&opts->pool_limits, nr_threads,
+				     helper_thread_do_server_request,
+				     pool_queued, pool_wake, &workers[0]);
+
+	/* the loops own the client sockets and feed the worker threads */
+	if (opts->nr_loops > 0)
+		sv->ev = event_init(opts->nr_loops, event_dispatch, sv,
+				    opts->header_ms, opts->write_ms);
 
 	return sv;
 }
 
 void
-server_request(struct server *sv, int connfd)
+server_request(struct server *sv, int group, int connfd,
+	       const struct sockaddr *addr)
 {
-	if (sv->nr_threads == 0) { /* no worker threads */
-		do_server_request(sv, connfd);
+	group %= sv->nr_groups;
+	if (sv->prefetch)
+		prefetch_accept(sv->prefetch, connfd, addr);
+	if (sv->ev) { /* the loop reads the request without blocking */
+		event_add(sv->ev, connfd);
+	} else if (sv->parse) {
+		if (!stage_request(sv, connfd, NULL))
+			SYS(close(connfd));
+	} else if (sv->nr_threads == 0) { /* no worker threads */
+		do_server_request(sv, connfd, &sv->arenas[group], NULL);
 	} else {
 		/*  Save the relevant info in a buffer and have one of the
 		 *  worker threads do the work. */
-		pthread_mutex_lock(&queue_mutex);
-		while (request_queue->curr_size == request_queue->max_size) {
-			pthread_cond_wait(&queue_became_nonfull, &queue_mutex);
-		}
+		if (!enqueue_request(sv, group, connfd))
+			SYS(close(connfd));
+	}
+}
 
-		// we now have the lock and can add to queue
-		// should succeed because the queue is nonfull
-		assert(push_back(request_queue, connfd));
+int
+server_save_cache(struct server *sv, int fd)
+{
+	struct file_data **datas;
+	int i, nr;
+
+	if (!cache)
+		return 0;
+	nr = collect_hash_table(cache, &datas);
+	for (i = 0; i < nr; i++) {
+		restart_save(fd, datas[i]);
+		file_data_free(datas[i]);
+	}
+	free(datas);
+	return nr;
+}
 
-		// issue nonempty signal if applicable
-		if (request_queue->curr_size == 1) {
-			pthread_cond_broadcast(&queue_became_nonempty);
-		}
-		pthread_mutex_unlock(&queue_mutex);
+static void
+server_cache_file(void *arg, struct file_data *data)
+{
+	struct server *sv = (struct server *)arg;
+
+	/* the new cache may be smaller */
+	if (file_data_size(data) <= sv->max_cache_size)
+		add_to_hash_table(cache, data->file_name, data);
+	file_data_free(data);
+}
+
+int
+server_load_cache(struct server *sv, int fd)
+{
+	if (!cache)
+		return 0;
+	return restart_load(fd, server_cache_file, sv);
+}
+
+/* returns the number of connections waiting to be served */
+static int
+server_pending(struct server *sv)
+{
+	int i, nr = 0;
+
+	for (i = 0; i < sv->nr_groups; i++)
+		nr += ring_len(request_queues[i]);
+	if (sv->fq)
+		nr += fairq_len(sv->fq);
+	if (sv->wsq)
+		nr += wsq_len(sv->wsq);
+	if (sv->ev)
+		nr += event_nr_conns(sv->ev);
+	return nr;
+}
+
+void
+server_drain(struct server *sv, int ms)
+{
+	/* the requests the workers, or stages, are serving are finished by
+	 * server_exit */
+	while (server_pending(sv) > 0 && ms > 0) {
+		usleep(10000);
+		ms -= 10;
 	}
 }
 
@@ -215,17 +909,70 @@ server_exit(struct server *sv)
 	 * these threads that the server is exiting. make sure to call
 	 * pthread_join in this function so that the main server thread waits
 	 * for all the worker threads to exit before exiting. */
-	//First wake all reader threads
+	//First wake all reader threads, as well as event loops blocked on a
+	//full queue
 	sv->exiting = 1;
+	for (int i = 0; i < sv->nr_groups; i++)
+		ring_stop(request_queues[i]);
+	if (sv->fq)
+		fairq_stop(sv->fq);
+	if (sv->wsq)
+		wsq_stop(sv->wsq);
+
+	if (sv->pool) {
+		pool_print_stats(sv->pool, stderr);
+		pool_exit(sv->pool);
+	} else {
+		for (int i = 0; i < sv->nr_threads; i++) {
+			pthread_join(pthreads[i], NULL);
+		}
+	}
+	if (sv->parse)
+		stage_exit(sv);
+	if (sv->ev) {
+		event_print_stats(sv->ev, stderr);
+		fprintf(stderr, "event busy %ld\n", sv->nr_shed);
+		event_exit(sv->ev);
+	}
+	forkjoin_exit();
 
-	pthread_cond_broadcast(&queue_became_nonempty);
-	for (int i = 0; i < sv->nr_threads; i++) {
-		pthread_join(pthreads[i], NULL);
+	/* before the cache it fills is gone */
+	if (sv->prefetch) {
+		prefetch_print_stats(sv->prefetch, stderr);
+		prefetch_exit(sv->prefetch);
 	}
 
 	free(pthreads);
-	delete_queue(request_queue);
-	delete_hash_table(cache);
+	free(workers);
+	for (int i = 0; i < sv->nr_groups; i++)
+		ring_destroy(request_queues[i]);
+	free(request_queues);
+	if (cache)
+		delete_hash_table(cache);
+	if (sv->fq) {
+		fairq_print_stats(sv->fq, stderr);
+		fairq_destroy(sv->fq);
+	}
+	if (sv->wsq) {
+		wsq_print_stats(sv->wsq, stderr);
+		wsq_destroy(sv->wsq);
+	}
+	if (sv->archive) {
+		archive_print_stats(sv->archive, stderr);
+		archive_close(sv->archive);
+	}
+	if (sv->proxy) {
+		proxy_print_stats(sv->proxy, stderr);
+		proxy_exit(sv->proxy);
+	}
+	if (sv->peers) {
+		peers_print_stats(sv->peers, stderr);
+		peers_exit(sv->peers);
+	}
+	for (int i = 0; i < sv->nr_groups; i++)
+		arena_destroy(&sv->arenas[i]);
+	free(sv->arenas);
+	bufpool_drain();
 
 	/* make sure to free any allocated resources */
 	free(sv);
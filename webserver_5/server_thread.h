@@ -3,12 +3,73 @@
 
 
 #include "queue.h"
+#include "fairq.h"
+#include "pool.h"
 
 struct server;
+struct sockaddr;
+
+/* optional server features, set from the command line. A zeroed struct gives
+ * the plain lab 5 server. */
+struct server_options {
+	int nr_loops;	/* epoll event loops, 0 for blocking workers */
+	int stream_size; /* stream files larger than this, 0 to never stream */
+	/* thread pools of the staged server, which replaces the nr_threads
+	 * workers when parse_threads > 0 */
+	int parse_threads;
+	int disk_threads;
+	int send_threads;
+	int nr_helpers;	/* threads that help process large files */
+	int direct_io;	/* read files with O_DIRECT */
+	int uring;	/* staged server reads files with io_uring */
+	char *archive;	/* serve the files in this archive, see pack.h */
+	/* close connections whose headers take longer than header_ms, or
+	 * whose response stalls for write_ms, 0 for no deadline. Only
+	 * applies with event loops, or to a proxy. */
+	int header_ms;
+	int write_ms;
+	/* workers take connections from a queue that is fair across
+	 * clients, within these limits */
+	int fair;
+	struct fairq_limits fair_limits;
+	/* workers take connections from deques of their own, and steal
+	 * from each other's, see wsq.h. Ignored with fair. */
+	int steal;
+	/* grow and shrink the workers, from nr_threads, within these
+	 * limits, see pool.h. Needs the one request queue. */
+	int pool;
+	struct pool_limits pool_limits;
+	/* forward requests to these backends, picked by proxy_policy,
+	 * instead of serving them, see proxy.h */
+	char *proxy;
+	char *proxy_policy;
+	/* share the cache with these peers, see peer.h */
+	char *peers;
+	int port;	/* the one this server listens on */
+	/* threads that read the files clients are likely to ask for next
+	 * into the cache, see prefetch.h, 0 for none */
+	int prefetch_threads;
+	/* threads accepting connections, each on its own listen socket, see
+	 * acceptor.h. With blocking workers, and no fair queue or deques,
+	 * the workers are split into as many groups, one fed by each. 0 for
+	 * the main thread. */
+	int nr_acceptors;
+};
 
 struct server *server_init(int nr_threads, int max_requests, 
-			   int max_cache_size);
-void server_request(struct server *sv, int connfd);
+			   int max_cache_size,
+			   const struct server_options *opts);
+/* serves connfd, accepted by acceptor group from the client at addr, which
+ * may be NULL if it is not known, with that acceptor's workers */
+void server_request(struct server *sv, int group, int connfd,
+		    const struct sockaddr *addr);
+/* writes the cached files to fd, see restart.h. Returns their number. */
+int server_save_cache(struct server *sv, int fd);
+/* caches the files saved to fd. Returns their number. */
+int server_load_cache(struct server *sv, int fd);
+/* waits, for up to ms, for the connections the server has accepted to be
+ * served, once it has stopped accepting */
+void server_drain(struct server *sv, int ms);
 void server_exit(struct server *sv);
 
 #endif /* __SERVER_THREAD_H__ */
@@ -0,0 +1,168 @@
+/*
+ * stage.c: a bounded queue served by a pool of threads, the building block of
+ * the staged server (see stage.h).
+ */
+
+#include <time.h>
+#include "common.h"
+#include "stage.h"
+
+struct stage_item {
+	void *item;
+	struct timespec queued;	/* when the item was queued */
+};
+
+struct stage {
+	const char *name;
+	void (*handler)(void *arg, void *item);
+	void *arg;
+	pthread_t *threads;
+	int nr_threads;
+	pthread_mutex_t lock;
+	pthread_cond_t nonempty, nonfull;
+	int exiting;
+	struct stage_item *items; /* circular buffer of max_items items */
+	int max_items;
+	int head;		/* next item to take off the queue */
+	int len;		/* items in the queue */
+	/* statistics, protected by lock */
+	long nr_items;		/* items taken off the queue */
+	long len_sum;		/* sum of the queue lengths seen by new items */
+	int len_max;
+	double wait_sum;	/* seconds items spent in the queue */
+	double wait_max;
+	long nr_full;		/* times a caller waited for a full queue */
+};
+
+static double
+elapsed(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) +
+		(to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static void *
+stage_thread(void *arg)
+{
+	struct stage *st = (struct stage *)arg;
+	struct stage_item it;
+	struct timespec now;
+	double wait;
+
+	while (1) {
+		pthread_mutex_lock(&st->lock);
+		while (st->len == 0 && !st->exiting)
+			pthread_cond_wait(&st->nonempty, &st->lock);
+		if (st->len == 0) { /* exiting, and nothing left to do */
+			pthread_mutex_unlock(&st->lock);
+			break;
+		}
+		it = st->items[st->head];
+		st->head = (st->head + 1) % st->max_items;
+		if (st->len-- == st->max_items)
+			pthread_cond_broadcast(&st->nonfull);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		wait = elapsed(&it.queued, &now);
+		st->nr_items++;
+		st->wait_sum += wait;
+		if (wait > st->wait_max)
+			st->wait_max = wait;
+		pthread_mutex_unlock(&st->lock);
+
+		st->handler(st->arg, it.item);
+	}
+	return NULL;
+}
+
+/* creates a stage whose nr_threads threads call handler(arg, item) for each
+ * item queued, and whose queue holds at most max_items items */
+struct stage *
+stage_init(const char *name, int nr_threads, int max_items,
+	   void (*handler)(void *arg, void *item), void *arg)
+{
+	struct stage *st;
+	int i;
+
+	assert(nr_threads > 0 && max_items > 0);
+	st = Malloc(sizeof(struct stage));
+	memset(st, 0, sizeof(struct stage));
+	st->name = name;
+	st->handler = handler;
+	st->arg = arg;
+	st->items = Malloc(max_items * sizeof(struct stage_item));
+	st->max_items = max_items;
+	pthread_mutex_init(&st->lock, NULL);
+	pthread_cond_init(&st->nonempty, NULL);
+	pthread_cond_init(&st->nonfull, NULL);
+	st->threads = Malloc(nr_threads * sizeof(pthread_t));
+	st->nr_threads = nr_threads;
+	for (i = 0; i < nr_threads; i++)
+		pthread_create(&st->threads[i], NULL, stage_thread, st);
+	return st;
+}
+
+int
+stage_enqueue(struct stage *st, void *item)
+{
+	struct stage_item *it;
+
+	pthread_mutex_lock(&st->lock);
+	if (st->len == st->max_items)
+		st->nr_full++;
+	while (st->len == st->max_items && !st->exiting)
+		pthread_cond_wait(&st->nonfull, &st->lock);
+	if (st->exiting) {
+		pthread_mutex_unlock(&st->lock);
+		return 0;
+	}
+	it = &st->items[(st->head + st->len) % st->max_items];
+	it->item = item;
+	clock_gettime(CLOCK_MONOTONIC, &it->queued);
+	st->len_sum += st->len;
+	if (++st->len > st->len_max)
+		st->len_max = st->len;
+	if (st->len == 1)
+		pthread_cond_broadcast(&st->nonempty);
+	pthread_mutex_unlock(&st->lock);
+	return 1;
+}
+
+void
+stage_stop(struct stage *st)
+{
+	int i;
+
+	pthread_mutex_lock(&st->lock);
+	st->exiting = 1;
+	pthread_cond_broadcast(&st->nonempty);
+	pthread_cond_broadcast(&st->nonfull);
+	pthread_mutex_unlock(&st->lock);
+	for (i = 0; i < st->nr_threads; i++)
+		pthread_join(st->threads[i], NULL);
+}
+
+void
+stage_print_stats(struct stage *st, FILE *out)
+{
+	long n;
+
+	pthread_mutex_lock(&st->lock);
+	n = st->nr_items ? st->nr_items : 1;
+	fprintf(out, "stage %-6s threads %d items %ld queue avg %.2f max %d/%d "
+		"full %ld wait avg %.3f ms max %.3f ms\n", st->name,
+		st->nr_threads, st->nr_items, (double)st->len_sum / n,
+		st->len_max, st->max_items, st->nr_full,
+		st->wait_sum / n * 1e3, st->wait_max * 1e3);
+	pthread_mutex_unlock(&st->lock);
+}
+
+void
+stage_destroy(struct stage *st)
+{
+	pthread_mutex_destroy(&st->lock);
+	pthread_cond_destroy(&st->nonempty);
+	pthread_cond_destroy(&st->nonfull);
+	free(st->threads);
+	free(st->items);
+	free(st);
+}
@@ -0,0 +1,25 @@
+#ifndef __STAGE_H__
+#define __STAGE_H__
+
+#include <stdio.h>
+
+/* A stage of a staged (SEDA) server: a bounded queue of items, and a pool of
+ * threads that take the items off the queue and hand them to the stage's
+ * handler. A handler usually ends by passing its item on to the next stage,
+ * so slow work in one stage (waiting for the disk) does not hold up threads
+ * doing other work (processing files). */
+
+struct stage;
+
+struct stage *stage_init(const char *name, int nr_threads, int max_items,
+			 void (*handler)(void *arg, void *item), void *arg);
+/* queues item, waiting while the queue is full.
+ * Returns 0, without queueing item, once the stage is exiting. */
+int stage_enqueue(struct stage *st, void *item);
+/* lets the threads handle the items still queued, then stops them */
+void stage_stop(struct stage *st);
+/* prints the number of items handled and queue lengths and delays */
+void stage_print_stats(struct stage *st, FILE *out);
+void stage_destroy(struct stage *st);
+
+#endif /* __STAGE_H__ */
@@ -0,0 +1,200 @@
+/*
+ * storage.c: storage latency models (see storage.h).
+ */
+
+#include <time.h>
+#include "common.h"
+#include "storage.h"
+
+static struct {
+	const char *name;
+	const char *spec;
+} presets[] = {
+	{ "fixed", "lat=10000" },
+	{ "hdd", "lat=8000,bw=150,slots=1" },
+	{ "ssd", "lat=100,bw=500,slots=32" },
+	{ "nvme", "lat=20,bw=3000,slots=64" },
+	{ "none", "lat=0" },
+};
+
+static long lat;		/* microseconds */
+static long bw;			/* MB/s, 0 for infinite */
+static int slots;		/* 0 for no limit */
+static long *samples;		/* latencies to replay, in microseconds */
+static int nr_samples;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t slot_free = PTHREAD_COND_INITIALIZER;
+/* protected by lock */
+static int busy;		/* reads holding a slot */
+static long nr_reads;
+static long nr_queued;		/* reads that waited for a slot */
+static double delay_sum;	/* seconds */
+static double queue_sum;	/* seconds spent waiting for a slot */
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* loads the latencies listed in file name */
+static int
+storage_load(const char *name)
+{
+	char line[64];
+	long us;
+	int max = 0;
+	FILE *f;
+
+	if (!(f = fopen(name, "r"))) {
+		perror(name);
+		return 0;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%ld", &us) != 1 || us < 0)
+			continue;	/* blank or comment */
+		if (nr_samples == max) {
+			max = max ? max * 2 : 256;
+			samples = Realloc(samples, max * sizeof(long));
+		}
+		samples[nr_samples++] = us;
+	}
+	fclose(f);
+	if (nr_samples == 0) {
+		fprintf(stderr, "%s: no latencies found\n", name);
+		return 0;
+	}
+	return 1;
+}
+
+int
+storage_init(const char *spec)
+{
+	char buf[MAXLINE], *opt, *save;
+	unsigned int i;
+
+	lat = 10000;
+	bw = 0;
+	slots = 0;
+	if (!spec)
+		return 1;
+	for (i = 0; i < sizeof(presets) / sizeof(presets[0]); i++) {
+		if (strcmp(spec, presets[i].name) == 0) {
+			spec = presets[i].spec;
+			break;
+		}
+	}
+	snprintf(buf, sizeof(buf), "%s", spec);
+	for (opt = strtok_r(buf, ",", &save); opt;
+	     opt = strtok_r(NULL, ",", &save)) {
+		if (sscanf(opt, "lat=%ld", &lat) == 1 && lat >= 0)
+			continue;
+		if (sscanf(opt, "bw=%ld", &bw) == 1 && bw >= 0)
+			continue;
+		if (sscanf(opt, "slots=%d", &slots) == 1 && slots >= 0)
+			continue;
+		if (strncmp(opt, "replay=", 7) == 0 && storage_load(opt + 7))
+			continue;
+		fprintf(stderr, "bad storage model: %s\n", opt);
+		return 0;
+	}
+	return 1;
+}
+
+/* the delay of one read of size bytes, in seconds */
+static double
+storage_model(long size)
+{
+	static __thread unsigned int seed;
+	double delay;
+
+	if (nr_samples) {
+		if (!seed)
+			seed = (unsigned int)pthread_self() ^ time(NULL);
+		delay = samples[rand_r(&seed) % nr_samples] / 1e6;
+	} else {
+		delay = lat / 1e6;
+	}
+	if (bw)
+		delay += (double)size / (bw * 1000000.0);
+	return delay;
+}
+
+void
+storage_read(long size)
+{
+	struct timespec ts;
+	double delay, start = 0;
+
+	delay = storage_model(size);
+	pthread_mutex_lock(&lock);
+	if (slots && busy == slots) {
+		nr_queued++;
+		start = now();
+		while (busy == slots)
+			pthread_cond_wait(&slot_free, &lock);
+		queue_sum += now() - start;
+	}
+	busy++;
+	nr_reads++;
+	delay_sum += delay;
+	pthread_mutex_unlock(&lock);
+
+	ts.tv_sec = (time_t)delay;
+	ts.tv_nsec = (delay - ts.tv_sec) * 1e9;
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+
+	pthread_mutex_lock(&lock);
+	busy--;
+	pthread_cond_signal(&slot_free);
+	pthread_mutex_unlock(&lock);
+}
+
+double
+storage_delay(long size)
+{
+	double delay = storage_model(size);
+
+	pthread_mutex_lock(&lock);
+	nr_reads++;
+	delay_sum += delay;
+	pthread_mutex_unlock(&lock);
+	return delay;
+}
+
+int
+storage_idle(void)
+{
+	int idle;
+
+	pthread_mutex_lock(&lock);
+	idle = !slots || busy < slots;
+	pthread_mutex_unlock(&lock);
+	return idle;
+}
+
+void
+storage_print_stats(FILE *out)
+{
+	long n;
+
+	pthread_mutex_lock(&lock);
+	n = nr_reads ? nr_reads : 1;
+	fprintf(out, "storage reads %ld delay avg %.3f ms queued %ld "
+		"queue wait avg %.3f ms\n", nr_reads, delay_sum / n * 1e3,
+		nr_queued, queue_sum / n * 1e3);
+	pthread_mutex_unlock(&lock);
+}
+
+void
+storage_exit(void)
+{
+	free(samples);
+	samples = NULL;
+	nr_samples = 0;
+}
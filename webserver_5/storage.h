@@ -0,0 +1,41 @@
+#ifndef __STORAGE_H__
+#define __STORAGE_H__
+
+#include <stdio.h>
+
+/* A model of the latency of the storage files are read from. The files
+ * themselves come from a fast local disk (or the page cache), so each read
+ * is followed by a delay that makes it take as long as it would on the
+ * storage being modelled.
+ *
+ * A model is given as a preset name, or as a comma separated list of:
+ *	lat=USEC	latency of each read, in microseconds
+ *	bw=MBPS		transfer rate, in MB/s. 0 (the default) for infinite
+ *	slots=N		reads that can be in progress at once, further reads
+ *			queue for a slot. 0 (the default) for no limit
+ *	replay=FILE	take the latency of each read from a random line of
+ *			FILE, which lists measured latencies in microseconds,
+ *			instead of from lat
+ * The presets are:
+ *	fixed		lat=10000, the original model
+ *	hdd		lat=8000,bw=150,slots=1
+ *	ssd		lat=100,bw=500,slots=32
+ *	nvme		lat=20,bw=3000,slots=64
+ *	none		no delay */
+
+/* sets up the model described by spec. Returns 0 if spec is malformed. */
+int storage_init(const char *spec);
+/* delays the calling thread as reading size bytes would */
+void storage_read(long size);
+/* returns the delay, in seconds, that reading size bytes should take, for
+ * callers that wait without blocking a thread. Slots are not modelled. */
+double storage_delay(long size);
+/* returns 1 if a read would get a slot right away, so that reads which can
+ * wait, such as prefetches, won't hold up others. Always 1 without a limit
+ * on slots. */
+int storage_idle(void);
+/* prints the number of reads and the delays and queueing they saw */
+void storage_print_stats(FILE *out);
+void storage_exit(void);
+
+#endif /* __STORAGE_H__ */
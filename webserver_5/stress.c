@@ -0,0 +1,376 @@
+/*
+ * stress.c: producer/consumer stress tests of the connection queues.
+ *
+ * To run, type "make check", or:
+ *      stress ring|wsq|pool [items]
+ *
+ * Each test runs producers and consumers of a queue, with values standing
+ * in for connections, for a range of queue sizes and thread counts, and
+ * checks that every value pushed is popped exactly once. Threads yield now
+ * and then, to shake up the interleavings on few CPUs. A test that makes no
+ * progress for STRESS_HANG_SECS is reported as hung, with the length of the
+ * queue, e.g., when a wake-up was lost.
+ *
+ * The pool test serves a burst of items with the workers of an adaptive
+ * pool, each item blocking a worker for STRESS_POOL_US, and checks that
+ * the pool grows, and then that it shrinks once idle, without anything
+ * showing up in the queue it serves.
+ */
+
+#include "common.h"
+#include "ring.h"
+#include "wsq.h"
+#include "pool.h"
+
+#define STRESS_ITEMS 20000	/* per producer, by default */
+#define STRESS_HANG_SECS 10
+#define STRESS_POOL_ITEMS 4000
+#define STRESS_POOL_US 1000
+#define STRESS_POOL_START 2
+#define STRESS_POOL_IDLE_SECS 5
+
+/* a queue under test */
+struct stress_ops {
+	const char *name;
+	void *(*init)(int size, int nr_consumers);
+	int (*push)(void *q, int v);
+	/* consumer is the number of the calling consumer */
+	int (*pop)(void *q, int consumer, int *v);
+	int (*len)(void *q);
+	void (*stop)(void *q);
+	void (*destroy)(void *q);
+};
+
+struct stress {
+	const struct stress_ops *ops;
+	void *q;
+	int nr_items;		/* per producer */
+	int nr_producers;
+	unsigned char *seen;	/* times each value was popped */
+	long popped;
+	long dups;
+};
+
+struct stress_thread {
+	struct stress *s;
+	int id;
+	pthread_t thread;
+};
+
+struct pool_stress {
+	struct ring *r;
+	struct pool *p;
+	long served;
+};
+
+static void *
+ring_stress_init(int size, int nr_consumers)
+{
+	return ring_init(size);
+}
+
+static int
+ring_stress_push(void *q, int v)
+{
+	return ring_push(q, v);
+}
+
+static int
+ring_stress_pop(void *q, int consumer, int *v)
+{
+	return ring_pop(q, v);
+}
+
+static int
+ring_stress_len(void *q)
+{
+	return ring_len(q);
+}
+
+static void
+ring_stress_stop(void *q)
+{
+	ring_stop(q);
+}
+
+static void
+ring_stress_destroy(void *q)
+{
+	ring_destroy(q);
+}
+
+static const struct stress_ops ring_ops = {
+	"ring", ring_stress_init, ring_stress_push, ring_stress_pop,
+	ring_stress_len, ring_stress_stop, ring_stress_destroy,
+};
+
+static void *
+wsq_stress_init(int size, int nr_consumers)
+{
+	return wsq_init(nr_consumers, size);
+}
+
+static int
+wsq_stress_push(void *q, int v)
+{
+	return wsq_push(q, v);
+}
+
+static int
+wsq_stress_pop(void *q, int consumer, int *v)
+{
+	return wsq_pop(q, consumer, v);
+}
+
+static int
+wsq_stress_len(void *q)
+{
+	return wsq_len(q);
+}
+
+static void
+wsq_stress_stop(void *q)
+{
+	wsq_stop(q);
+}
+
+static void
+wsq_stress_destroy(void *q)
+{
+	wsq_print_stats(q, stdout);
+	wsq_destroy(q);
+}
+
+static const struct stress_ops wsq_ops = {
+	"wsq", wsq_stress_init, wsq_stress_push, wsq_stress_pop,
+	wsq_stress_len, wsq_stress_stop, wsq_stress_destroy,
+};
+
+static void *
+stress_producer(void *arg)
+{
+	struct stress_thread *t = (struct stress_thread *)arg;
+	struct stress *s = t->s;
+	unsigned int seed = t->id;
+	int i;
+
+	for (i = 0; i < s->nr_items; i++) {
+		if (!s->ops->push(s->q, t->id * s->nr_items + i)) {
+			fprintf(stderr, "push failed\n");
+			exit(1);
+		}
+		if (rand_r(&seed) % 8 == 0)
+			sched_yield();
+	}
+	return NULL;
+}
+
+static void *
+stress_consumer(void *arg)
+{
+	struct stress_thread *t = (struct stress_thread *)arg;
+	struct stress *s = t->s;
+	unsigned int seed = t->id + 1000;
+	int v;
+
+	while (s->ops->pop(s->q, t->id, &v) > 0) {
+		if (v < 0 || v >= s->nr_items * s->nr_producers ||
+		    __atomic_fetch_add(&s->seen[v], 1, __ATOMIC_RELAXED) > 0)
+			__atomic_add_fetch(&s->dups, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&s->popped, 1, __ATOMIC_RELEASE);
+		if (rand_r(&seed) % 8 == 0)
+			sched_yield();
+	}
+	return NULL;
+}
+
+/* runs one test. Returns 0 if it failed. */
+static int
+stress_run(const struct stress_ops *ops, int size, int nr_producers,
+	   int nr_consumers, int nr_items)
+{
+	struct stress s;
+	struct stress_thread *producers, *consumers;
+	long total = (long)nr_items * nr_producers, popped, last = -1;
+	int i, stalled = 0, ok = 1;
+
+	memset(&s, 0, sizeof(s));
+	s.ops = ops;
+	s.q = ops->init(size, nr_consumers);
+	s.nr_items = nr_items;
+	s.nr_producers = nr_producers;
+	s.seen = Malloc(total);
+	memset(s.seen, 0, total);
+	producers = Malloc(nr_producers * sizeof(struct stress_thread));
+	consumers = Malloc(nr_consumers * sizeof(struct stress_thread));
+	for (i = 0; i < nr_consumers; i++) {
+		consumers[i].s = &s;
+		consumers[i].id = i;
+		pthread_create(&consumers[i].thread, NULL, stress_consumer,
+			       &consumers[i]);
+	}
+	for (i = 0; i < nr_producers; i++) {
+		producers[i].s = &s;
+		producers[i].id = i;
+		pthread_create(&producers[i].thread, NULL, stress_producer,
+			       &producers[i]);
+	}
+	while ((popped = __atomic_load_n(&s.popped, __ATOMIC_ACQUIRE)) <
+	       total) {
+		if (popped == last && ++stalled >= STRESS_HANG_SECS * 10) {
+			printf("%s size %d producers %d consumers %d: HANG at "
+			       "popped=%ld len=%d\n", ops->name, size,
+			       nr_producers, nr_consumers, popped,
+			       ops->len(s.q));
+			exit(1);
+		}
+		if (popped != last)
+			stalled = 0;
+		last = popped;
+		usleep(100000);
+	}
+	for (i = 0; i < nr_producers; i++)
+		pthread_join(producers[i].thread, NULL);
+	ops->stop(s.q);
+	for (i = 0; i < nr_consumers; i++)
+		pthread_join(consumers[i].thread, NULL);
+	if (s.dups > 0 || s.popped != total) {
+		ok = 0;
+	} else {
+		for (i = 0; i < total; i++) {
+			if (s.seen[i] != 1)
+				ok = 0;
+		}
+	}
+	printf("%s size %d producers %d consumers %d: %ld items %s\n",
+	       ops->name, size, nr_producers, nr_consumers, s.popped,
+	       ok ? "ok" : "FAILED");
+	ops->destroy(s.q);
+	free(s.seen);
+	free(producers);
+	free(consumers);
+	return ok;
+}
+
+/* runs ops for each size and number of threads. Returns 0 if a test
+ * failed. */
+static int
+stress_queue(const struct stress_ops *ops, int nr_items)
+{
+	static const int sizes[] = { 1, 2, 64 };
+	static const int threads[] = { 1, 4, 16 };
+	int i, j, k, ok = 1;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		for (j = 0; j < 2; j++) {
+			for (k = 0; k < sizeof(threads) / sizeof(threads[0]);
+			     k++)
+				ok &= stress_run(ops, sizes[i], threads[j],
+						 threads[k], nr_items);
+		}
+	}
+	return ok;
+}
+
+static void *
+pool_stress_worker(void *arg)
+{
+	struct pool_stress *ps = (struct pool_stress *)arg;
+	struct pool_clock c;
+	int v, ok;
+
+	while ((ok = ring_pop(ps->r, &v)) != 0) {
+		if (ok > 0) {
+			pool_begin(&c);
+			usleep(STRESS_POOL_US);
+			pool_end(ps->p, &c);
+			__atomic_add_fetch(&ps->served, 1, __ATOMIC_RELEASE);
+		}
+		if (pool_leave(ps->p))
+			break;
+	}
+	return NULL;
+}
+
+static int
+pool_stress_queued(void *arg)
+{
+	return ring_len(((struct pool_stress *)arg)->r);
+}
+
+static void
+pool_stress_wake(void *arg)
+{
+	ring_kick(((struct pool_stress *)arg)->r);
+}
+
+/* runs the pool test. Returns 0 if it failed. */
+static int
+stress_pool(int nr_items)
+{
+	struct pool_limits limits = { 1, 32 };
+	struct pool_stress ps;
+	long served, last = -1;
+	int i, peak = 0, queued = 0, stalled = 0, ok;
+
+	memset(&ps, 0, sizeof(ps));
+	ps.r = ring_init(nr_items);
+	ps.p = pool_init(&limits, STRESS_POOL_START, pool_stress_worker,
+			 pool_stress_queued, pool_stress_wake, &ps);
+	for (i = 0; i < nr_items; i++)
+		ring_push(ps.r, i);
+	while ((served = __atomic_load_n(&ps.served, __ATOMIC_ACQUIRE)) <
+	       nr_items) {
+		if (served == last && ++stalled >= STRESS_HANG_SECS * 10) {
+			printf("pool: HANG at served=%ld len=%d threads %d\n",
+			       served, ring_len(ps.r), pool_size(ps.p));
+			exit(1);
+		}
+		if (served != last)
+			stalled = 0;
+		last = served;
+		if (pool_size(ps.p) > peak)
+			peak = pool_size(ps.p);
+		usleep(100000);
+	}
+	/* idle: the wake-ups to shrink must not look like queued work */
+	for (i = 0; i < STRESS_POOL_IDLE_SECS * 10; i++) {
+		if (ring_len(ps.r) > queued)
+			queued = ring_len(ps.r);
+		usleep(100000);
+	}
+	ok = peak > STRESS_POOL_START && pool_size(ps.p) < peak &&
+		queued == 0 && ps.served == nr_items;
+	printf("pool: %ld items, %d -> %d threads, %d once idle, %d queued "
+	       "while idle %s\n", ps.served, STRESS_POOL_START, peak,
+	       pool_size(ps.p), queued, ok ? "ok" : "FAILED");
+	ring_stop(ps.r);
+	pool_exit(ps.p);
+	ring_destroy(ps.r);
+	return ok;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int nr_items;
+
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "Usage: %s ring|wsq|pool [items]\n", argv[0]);
+		exit(1);
+	}
+	nr_items = strcmp(argv[1], "pool") == 0 ? STRESS_POOL_ITEMS :
+		STRESS_ITEMS;
+	if (argc == 3 && (nr_items = atoi(argv[2])) < 1) {
+		fprintf(stderr, "bad number of items: %s\n", argv[2]);
+		exit(1);
+	}
+	if (strcmp(argv[1], "ring") == 0)
+		exit(stress_queue(&ring_ops, nr_items) ? 0 : 1);
+	if (strcmp(argv[1], "wsq") == 0)
+		exit(stress_queue(&wsq_ops, nr_items) ? 0 : 1);
+	if (strcmp(argv[1], "pool") == 0)
+		exit(stress_pool(nr_items) ? 0 : 1);
+	fprintf(stderr, "unknown queue: %s\n", argv[1]);
+	exit(1);
+}
@@ -0,0 +1,275 @@
+/*
+ * upstream.c: requests to other servers (see upstream.h).
+ */
+
+#include <netinet/tcp.h>
+#include "common.h"
+#include "upstream.h"
+
+int
+upstream_init(struct upstream *u, const char *spec)
+{
+	char host[64] = "127.0.0.1";
+	struct addrinfo hints, *res;
+	const char *colon = strrchr(spec, ':');
+	int port;
+
+	if (colon) {
+		if (colon - spec >= (int)sizeof(host))
+			return 0;
+		memcpy(host, spec, colon - spec);
+		host[colon - spec] = 0;
+		spec = colon + 1;
+	}
+	if (sscanf(spec, "%d", &port) != 1 || port <= 0 || port > 65535)
+		return 0;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, NULL, &hints, &res) != 0)
+		return 0;
+	memcpy(&u->addr, res->ai_addr, sizeof(u->addr));
+	u->addr.sin_port = htons(port);
+	freeaddrinfo(res);
+	snprintf(u->name, sizeof(u->name), "%s:%d", host, port);
+	u->up = 1;
+	u->timeout_ms = 0;
+	pthread_mutex_init(&u->lock, NULL);
+	u->nr_idle = 0;
+	return 1;
+}
+
+/* connects fd, which does not block, to u, waiting up to timeout_ms for
+ * it, or for as long as it takes if that is -1. Returns 1 once connected,
+ * 0 if it failed, or -1 if it timed out. */
+static int
+upstream_connect_wait(struct upstream *u, int fd, int timeout_ms)
+{
+	struct pollfd pfd;
+	socklen_t len = sizeof(int);
+	int err = 0, r;
+
+	if (connect(fd, (struct sockaddr *)&u->addr, sizeof(u->addr)) == 0)
+		return 1;
+	if (errno != EINPROGRESS)
+		return 0;
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+	while ((r = poll(&pfd, 1, timeout_ms)) < 0 && errno == EINTR)
+		;
+	if (r == 0)
+		return -1;
+	return r == 1 && getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 &&
+		err == 0;
+}
+
+/* returns a new connection to u, -1 if one could not be made, or -3 if it
+ * took longer than u->timeout_ms to. The connect does not block, since a
+ * server whose backlog is full, or a host that drops SYNs, would otherwise
+ * hold us for as long as the kernel retries, minutes. */
+static int
+upstream_connect(struct upstream *u)
+{
+	int fd, one = 1, ok;
+
+	if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+		return -1;
+	if ((ok = upstream_connect_wait(u, fd, u->timeout_ms ?
+					u->timeout_ms : -1)) <= 0) {
+		SYS(close(fd));
+		return ok < 0 ? -3 : -1;
+	}
+	/* reads and writes block, for at most the timeouts below */
+	SYS(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK));
+	/* requests and response headers are small, send them right away */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (u->timeout_ms) {
+		struct timeval tv = { u->timeout_ms / 1000,
+				      u->timeout_ms % 1000 * 1000 };
+
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	}
+	return fd;
+}
+
+/* closes the connections kept to u */
+static void
+upstream_flush(struct upstream *u)
+{
+	pthread_mutex_lock(&u->lock);
+	while (u->nr_idle > 0)
+		SYS(close(u->idle[--u->nr_idle]));
+	pthread_mutex_unlock(&u->lock);
+}
+
+/* returns a connection to u, a kept one if there is any, with *reused set,
+ * or as upstream_connect fails */
+static int
+upstream_get(struct upstream *u, int *reused)
+{
+	int fd = -1;
+
+	pthread_mutex_lock(&u->lock);
+	if (u->nr_idle > 0)
+		fd = u->idle[--u->nr_idle];
+	pthread_mutex_unlock(&u->lock);
+	*reused = fd >= 0;
+	return fd >= 0 ? fd : upstream_connect(u);
+}
+
+int
+upstream_write(int fd, const char *buf, long n)
+{
+	ssize_t r;
+
+	while (n > 0) {
+		r = send(fd, buf, n, MSG_NOSIGNAL);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return 0;
+		buf += r;
+		n -= r;
+	}
+	return 1;
+}
+
+/* reads the headers of the response on fd into buf. Returns their length,
+ * up to and including the blank line, with *n set to the bytes read, which
+ * may include some of the body. Returns 0 if the connection ends, or the
+ * headers don't fit, first. */
+static int
+upstream_read_headers(int fd, char *buf, int size, int *n)
+{
+	char *end;
+	ssize_t r;
+
+	*n = 0;
+	while (*n < size - 1) {
+		r = read(fd, buf + *n, size - 1 - *n);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return 0;
+		*n += r;
+		buf[*n] = 0;
+		if ((end = strstr(buf, "\r\n\r\n")))
+			return end + 4 - buf;
+	}
+	return 0;
+}
+
+const char *
+upstream_header(const struct upstream_response *r, const char *name)
+{
+	const char *line, *eol;
+	int len = strlen(name);
+
+	/* skip the status line */
+	for (line = strstr(r->buf, "\r\n") + 2; line < r->buf + r->hlen;
+	     line = eol + 2) {
+		eol = strstr(line, "\r\n");
+		if (eol == line)
+			break;
+		if (strncasecmp(line, name, len) == 0 && line[len] == ':') {
+			line += len + 1;
+			while (*line == ' ')
+				line++;
+			return line;
+		}
+	}
+	return NULL;
+}
+
+/* fills in r from the headers in its buffer */
+static void
+upstream_parse(struct upstream_response *r)
+{
+	const char *h;
+
+	if (sscanf(r->buf, "HTTP/%*d.%*d %d", &r->status) != 1)
+		r->status = 0;
+	h = upstream_header(r, "Content-Length");
+	r->length = h ? atol(h) : -1;
+	/* these have no body, whatever the headers say */
+	if (r->status == 304 || r->status == 204 ||
+	    (r->status >= 100 && r->status < 200))
+		r->length = 0;
+	h = upstream_header(r, "Connection");
+	r->keep_alive = h && strncasecmp(h, "keep-alive", 10) == 0;
+}
+
+int
+upstream_request(struct upstream *u, const char *req, int len,
+		 char *buf, int size, struct upstream_response *r)
+{
+	int fd, timedout;
+
+	r->buf = buf;
+	while (1) {
+		if ((fd = upstream_get(u, &r->reused)) < 0)
+			return fd;
+		errno = 0;
+		if (upstream_write(fd, req, len) &&
+		    (r->hlen = upstream_read_headers(fd, buf, size, &r->n)) > 0)
+			break;
+		/* SO_RCVTIMEO and SO_SNDTIMEO fail reads and writes so */
+		timedout = errno == EAGAIN || errno == EWOULDBLOCK;
+		SYS(close(fd));
+		if (timedout)
+			return -3;
+		if (!r->reused)
+			return -2;
+		/* the server closed the kept connection, e.g., once it had
+		 * been idle for its header deadline. The others are likely
+		 * closed too, so try a new connection. */
+		upstream_flush(u);
+	}
+	upstream_parse(r);
+	return fd;
+}
+
+void
+upstream_done(struct upstream *u, int fd, const struct upstream_response *r,
+	      int complete)
+{
+	/* the connection can only take another request once the whole
+	 * response has been read from it */
+	if (r->keep_alive && r->length >= 0 && complete) {
+		pthread_mutex_lock(&u->lock);
+		if (u->up && u->nr_idle < UPSTREAM_MAX_IDLE) {
+			u->idle[u->nr_idle++] = fd;
+			fd = -1;
+		}
+		pthread_mutex_unlock(&u->lock);
+	}
+	if (fd >= 0)
+		SYS(close(fd));
+}
+
+void
+upstream_down(struct upstream *u)
+{
+	u->up = 0;
+	upstream_flush(u);
+}
+
+int
+upstream_check(struct upstream *u, int timeout_ms)
+{
+	int fd, ok;
+
+	if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+		return 0;
+	ok = upstream_connect_wait(u, fd, timeout_ms) == 1;
+	SYS(close(fd));
+	return ok;
+}
+
+void
+upstream_destroy(struct upstream *u)
+{
+	upstream_flush(u);
+	pthread_mutex_destroy(&u->lock);
+}
@@ -0,0 +1,60 @@
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include <pthread.h>
+#include <netinet/in.h>
+
+/* Requests to other servers, for the proxy and for peers. Connections to an
+ * upstream server are kept open between requests, with HTTP/1.0 keep-alive,
+ * which servers support when they run with event loops (-e). */
+
+#define UPSTREAM_MAX_IDLE 16	/* connections kept open to each server */
+
+struct upstream {
+	char name[80];		/* host:port */
+	struct sockaddr_in addr;
+	int up;			/* connections are only kept while up */
+	int timeout_ms;		/* for each read or write, 0 for none */
+	pthread_mutex_t lock;	/* protects idle */
+	int idle[UPSTREAM_MAX_IDLE]; /* open connections, ready for a request */
+	int nr_idle;
+};
+
+/* the head of a response from an upstream server */
+struct upstream_response {
+	char *buf;		/* holds the headers, and maybe some body */
+	int hlen;		/* length of the headers, up to the blank line */
+	int n;			/* bytes in buf */
+	int status;
+	long length;		/* of the body, -1 if it ends with the
+				 * connection */
+	int keep_alive;		/* the connection takes another request */
+	int reused;		/* the request went on a kept connection */
+};
+
+/* fills in u from spec, a port or host:port, without a timeout. Returns 0
+ * if it is malformed. */
+int upstream_init(struct upstream *u, const char *spec);
+/* sends the request in req on a connection to u, and reads the head of the
+ * response into buf, of size bytes, and r. Returns the connection, -1 if
+ * one could not be made, -2 if u did not respond, or -3 if connecting, or
+ * responding, took longer than u->timeout_ms. */
+int upstream_request(struct upstream *u, const char *req, int len,
+		     char *buf, int size, struct upstream_response *r);
+/* returns the value of header name of r, which ends at \r\n, or NULL */
+const char *upstream_header(const struct upstream_response *r,
+			    const char *name);
+/* done with the response on fd. complete is 1 if all of its body was read,
+ * so that the connection may be kept for the next request. */
+void upstream_done(struct upstream *u, int fd,
+		   const struct upstream_response *r, int complete);
+/* marks u down, closing the connections kept to it */
+void upstream_down(struct upstream *u);
+/* returns 1 if a connection to u can be made within timeout_ms */
+int upstream_check(struct upstream *u, int timeout_ms);
+/* writes all of buf to fd, without dying of SIGPIPE if the peer is gone.
+ * Returns 0 on failure. */
+int upstream_write(int fd, const char *buf, long n);
+void upstream_destroy(struct upstream *u);
+
+#endif /* __UPSTREAM_H__ */
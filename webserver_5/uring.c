@@ -0,0 +1,401 @@
+/*
+ * uring.c: file reads with io_uring (see uring.h), using the raw system calls.
+ */
+
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#include "common.h"
+#include "uring.h"
+#include "bufpool.h"
+#include "storage.h"
+
+#define URING_ENTRIES 256
+
+/* the operation a completion belongs to is kept in the low bits of its
+ * user_data, the file in the others */
+enum {
+	OP_WAKE,		/* read of the eventfd, no file */
+	OP_OPEN,
+	OP_STATX,
+	OP_READ,
+	OP_TIMEOUT,
+	OP_CLOSE,
+};
+#define OP_MASK 7
+
+struct uring {
+	int fd;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int sq_entries;
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size;
+	unsigned int to_submit;	/* sqes queued since the last submission */
+
+	pthread_t thread;
+	int wake_fd;		/* eventfd, written when files are added */
+	uint64_t wake_val;
+	pthread_mutex_t lock;
+	struct uring_file *added; /* files not yet started, under lock */
+	int exiting;		/* under lock */
+	int in_flight;		/* files started but not done */
+
+	/* statistics, only touched by the ring's thread */
+	long nr_files;
+	long nr_enters;
+	long nr_sqes;
+	int max_in_flight;
+};
+
+static int
+sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+		   unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       NULL, 0);
+}
+
+/* submits the queued sqes, and waits for at least wait completions */
+static void
+uring_enter(struct uring *u, unsigned int wait)
+{
+	int ret;
+
+	do {
+		ret = sys_io_uring_enter(u->fd, u->to_submit, wait,
+					 wait ? IORING_ENTER_GETEVENTS : 0);
+	} while (ret < 0 && errno == EINTR);
+	SYS(ret);
+	u->nr_enters++;
+	u->nr_sqes += u->to_submit;
+	u->to_submit = 0;
+}
+
+/* returns a cleared sqe for an operation on uf. When the submission queue is
+ * full, what is queued is submitted first. */
+static struct io_uring_sqe *
+uring_sqe(struct uring *u, struct uring_file *uf, int op)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail = *u->sq_tail, idx;
+
+	while (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) ==
+	       u->sq_entries) {
+		uring_enter(u, 0);
+	}
+	idx = tail & *u->sq_mask;
+	sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = (uint64_t)(uintptr_t)uf | op;
+	u->sq_array[idx] = idx;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->to_submit++;
+	if (uf)
+		uf->pending++;
+	return sqe;
+}
+
+static void
+uring_wait_wake(struct uring *u)
+{
+	struct io_uring_sqe *sqe = uring_sqe(u, NULL, OP_WAKE);
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = u->wake_fd;
+	sqe->addr = (uintptr_t)&u->wake_val;
+	sqe->len = sizeof(u->wake_val);
+}
+
+static void
+uring_start(struct uring *u, struct uring_file *uf)
+{
+	struct io_uring_sqe *sqe;
+
+	uf->err = 0;
+	uf->buf = NULL;
+	uf->len = 0;
+	uf->fd = -1;
+	uf->pending = 0;
+	uf->closing = 0;
+	u->nr_files++;
+	if (++u->in_flight > u->max_in_flight)
+		u->max_in_flight = u->in_flight;
+
+	/* the open and the statx run side by side */
+	sqe = uring_sqe(u, uf, OP_OPEN);
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uintptr_t)uf->name;
+	sqe->open_flags = O_RDONLY;
+	sqe = uring_sqe(u, uf, OP_STATX);
+	sqe->opcode = IORING_OP_STATX;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uintptr_t)uf->name;
+	sqe->len = STATX_BASIC_STATS;
+	sqe->off = (uintptr_t)&uf->stx;
+}
+
+static void
+uring_submit_read(struct uring *u, struct uring_file *uf)
+{
+	struct io_uring_sqe *sqe = uring_sqe(u, uf, OP_READ);
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = uf->fd;
+	sqe->addr = (uintptr_t)(uf->buf + uf->len);
+	sqe->len = uf->sbuf.st_size - uf->len;
+	sqe->off = uf->len;
+}
+
+/* closes the file, after waiting out the storage delay if it was read */
+static void
+uring_close(struct uring *u, struct uring_file *uf)
+{
+	struct io_uring_sqe *sqe;
+	double delay;
+
+	uf->closing = 1;
+	if (uf->buf && (delay = storage_delay(uf->len)) > 0) {
+		uf->delay.tv_sec = (long long)delay;
+		uf->delay.tv_nsec = (delay - uf->delay.tv_sec) * 1e9;
+		sqe = uring_sqe(u, uf, OP_TIMEOUT);
+		sqe->opcode = IORING_OP_TIMEOUT;
+		sqe->addr = (uintptr_t)&uf->delay;
+		sqe->len = 1;
+	}
+	if (uf->fd >= 0) {
+		sqe = uring_sqe(u, uf, OP_CLOSE);
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->fd = uf->fd;
+	}
+}
+
+/* the open and statx of uf have both completed */
+static void
+uring_opened(struct uring *u, struct uring_file *uf)
+{
+	if (uf->err == 0) {
+		memset(&uf->sbuf, 0, sizeof(uf->sbuf));
+		uf->sbuf.st_mode = uf->stx.stx_mode;
+		uf->sbuf.st_size = uf->stx.stx_size;
+		uf->sbuf.st_mtim.tv_sec = uf->stx.stx_mtime.tv_sec;
+		uf->sbuf.st_mtim.tv_nsec = uf->stx.stx_mtime.tv_nsec;
+	}
+	if (uf->err || !S_ISREG(uf->sbuf.st_mode) ||
+	    uf->sbuf.st_size == 0 || uf->sbuf.st_size > uf->max_size) {
+		uring_close(u, uf);
+		return;
+	}
+	uf->buf = bufpool_alloc(uf->sbuf.st_size);
+	uring_submit_read(u, uf);
+}
+
+static void
+uring_complete(struct uring *u, struct io_uring_cqe *cqe)
+{
+	struct uring_file *uf;
+	int op;
+
+	op = cqe->user_data & OP_MASK;
+	uf = (struct uring_file *)(uintptr_t)(cqe->user_data & ~OP_MASK);
+	if (op == OP_WAKE)
+		return;	/* uring_thread picks up the added files */
+	uf->pending--;
+	switch (op) {
+	case OP_OPEN:
+		if (cqe->res < 0 && !uf->err)
+			uf->err = cqe->res;
+		else if (cqe->res >= 0)
+			uf->fd = cqe->res;
+		if (uf->pending == 0)
+			uring_opened(u, uf);
+		break;
+	case OP_STATX:
+		if (cqe->res < 0 && !uf->err)
+			uf->err = cqe->res;
+		if (uf->pending == 0)
+			uring_opened(u, uf);
+		break;
+	case OP_READ:
+		if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+			uring_submit_read(u, uf);
+		} else if (cqe->res < 0) {
+			uf->err = cqe->res;
+			bufpool_free(uf->buf);
+			uf->buf = NULL;
+			uring_close(u, uf);
+		} else {
+			uf->len += cqe->res;
+			/* the file may have shrunk, then res is 0 */
+			if (cqe->res > 0 && uf->len < uf->sbuf.st_size)
+				uring_submit_read(u, uf);
+			else
+				uring_close(u, uf);
+		}
+		break;
+	case OP_TIMEOUT:	/* res is -ETIME, the normal expiry */
+	case OP_CLOSE:
+		break;
+	}
+	if (uf->closing && uf->pending == 0) {
+		u->in_flight--;
+		uf->done(uf->arg);
+	}
+}
+
+static void *
+uring_thread(void *arg)
+{
+	struct uring *u = (struct uring *)arg;
+	struct uring_file *uf, *added;
+	unsigned int head, tail;
+	int exiting = 0;
+
+	uring_wait_wake(u);
+	while (!exiting || u->in_flight > 0) {
+		pthread_mutex_lock(&u->lock);
+		added = u->added;
+		u->added = NULL;
+		exiting = u->exiting;
+		pthread_mutex_unlock(&u->lock);
+		while ((uf = added)) {
+			added = uf->next;
+			uring_start(u, uf);
+		}
+		if (exiting && u->in_flight == 0)
+			break;
+
+		/* one system call submits everything queued above and by
+		 * the previous round of completions */
+		uring_enter(u, 1);
+		head = *u->cq_head;
+		tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+
+			if ((cqe->user_data & OP_MASK) == OP_WAKE)
+				uring_wait_wake(u);
+			uring_complete(u, cqe);
+		}
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+struct uring *
+uring_init(void)
+{
+	struct io_uring_params p;
+	struct uring *u;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	fd = sys_io_uring_setup(URING_ENTRIES, &p);
+	if (fd < 0)
+		return NULL;
+	u = Malloc(sizeof(struct uring));
+	memset(u, 0, sizeof(struct uring));
+	u->fd = fd;
+	u->sq_entries = p.sq_entries;
+	u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_ring_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_ring_size > u->sq_ring_size)
+			u->sq_ring_size = u->cq_ring_size;
+		u->cq_ring_size = 0;
+	}
+	u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED)
+		unix_error("mmap error");
+	if (u->cq_ring_size) {
+		u->cq_ring = mmap(NULL, u->cq_ring_size,
+				  PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, fd,
+				  IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED)
+			unix_error("mmap error");
+	} else {
+		u->cq_ring = u->sq_ring;
+	}
+	u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+		       IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		unix_error("mmap error");
+	u->sq_head = (unsigned int *)((char *)u->sq_ring + p.sq_off.head);
+	u->sq_tail = (unsigned int *)((char *)u->sq_ring + p.sq_off.tail);
+	u->sq_mask = (unsigned int *)((char *)u->sq_ring + p.sq_off.ring_mask);
+	u->sq_array = (unsigned int *)((char *)u->sq_ring + p.sq_off.array);
+	u->cq_head = (unsigned int *)((char *)u->cq_ring + p.cq_off.head);
+	u->cq_tail = (unsigned int *)((char *)u->cq_ring + p.cq_off.tail);
+	u->cq_mask = (unsigned int *)((char *)u->cq_ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((char *)u->cq_ring + p.cq_off.cqes);
+
+	SYS(u->wake_fd = eventfd(0, 0));
+	pthread_mutex_init(&u->lock, NULL);
+	pthread_create(&u->thread, NULL, uring_thread, u);
+	return u;
+}
+
+/* starts reading uf. uf->done is called from the ring's thread. */
+void
+uring_read(struct uring *u, struct uring_file *uf)
+{
+	uint64_t one = 1;
+	int wake;
+
+	pthread_mutex_lock(&u->lock);
+	wake = u->added == NULL;
+	uf->next = u->added;
+	u->added = uf;
+	pthread_mutex_unlock(&u->lock);
+	/* the thread takes all added files at once, so only the first one
+	 * needs to wake it */
+	if (wake)
+		Rio_write(u->wake_fd, &one, sizeof(one));
+}
+
+void
+uring_print_stats(struct uring *u, FILE *out)
+{
+	fprintf(out, "uring files %ld max in flight %d submits %ld "
+		"sqes per submit %.2f\n", u->nr_files, u->max_in_flight,
+		u->nr_enters, u->nr_enters ?
+		(double)u->nr_sqes / u->nr_enters : 0.0);
+}
+
+void
+uring_stop(struct uring *u)
+{
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&u->lock);
+	u->exiting = 1;
+	pthread_mutex_unlock(&u->lock);
+	Rio_write(u->wake_fd, &one, sizeof(one));
+	pthread_join(u->thread, NULL);
+}
+
+void
+uring_destroy(struct uring *u)
+{
+	munmap(u->sqes, u->sq_entries * sizeof(struct io_uring_sqe));
+	if (u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_ring_size);
+	munmap(u->sq_ring, u->sq_ring_size);
+	SYS(close(u->fd));
+	SYS(close(u->wake_fd));
+	pthread_mutex_destroy(&u->lock);
+	free(u);
+}
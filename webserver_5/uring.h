@@ -0,0 +1,53 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <stdio.h>
+#include <sys/stat.h>
+#include <linux/stat.h>
+#include <linux/time_types.h>
+
+/* Asynchronous file reads with io_uring. One thread drives the ring: it
+ * opens, stats, reads and closes files for any number of requests, so many
+ * reads can be in flight without a thread waiting on each of them. The
+ * operations of all files are submitted together, with one system call per
+ * round. After a file has been read, the delay of the storage model (see
+ * storage.h) is waited out with a timeout on the ring as well. */
+
+struct uring;
+
+/* a file to read. The caller fills in the first fields, and gets done(arg)
+ * called from the ring's thread once the file has been read, or once it
+ * turned out that it should not be. */
+struct uring_file {
+	const char *name;
+	long max_size;		/* files larger than this are not read */
+	void (*done)(void *arg);
+	void *arg;
+	/* results */
+	int err;		/* -errno if the file could not be opened or
+				 * stat'ed, or read */
+	struct stat sbuf;	/* valid if err is 0 */
+	char *buf;		/* file contents, from bufpool. NULL if the
+				 * file is empty, is not a regular file or is
+				 * larger than max_size */
+	long len;		/* bytes read into buf */
+	/* private */
+	int fd;
+	int pending;		/* operations in flight */
+	int closing;		/* the file has been read, or won't be */
+	struct statx stx;
+	struct __kernel_timespec delay;
+	struct uring_file *next;
+};
+
+/* returns NULL if io_uring is not available */
+struct uring *uring_init(void);
+void uring_read(struct uring *u, struct uring_file *uf);
+/* prints how many files were read and how many operations were submitted per
+ * system call */
+void uring_print_stats(struct uring *u, FILE *out);
+/* waits for the reads in flight, then stops the ring's thread */
+void uring_stop(struct uring *u);
+void uring_destroy(struct uring *u);
+
+#endif /* __URING_H__ */
@@ -0,0 +1,481 @@
+/*
+ * wsq.c: work-stealing queues of connections (see wsq.h).
+ */
+
+#include <limits.h>
+#include <stdint.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "common.h"
+#include "ring.h"
+#include "wsq.h"
+
+#define CACHE_LINE 64
+#define WORD_BITS 64
+
+/* the queue of a worker, and where the worker sleeps */
+struct wsq_worker {
+	/* the deque: the worker pushes and pops at the bottom, thieves take
+	 * from the top. top <= bottom, but for the moment the worker takes
+	 * the last connection. */
+	int64_t top __attribute__((aligned(CACHE_LINE)));
+	int64_t bottom __attribute__((aligned(CACHE_LINE)));
+	int buf[WSQ_DEQUE];
+	struct ring *inbox;
+	/* the worker */
+	uint32_t event __attribute__((aligned(CACHE_LINE))); /* wakes it */
+	long nr_own;		/* taken from its own queue */
+	long nr_stolen;		/* taken from others */
+	long nr_lost;		/* steals lost to another thief */
+};
+
+struct wsq {
+	struct wsq_worker *workers;
+	int nr;
+	int nr_words;		/* in each bitmap */
+	int stopped;
+	unsigned int next __attribute__((aligned(CACHE_LINE))); /* round-robin */
+	uint64_t *idle;		/* the workers asleep, or going to sleep */
+	uint64_t *ready;	/* the queues that may hold connections */
+	/* callers of wsq_push waiting for room */
+	uint32_t nonfull_seq __attribute__((aligned(CACHE_LINE)));
+	int nonfull_sleepers;
+};
+
+static void
+futex_wait(uint32_t *addr, uint32_t val)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void
+futex_wake(uint32_t *addr, int nr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, nr, NULL, NULL, 0);
+}
+
+static void *
+wsq_alloc(size_t size)
+{
+	void *p = NULL;
+
+	if (posix_memalign(&p, CACHE_LINE, size) != 0)
+		unix_error("posix_memalign error");
+	memset(p, 0, size);
+	return p;
+}
+
+/* sets bit i of map, if it is not set already */
+static void
+bit_set(uint64_t *map, int i)
+{
+	uint64_t bit = 1ULL << (i % WORD_BITS);
+
+	if (!(__atomic_load_n(&map[i / WORD_BITS], __ATOMIC_SEQ_CST) & bit))
+		__atomic_fetch_or(&map[i / WORD_BITS], bit, __ATOMIC_SEQ_CST);
+}
+
+/* clears bit i of map. Returns 1 if it was set. */
+static int
+bit_clear(uint64_t *map, int i)
+{
+	uint64_t bit = 1ULL << (i % WORD_BITS);
+
+	if (!(__atomic_load_n(&map[i / WORD_BITS], __ATOMIC_SEQ_CST) & bit))
+		return 0;
+	return (__atomic_fetch_and(&map[i / WORD_BITS], ~bit,
+				   __ATOMIC_SEQ_CST) & bit) != 0;
+}
+
+struct wsq *
+wsq_init(int nr_workers, int size)
+{
+	struct wsq *q;
+	int i;
+
+	if (nr_workers < 1)
+		nr_workers = 1;
+	q = wsq_alloc(sizeof(struct wsq));
+	q->workers = wsq_alloc(nr_workers * sizeof(struct wsq_worker));
+	q->nr = nr_workers;
+	q->nr_words = (nr_workers + WORD_BITS - 1) / WORD_BITS;
+	/* each bitmap on lines of its own */
+	q->idle = wsq_alloc(q->nr_words * sizeof(uint64_t) + CACHE_LINE);
+	q->ready = wsq_alloc(q->nr_words * sizeof(uint64_t) + CACHE_LINE);
+	for (i = 0; i < nr_workers; i++)
+		q->workers[i].inbox = ring_init((size + nr_workers - 1) /
+						nr_workers);
+	return q;
+}
+
+/* pushes connfd at the bottom of w's deque, which must have room. Only w
+ * calls it. */
+static void
+deque_push(struct wsq_worker *w, int connfd)
+{
+	int64_t b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&w->buf[b & (WSQ_DEQUE - 1)], connfd,
+			 __ATOMIC_RELAXED);
+	/* a thief that sees the new bottom sees connfd */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+}
+
+/* pops the connection at the bottom of w's deque into *connfd. Only w calls
+ * it. Returns 0 if the deque is empty, or a thief took the last
+ * connection. */
+static int
+deque_pop(struct wsq_worker *w, int *connfd)
+{
+	int64_t b, t;
+	int ok = 1;
+
+	b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED) - 1;
+	__atomic_store_n(&w->bottom, b, __ATOMIC_RELAXED);
+	/* orders taking the bottom before reading top. A thief reads them the
+	 * other way around, so we can't both take the same connection, but
+	 * for the last one, which the compare-and-swap decides. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	t = __atomic_load_n(&w->top, __ATOMIC_RELAXED);
+	if (t > b) {
+		__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	*connfd = __atomic_load_n(&w->buf[b & (WSQ_DEQUE - 1)],
+				  __ATOMIC_RELAXED);
+	if (t == b) {
+		stress_yield();
+		ok = __atomic_compare_exchange_n(&w->top, &t, t + 1, 0,
+						 __ATOMIC_SEQ_CST,
+						 __ATOMIC_RELAXED);
+		__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+	return ok;
+}
+
+/* steals the connection at the top of w's deque into *connfd. Returns 1 if
+ * it did, 0 if the deque is empty, and -1 if another thread took it
+ * first. */
+static int
+deque_steal(struct wsq_worker *w, int *connfd)
+{
+	int64_t t, b;
+	int fd;
+
+	t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	b = __atomic_load_n(&w->bottom, __ATOMIC_ACQUIRE);
+	if (t >= b)
+		return 0;
+	/* the slot may be pushed into again only once top has moved on, and
+	 * then we fail */
+	fd = __atomic_load_n(&w->buf[t & (WSQ_DEQUE - 1)], __ATOMIC_RELAXED);
+	stress_yield();
+	if (!__atomic_compare_exchange_n(&w->top, &t, t + 1, 0,
+					 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return -1;
+	*connfd = fd;
+	return 1;
+}
+
+/* returns 1 if worker i's queue holds no connections */
+static int
+wsq_empty(struct wsq *q, int i)
+{
+	struct wsq_worker *w = &q->workers[i];
+
+	return __atomic_load_n(&w->bottom, __ATOMIC_SEQ_CST) <=
+		__atomic_load_n(&w->top, __ATOMIC_SEQ_CST) &&
+		ring_len(w->inbox) == 0;
+}
+
+/* unmarks worker i's queue, found empty. A connection put in meanwhile
+ * marks it again, but the mark may have been there already, so look once
+ * more after clearing it. */
+static void
+wsq_unready(struct wsq *q, int i)
+{
+	if (!bit_clear(q->ready, i))
+		return;
+	stress_yield();
+	if (!wsq_empty(q, i))
+		bit_set(q->ready, i);
+}
+
+/* wakes up worker i, which was taken off the idle bitmap */
+static void
+wsq_wake_worker(struct wsq *q, int i)
+{
+	__atomic_add_fetch(&q->workers[i].event, 1, __ATOMIC_SEQ_CST);
+	futex_wake(&q->workers[i].event, 1);
+}
+
+/* wakes up a sleeping worker, if any, for a connection put into the queue
+ * of worker i: i itself if it is asleep, or else the first one asleep */
+static void
+wsq_wake(struct wsq *q, int i)
+{
+	uint64_t word;
+	int j, b;
+
+	/* orders marking the queue before reading idle. A worker orders
+	 * saying it is idle before looking at the marks, so either it sees the
+	 * mark, or we see it idle. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	stress_yield();
+	if (bit_clear(q->idle, i)) {
+		wsq_wake_worker(q, i);
+		return;
+	}
+	for (j = 0; j < q->nr_words; j++) {
+		while ((word = __atomic_load_n(&q->idle[j], __ATOMIC_SEQ_CST))) {
+			b = __builtin_ctzll(word);
+			if (bit_clear(q->idle, j * WORD_BITS + b)) {
+				wsq_wake_worker(q, j * WORD_BITS + b);
+				return;
+			}
+		}
+	}
+}
+
+/* wakes up a caller of wsq_push waiting for room, after a connection was
+ * taken from an inbox */
+static void
+wsq_wake_nonfull(struct wsq *q)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&q->nonfull_sleepers, __ATOMIC_SEQ_CST) == 0)
+		return;
+	__atomic_add_fetch(&q->nonfull_seq, 1, __ATOMIC_SEQ_CST);
+	futex_wake(&q->nonfull_seq, 1);
+}
+
+/* tries to put connfd into an inbox, the next one round-robin, or else the
+ * first with room after it. Returns the worker, or -1 if all are full. */
+static int
+wsq_put(struct wsq *q, int connfd)
+{
+	int i, start;
+
+	start = __atomic_fetch_add(&q->next, 1, __ATOMIC_RELAXED) % q->nr;
+	for (i = 0; i < q->nr; i++) {
+		if (ring_try_push(q->workers[(start + i) % q->nr].inbox,
+				  connfd))
+			return (start + i) % q->nr;
+	}
+	return -1;
+}
+
+int
+wsq_push(struct wsq *q, int connfd)
+{
+	uint32_t seq;
+	int i;
+
+	if (__atomic_load_n(&q->stopped, __ATOMIC_ACQUIRE))
+		return 0;
+	while ((i = wsq_put(q, connfd)) < 0) {
+		seq = __atomic_load_n(&q->nonfull_seq, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&q->nonfull_sleepers, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (!__atomic_load_n(&q->stopped, __ATOMIC_SEQ_CST) &&
+		    (i = wsq_put(q, connfd)) < 0)
+			futex_wait(&q->nonfull_seq, seq);
+		__atomic_sub_fetch(&q->nonfull_sleepers, 1, __ATOMIC_SEQ_CST);
+		if (i >= 0)
+			break;
+		if (__atomic_load_n(&q->stopped, __ATOMIC_ACQUIRE))
+			return 0;
+	}
+	bit_set(q->ready, i);
+	wsq_wake(q, i);
+	return 1;
+}
+
+int
+wsq_try_push(struct wsq *q, int connfd)
+{
+	int i;
+
+	if (__atomic_load_n(&q->stopped, __ATOMIC_ACQUIRE) ||
+	    (i = wsq_put(q, connfd)) < 0)
+		return 0;
+	bit_set(q->ready, i);
+	wsq_wake(q, i);
+	return 1;
+}
+
+/* takes a connection from worker i's queue, for another worker. Returns 1
+ * if it did, 0 if the queue is empty, and -1 if it lost a race for the
+ * last one in the deque. */
+static int
+wsq_steal(struct wsq *q, int i, int *connfd)
+{
+	int r;
+
+	if ((r = deque_steal(&q->workers[i], connfd)) != 0)
+		return r;
+	if (ring_try_pop(q->workers[i].inbox, connfd)) {
+		wsq_wake_nonfull(q);
+		return 1;
+	}
+	return 0;
+}
+
+/* tries to take a connection for worker i from its own queue, moving a
+ * batch from the inbox into the deque when the deque is empty. Returns 0
+ * if the queue is empty. */
+static int
+wsq_try_own(struct wsq *q, int i, int *connfd)
+{
+	struct wsq_worker *w = &q->workers[i];
+	int fd, n;
+
+	if (deque_pop(w, connfd))
+		return 1;
+	/* the deque is empty, so a batch fits */
+	for (n = 0; n < WSQ_BATCH && ring_try_pop(w->inbox, &fd); n++)
+		deque_push(w, fd);
+	if (n == 0)
+		return 0;
+	wsq_wake_nonfull(q);
+	/* the rest of the batch may be stolen from the deque */
+	if (n > 1)
+		bit_set(q->ready, i);
+	return deque_pop(w, connfd);
+}
+
+/* tries to take a connection for worker i, from its own queue, and then
+ * from the others marked ready. Returns 0 if none was found. */
+static int
+wsq_try_pop(struct wsq *q, int i, int *connfd)
+{
+	struct wsq_worker *w = &q->workers[i];
+	uint64_t word;
+	int j, k, b, r;
+
+	if (wsq_try_own(q, i, connfd)) {
+		w->nr_own++;
+		return 1;
+	}
+	wsq_unready(q, i);
+	/* the words after our own first, so thieves spread out */
+	for (k = 0; k <= q->nr_words; k++) {
+		j = (i / WORD_BITS + k) % q->nr_words;
+		word = __atomic_load_n(&q->ready[j], __ATOMIC_SEQ_CST);
+		if (k == 0)
+			word &= ~0ULL << (i % WORD_BITS);
+		else if (k == q->nr_words)
+			word &= ~(~0ULL << (i % WORD_BITS));
+		while (word) {
+			b = __builtin_ctzll(word);
+			word &= word - 1;
+			if (j * WORD_BITS + b == i)
+				continue;
+			while ((r = wsq_steal(q, j * WORD_BITS + b,
+					      connfd)) < 0)
+				w->nr_lost++;
+			if (r > 0) {
+				w->nr_stolen++;
+				return 1;
+			}
+			wsq_unready(q, j * WORD_BITS + b);
+		}
+	}
+	return 0;
+}
+
+int
+wsq_pop(struct wsq *q, int worker, int *connfd)
+{
+	struct wsq_worker *w = &q->workers[worker];
+	uint32_t event;
+	int ok;
+
+	if (__atomic_load_n(&q->stopped, __ATOMIC_ACQUIRE))
+		return 0;
+	ok = wsq_try_pop(q, worker, connfd);
+	while (!ok) {
+		event = __atomic_load_n(&w->event, __ATOMIC_SEQ_CST);
+		bit_set(q->idle, worker);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		stress_yield();
+		ok = !__atomic_load_n(&q->stopped, __ATOMIC_SEQ_CST) &&
+			wsq_try_pop(q, worker, connfd);
+		if (!ok && !__atomic_load_n(&q->stopped, __ATOMIC_SEQ_CST))
+			futex_wait(&w->event, event);
+		/* if we are no longer idle, someone woke us for a connection.
+		 * We may have taken another one, so pass the wake-up on. */
+		if (!bit_clear(q->idle, worker) && ok)
+			wsq_wake(q, worker);
+		if (!ok && __atomic_load_n(&q->stopped, __ATOMIC_ACQUIRE))
+			return 0;
+		if (!ok)
+			ok = wsq_try_pop(q, worker, connfd);
+	}
+	return 1;
+}
+
+int
+wsq_len(struct wsq *q)
+{
+	struct wsq_worker *w;
+	int64_t t, b;
+	int i, nr = 0;
+
+	for (i = 0; i < q->nr; i++) {
+		w = &q->workers[i];
+		t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+		b = __atomic_load_n(&w->bottom, __ATOMIC_ACQUIRE);
+		if (b > t)
+			nr += b - t;
+		nr += ring_len(w->inbox);
+	}
+	return nr;
+}
+
+void
+wsq_stop(struct wsq *q)
+{
+	struct wsq_worker *w;
+	int i;
+
+	__atomic_store_n(&q->stopped, 1, __ATOMIC_SEQ_CST);
+	for (i = 0; i < q->nr; i++) {
+		w = &q->workers[i];
+		__atomic_add_fetch(&w->event, 1, __ATOMIC_SEQ_CST);
+		futex_wake(&w->event, INT_MAX);
+	}
+	__atomic_add_fetch(&q->nonfull_seq, 1, __ATOMIC_SEQ_CST);
+	futex_wake(&q->nonfull_seq, INT_MAX);
+}
+
+void
+wsq_print_stats(struct wsq *q, FILE *out)
+{
+	long own = 0, stolen = 0, lost = 0;
+	int i;
+
+	for (i = 0; i < q->nr; i++) {
+		own += q->workers[i].nr_own;
+		stolen += q->workers[i].nr_stolen;
+		lost += q->workers[i].nr_lost;
+	}
+	fprintf(out, "wsq own %ld stolen %ld (%.1f%%) lost steals %ld\n",
+		own, stolen,
+		own + stolen ? 100.0 * stolen / (own + stolen) : 0.0, lost);
+}
+
+void
+wsq_destroy(struct wsq *q)
+{
+	int i;
+
+	for (i = 0; i < q->nr; i++)
+		ring_destroy(q->workers[i].inbox);
+	free(q->idle);
+	free(q->ready);
+	free(q->workers);
+	free(q);
+}
@@ -0,0 +1,59 @@
+#ifndef __WSQ_H__
+#define __WSQ_H__
+
+#include <stdio.h>
+
+/* Work-stealing queues of client connections, in place of the one request
+ * queue that all workers take from, whose head and tail every dispatch
+ * moves between all the cores. Each worker has a queue of its own, and
+ * connections are put into the queues round-robin. A worker takes from its
+ * own queue, and when it is empty steals from the others', so an idle
+ * worker takes over the connections of a busy one. Most of the time, a
+ * queue's lines are only shared by the thread that puts connections into
+ * it and the worker that takes them.
+ *
+ * A worker's queue is in two parts. Connections are put into its inbox, a
+ * ring (see ring.h), since there may be several threads putting them in,
+ * e.g., acceptors or event loops. The worker moves up to WSQ_BATCH of them
+ * at a time into its deque, a Chase-Lev deque of WSQ_DEQUE connections
+ * that only the worker pushes and pops, at the bottom, newest first.
+ * Thieves steal from the top of the deque, oldest first, with a
+ * compare-and-swap that only races with the owner over the last
+ * connection, and then from the inbox. Neither part takes a lock.
+ *
+ * Two bitmaps, of a bit per worker, keep a dispatch from looking at every
+ * worker: one of the workers asleep, and one of those whose queue may hold
+ * connections. Putting in a connection marks the queue, and wakes up its
+ * owner if it is asleep, or else another sleeping worker to steal it, if
+ * any is asleep. A worker that finds its own queue empty only tries the
+ * queues that are marked, and unmarks those it finds empty, before going
+ * to sleep on a futex of its own. Both cost a word for every 64 workers. */
+
+#define WSQ_DEQUE 16		/* a power of two */
+#define WSQ_BATCH 8		/* at most WSQ_DEQUE */
+
+struct wsq;
+
+/* a queue for each of nr_workers workers, holding about size connections
+ * in all */
+struct wsq *wsq_init(int nr_workers, int size);
+/* queues connfd, waiting while all the queues are full. Returns 0, without
+ * queueing it, once the queues are stopped. */
+int wsq_push(struct wsq *q, int connfd);
+/* wsq_push, returning 0 instead of waiting while the queues are full */
+int wsq_try_push(struct wsq *q, int connfd);
+/* takes a connection for worker into *connfd, from its own queue or another
+ * one, waiting while they are all empty. Returns 0 once the queues are
+ * stopped. */
+int wsq_pop(struct wsq *q, int worker, int *connfd);
+/* returns the number of connections queued */
+int wsq_len(struct wsq *q);
+/* wakes up, and fails, all callers of wsq_push and wsq_pop */
+void wsq_stop(struct wsq *q);
+/* prints the connections taken by workers from their own queues, those
+ * stolen, and the steals lost to another thief */
+void wsq_print_stats(struct wsq *q, FILE *out);
+/* connections still queued are left open */
+void wsq_destroy(struct wsq *q);
+
+#endif /* __WSQ_H__ */